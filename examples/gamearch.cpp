@@ -162,15 +162,27 @@ bool insertFile(ga::ArchivePtr pArchive, const std::string& strLocalFile,
 	// length (but it's ok to have a zero prefilter length if the file is empty)
 	assert(bUseFilters || (lenSource == 0) || (lenReal != 0));
 
-	// Create a new entry in the archive large enough to hold the file
+	// Add the file to the archive, writing the data in as it goes
 	ga::Archive::EntryPtr id = pArchive->insert(idBeforeThis, strArchFile,
-		lenSource, type, attr);
+		fsIn, type, attr);
 
-	// Open the new (empty) file in the archive
+	if (!bUseFilters) {
+		// Since filters were skipped we will pretend we applied the filter and
+		// we got more source data than we really did, so the file's uncompressed
+		// size gets set to the one given.
+		if (lenReal != lenSource) pArchive->resize(id, lenSource, lenReal);
+		return true;
+	}
+
+	// Unless the format wants the data filtered, we're done
+	if (id->filter.empty()) return true;
+
+	// Open the new file in the archive and write the data again, this time
+	// through the filter.
+	fsIn->seekg(0, stream::start);
 	camoto::stream::inout_sptr psNew(pArchive->open(id));
-	if (bUseFilters) applyFilter(&psNew, pArchive, id);
+	applyFilter(&psNew, pArchive, id);
 
-	// Copy all the data from the file on disk into the archive file.
 	try {
 		stream::copy(psNew, fsIn);
 		psNew->flush();
@@ -179,12 +191,6 @@ bool insertFile(ga::ArchivePtr pArchive, const std::string& strLocalFile,
 		return false;
 	}
 
-	if (!bUseFilters) {
-		// Since filters were skipped we will pretend we applied the filter and
-		// we got more source data than we really did, so the next check works.
-		lenSource = lenReal;
-	}
-
 	// If the data that went in was a different length to what we expected it
 	// must have been compressed so update the file size (keeping the original
 	// size as the 'uncompressed length' field.)
@@ -421,6 +427,9 @@ int main(int iArgC, char *cArgV[])
 		("delete,d", po::value<std::string>(),
 			"remove a file from the archive")
 
+		("compact",
+			"rewrite the archive in one pass, writing out all changes so far")
+
 		("uncompressed-size,z", po::value<int>(),
 			"[with -u only] specify the uncompressed size to use with -i")
 	;
@@ -443,6 +452,8 @@ int main(int iArgC, char *cArgV[])
 			"force open even if the archive is not in the given format")
 		("create,c",
 			"create a new archive file instead of opening an existing one")
+		("out-of-place",
+			"write changes to a new file then replace the original with it")
 	;
 
 	po::options_description poHidden("Hidden parameters");
@@ -466,6 +477,7 @@ int main(int iArgC, char *cArgV[])
 	bool bScript = false; // show output suitable for script parsing?
 	bool bForceOpen = false; // open anyway even if archive not in given format?
 	bool bCreate = false; // create a new archive?
+	bool bOutOfPlace = false; // write changes to a new file instead?
 	try {
 		po::parsed_options pa = po::parse_command_line(iArgC, cArgV, poComplete);
 
@@ -537,6 +549,8 @@ int main(int iArgC, char *cArgV[])
 				(i->string_key.compare("create") == 0)
 			) {
 				bCreate = true;
+			} else if (i->string_key.compare("out-of-place") == 0) {
+				bOutOfPlace = true;
 			}
 		}
 
@@ -699,6 +713,14 @@ finishTesting:
 			return RET_SHOWSTOPPER;
 		}
 
+		// Hold back every change so nothing reaches the original file until the
+		// new one has been written out in full.
+		if (bOutOfPlace && !pArchive->setOutOfPlace(true)) {
+			std::cerr << "Error: --out-of-place is not supported by this archive "
+				"format." << std::endl;
+			return RET_BADARGS;
+		}
+
 		// File type of inserted files defaults to empty, which means 'generic file'
 		std::string strLastFiletype;
 
@@ -775,6 +797,32 @@ finishTesting:
 				}
 				std::cout << std::endl;
 
+			} else if (i->string_key.compare("compact") == 0) {
+				std::cout << " compacting archive" << std::flush;
+				if (bOutOfPlace) {
+					// The whole archive will be rewritten at the end anyway
+					std::cout << " [skipped; --out-of-place already rewrites the archive]";
+				} else {
+					// Write the compacted archive next to the original, and only
+					// replace the original once it has been written out in full.
+					std::string strNewFilename = strFilename + ".new";
+					try {
+						stream::file_sptr psNew(new stream::file());
+						psNew->create(strNewFilename);
+						pArchive->compact(psNew);
+						fs::rename(strNewFilename, strFilename);
+					} catch (const stream::error& e) {
+						std::cout << " [failed; " << e.what() << "]";
+						iRet = RET_UNCOMMON_FAILURE; // some files failed, but not in a usual way
+						boost::system::error_code ec;
+						fs::remove(strNewFilename, ec);
+					} catch (const fs::filesystem_error& e) {
+						std::cout << " [failed; " << e.what() << "]";
+						iRet = RET_UNCOMMON_FAILURE; // some files failed, but not in a usual way
+					}
+				}
+				std::cout << std::endl;
+
 			} else if (i->string_key.compare("insert") == 0) {
 				std::string strSource, strInsertBefore;
 				if (!split(i->value[0], ':', &strSource, &strInsertBefore)) {
@@ -976,7 +1024,30 @@ finishTesting:
 				// else it's the archive filename, but we already have that
 			}
 		} // for (all command line elements)
-		pArchive->flush();
+		if (bOutOfPlace) {
+			// Write the new archive next to the original, and only replace the
+			// original once it has been written out in full.
+			std::string strNewFilename = strFilename + ".new";
+			try {
+				stream::file_sptr psNew(new stream::file());
+				psNew->create(strNewFilename);
+				pArchive->flushTo(psNew);
+				fs::rename(strNewFilename, strFilename);
+			} catch (const stream::error& e) {
+				std::cerr << "Error writing " << strNewFilename << ": " << e.what()
+					<< "\nThe original archive has not been changed." << std::endl;
+				// Don't leave a half-written archive lying around
+				boost::system::error_code ec;
+				fs::remove(strNewFilename, ec);
+				return RET_SHOWSTOPPER;
+			} catch (const fs::filesystem_error& e) {
+				std::cerr << "Error replacing " << strFilename << " with "
+					<< strNewFilename << ": " << e.what() << std::endl;
+				return RET_SHOWSTOPPER;
+			}
+		} else {
+			pArchive->flush();
+		}
 	} catch (const po::unknown_option& e) {
 		std::cerr << PROGNAME ": " << e.what()
 			<< ".  Use --help for help." << std::endl;
@@ -237,7 +237,9 @@ class Archive: virtual public Metadata {
 		 *   immediately affect the archive file.  When the time comes to
 		 *   flush() the changes, all the insert/delete/resize operations are
 		 *   done in a single pass.  However providing this class is the sole
-		 *   method of accessing the archive file, this is of no concern.
+		 *   method of accessing the archive file, this is of no concern.  When
+		 *   making many changes at once, group them with beginTransaction() so
+		 *   the FAT is only rewritten once.
 		 *
 		 * @post Existing EntryPtrs become invalid.  Any open files remain valid.
 		 *
@@ -273,13 +275,52 @@ class Archive: virtual public Metadata {
 			const std::string& strFilename, stream::pos storedSize, std::string type,
 			int attr) = 0;
 
+		/// Insert a new file into the archive, taking its content from a stream.
+		/**
+		 * This works like the other insert(), except the new file is made large
+		 * enough to hold the rest of src (from its current read position to the
+		 * end) and that data is written into the archive as the file is added.
+		 * This saves opening the new file and copying the data in afterwards,
+		 * which would write it twice.
+		 *
+		 * @param idBeforeThis
+		 *   The new file will be inserted before this one.  If it is not valid,
+		 *   the new file will be last in the archive.
+		 *
+		 * @param strFilename
+		 *   Filename of the new file.
+		 *
+		 * @param src
+		 *   Data to store in the new file.  It is written as-is, so if the
+		 *   returned EntryPtr has a filter set, src must already have been
+		 *   passed through that filter.
+		 *
+		 * @param type
+		 *   MIME-like file type, or empty string for generic file.  See
+		 *   FileEntry::type.
+		 *
+		 * @param attr
+		 *   File attributes (one or more E_ATTRIBUTEs)
+		 *
+		 * @return An EntryPtr to the newly added file.
+		 *
+		 * @note Note to archive format implementors: There is a default
+		 *   implementation of this function which calls the other insert() and
+		 *   then copies the data in through open().
+		 */
+		virtual EntryPtr insert(const EntryPtr idBeforeThis,
+			const std::string& strFilename, stream::input_sptr src, std::string type,
+			int attr);
+
 		/// Delete the given entry from the archive.
 		/**
 		 * @note For performance reasons, this operation is cached so it does not
 		 *   immediately affect the archive file.  When the time comes to
 		 *   flush() the changes, all the insert/delete/resize operations are
 		 *   done in a single pass.  However providing this class is the sole
-		 *   method of accessing the archive file, this is of no concern.
+		 *   method of accessing the archive file, this is of no concern.  When
+		 *   making many changes at once, group them with beginTransaction() so
+		 *   the FAT is only rewritten once.
 		 *
 		 * @param id
 		 *   The file to delete.
@@ -324,7 +365,9 @@ class Archive: virtual public Metadata {
 		 *   immediately affect the archive file.  When the time comes to flush()
 		 *   the changes, all the insert/delete/resize operations are done in a
 		 *   single pass.  However providing this class is the sole method of
-		 *   accessing the archive file stream, this is of no concern.
+		 *   accessing the archive file stream, this is of no concern.  When
+		 *   making many changes at once, group them with beginTransaction() so
+		 *   the FAT is only rewritten once.
 		 *
 		 * @param id
 		 *   File to resize.
@@ -370,6 +413,230 @@ class Archive: virtual public Metadata {
 		 */
 		virtual void flush() = 0;
 
+		/// Write out all changes by rewriting the whole archive into a new stream.
+		/**
+		 * This is an alternative to flush() for when a lot of changes have been
+		 * made.  Rather than moving data around inside the archive file to make
+		 * room for each change, the final archive is written out in order into
+		 * dest (FAT first, then each file's data) in a single sequential pass,
+		 * leaving out any gaps between files.  From then on the archive carries
+		 * on using dest, like flushTo().
+		 *
+		 * The original stream is only read from, so it stays intact if anything
+		 * goes wrong.  To compact a file on disk, write to a new file alongside
+		 * it and then rename that over the original.
+		 *
+		 * Note to archive format implementors: There is a default implementation
+		 * of this function which calls flushTo().
+		 *
+		 * @param dest
+		 *   Stream to write the compacted archive into.  Any existing content is
+		 *   replaced.  It must not be the stream the archive was opened with.
+		 *
+		 * @pre No transaction is in progress.
+		 *
+		 * @throws stream::error on I/O error, or if the archive format does not
+		 *   support this.
+		 */
+		virtual void compact(stream::inout_sptr dest);
+
+		/// Write out all changes to a new stream instead of the original.
+		/**
+		 * The complete archive, including all changes made so far, is written
+		 * sequentially into dest.  From then on the archive carries on using
+		 * dest, so a later flush() will write to dest as well.
+		 *
+		 * Changes may already have reached the original stream before this is
+		 * called, unless setOutOfPlace() was used to hold them all back.
+		 *
+		 * Note to archive format implementors: There is a default implementation
+		 * of this function which throws an exception.
+		 *
+		 * @param dest
+		 *   Stream to write the new archive into.  Any existing content is
+		 *   replaced.  It must not be the stream the archive was opened with.
+		 *
+		 * @pre No transaction is in progress.
+		 *
+		 * @throws stream::error on I/O error, or if the archive format does not
+		 *   support this.
+		 */
+		virtual void flushTo(stream::inout_sptr dest);
+
+		/// Leave the original stream untouched until flushTo() is called.
+		/**
+		 * Normally changes are written into the stream the archive was opened
+		 * with as they are made, or when flush() is called.  In out-of-place
+		 * mode that stream is only ever read from.  Every change, including data
+		 * written into files opened with open(), is kept in memory on top of the
+		 * original data, and flush() writes nothing out.  flushTo() or compact()
+		 * then write the complete archive into a new stream, and the archive
+		 * carries on in out-of-place mode on top of that.
+		 *
+		 * This allows the caller to write a new file alongside the original and
+		 * then rename it over the top, so programs reading the original never
+		 * see a partially modified archive, and the original is left intact if
+		 * anything goes wrong.
+		 *
+		 * Memory is used for all the data written until the archive is written
+		 * out.  Supplementary data such as an external FAT lives in a separate
+		 * stream and is still updated in place.
+		 *
+		 * Note to archive format implementors: There is a default implementation
+		 * of this function which only supports writing changes in place.
+		 *
+		 * @param outOfPlace
+		 *   true to hold back all changes, false to go back to writing them into
+		 *   the original stream, starting with those held back so far.
+		 *
+		 * @return true if the requested mode is now in use, false if the archive
+		 *   format does not support it.
+		 *
+		 * @pre No transaction is in progress.
+		 */
+		virtual bool setOutOfPlace(bool outOfPlace);
+
+		/// Allow files to be stored out of order with gaps between them.
+		/**
+		 * Some formats store the offset of every file in the FAT, so the files
+		 * do not have to be packed together one after the other.  With a sparse
+		 * layout enabled on one of these formats, removing a file leaves a gap
+		 * instead of moving every following file back to fill it.  Files that
+		 * are inserted or enlarged grow into any unused space directly after
+		 * them, or are placed into the smallest gap they will fit in, and are
+		 * only added to the end of the archive if there is nowhere else for
+		 * them to go.  Resaving a file then takes time proportional to the size
+		 * of the file rather than the size of the archive.
+		 *
+		 * Gaps are removed by compact() and flushTo().  The default is a packed
+		 * layout, which produces the same output as the game's own tools.
+		 *
+		 * Note to archive format implementors: There is a default implementation
+		 * of this function which only supports a packed layout.
+		 *
+		 * @param sparse
+		 *   true to allow gaps, false to go back to keeping files packed together
+		 *   (any gaps already present will remain until compact() is called.)
+		 *
+		 * @return true if the requested layout is now in use, false if the
+		 *   archive format does not support it.
+		 *
+		 * @pre No transaction is in progress.
+		 */
+		virtual bool setSparseLayout(bool sparse);
+
+		/// Store files with identical content only once.
+		/**
+		 * Formats that store an offset and size for every file can have several
+		 * FAT entries pointing at the same data.  With deduplication enabled,
+		 * files added with insert(idBeforeThis, strFilename, src, type, attr)
+		 * are compared against the files already in the archive, and if one
+		 * has the same content the new file shares its data instead of being
+		 * given a copy.  Writing to or resizing a file that shares its data
+		 * gives it its own copy first, so the other files are unaffected.
+		 *
+		 * This needs a sparse layout, which is enabled along with it.  Files
+		 * that already share the same data when this is enabled (e.g. in an
+		 * archive saved with deduplication earlier) are recognised as such.
+		 * Deduplication should always be enabled before changing an archive
+		 * like this, otherwise removing or resizing one of the files will also
+		 * affect the others.
+		 *
+		 * Note to archive format implementors: There is a default implementation
+		 * of this function which does not support deduplication.
+		 *
+		 * @param dedup
+		 *   true to share data between identical files, false to stop looking
+		 *   for new duplicates (files already sharing data will continue to do
+		 *   so until they are changed.)
+		 *
+		 * @return true if the requested mode is now in use, false if the
+		 *   archive format does not support it.
+		 *
+		 * @pre No transaction is in progress.
+		 */
+		virtual bool setDeduplication(bool dedup);
+
+		/// Get the amount of space saved by sharing data between files.
+		/**
+		 * @return The number of bytes that would be needed to give every file
+		 *   that currently shares its data with another file its own copy.
+		 *   Always 0 unless setDeduplication() has been enabled.
+		 */
+		virtual stream::len getDeduplicatedSize() const;
+
+		/// Hold back FAT updates until flush() for formats with the FAT at the end.
+		/**
+		 * Some formats store their FAT after all the file data, so every file
+		 * added to the end of the archive, or enlarged at the end, has to move
+		 * the FAT along to make room.  With this enabled the FAT is taken out
+		 * of the archive while it is open and the new data simply appended,
+		 * then the whole FAT is written once, after the last file, each time
+		 * the archive is flush()ed.  Adding N files then costs about the size
+		 * of their data rather than N moves of the FAT.
+		 *
+		 * The file written out is identical to the one produced without this
+		 * option.
+		 *
+		 * Note to archive format implementors: There is a default
+		 * implementation of this function which keeps the FAT up to date as
+		 * each change is made.
+		 *
+		 * @param defer
+		 *   true to hold back the FAT, false to put it back in the archive
+		 *   straight away.
+		 *
+		 * @return true if the requested mode is now in use, false if the
+		 *   archive format does not support it.
+		 *
+		 * @pre No transaction is in progress.
+		 */
+		virtual bool setDeferredFAT(bool defer);
+
+		/// Start grouping changes together.
+		/**
+		 * All insert(), remove(), rename(), move() and resize() calls made after
+		 * this function, and any data written into open files, are recorded
+		 * in memory against the archive's existing layout without changing it.
+		 * Updates to the FAT that only result from files moving around are held
+		 * back as well.  commitTransaction() then applies the final layout in
+		 * one pass, so bulk edits rewrite each FAT entry and move each byte of
+		 * file data once, instead of once per operation.
+		 *
+		 * Data written during a transaction is held in memory until it is
+		 * committed, so large files are best written afterwards.
+		 *
+		 * flush() must not be called while a transaction is in progress.
+		 *
+		 * Note to archive format implementors: There is a default implementation
+		 * of the three transaction functions which applies changes immediately,
+		 * commits by calling flush(), and cannot abort.
+		 *
+		 * @pre No transaction is already in progress.
+		 */
+		virtual void beginTransaction();
+
+		/// Write out all changes made since beginTransaction().
+		/**
+		 * The final layout is calculated from the in-memory state, the FAT is
+		 * updated and the archive is flush()ed.
+		 *
+		 * @throws stream::error on I/O error.
+		 */
+		virtual void commitTransaction();
+
+		/// Undo all changes made since beginTransaction().
+		/**
+		 * The recorded changes are thrown away, leaving the archive data as it
+		 * was, including anything written into open files.  Files that were
+		 * removed get new FAT entries, so any EntryPtrs to them will remain
+		 * invalid and getFileList() should be used to obtain the new ones.
+		 *
+		 * @throws stream::error on I/O error, or if the archive format does not
+		 *   support rolling back changes.
+		 */
+		virtual void abortTransaction();
+
 		/// Find out which attributes can be set on files in this archive.
 		/**
 		 * If an attribute is not returned by this function, that attribute must
@@ -103,6 +103,90 @@ class ArchiveType
 		virtual ArchivePtr newArchive(stream::inout_sptr psArchive,
 			SuppData& suppData) const = 0;
 
+		/// A file to add to a new archive with build().
+		struct BuildEntry {
+			/// Filename of the new file.
+			std::string name;
+
+			/// MIME-like file type, or empty string for generic file.  See
+			/// Archive::FileEntry::type.
+			std::string type;
+
+			/// File attributes (one or more E_ATTRIBUTEs)
+			int attr;
+
+			/// Size of the file once unfiltered, if attr includes EA_COMPRESSED.
+			/**
+			 * Ignored for files that aren't compressed, as the size of the data in
+			 * src is used instead.
+			 */
+			stream::len realSize;
+
+			/// Content of the file.
+			/**
+			 * Everything from the current read position to the end of the stream
+			 * is stored as-is.  If the format filters this type of file (e.g.
+			 * encryption or compression) the data must already be filtered.
+			 */
+			stream::input_sptr src;
+		};
+
+		/// List of files to add to a new archive.
+		typedef std::vector<BuildEntry> BuildList;
+
+		/// Metadata values to give a new archive in build().
+		typedef std::map<Metadata::MetadataType, std::string> BuildMetadata;
+
+		/// Create a new archive in this format containing the given files.
+		/**
+		 * This produces the same result as calling newArchive(), setting each
+		 * metadata item and then inserting each file at the end, but without
+		 * moving any file data to make room for FAT entries added later.
+		 *
+		 * Formats with a simple fixed-length FAT (such as GRP, WAD, VOL and
+		 * LIB) work out the final layout up front and write the header, FAT and
+		 * file data to psArchive strictly in order, from start to finish.  These
+		 * formats store only a name and size or offset for each file, so a file
+		 * with a type or attributes is rejected.  (insert() would accept it, but
+		 * the type and attributes would be gone when the archive was reopened.)
+		 *
+		 * Note to format implementors: There is a default implementation of this
+		 * function which works for any format, using newArchive() and
+		 * Archive::beginTransaction().  It builds the archive in psArchive with
+		 * the usual insert and resize calls, so it is not sequential, and (like
+		 * any other change) the archive is held in memory until it is flushed.
+		 * Override this function to write a format's layout directly.  An
+		 * override must reject any file type or attribute that the format has
+		 * nowhere to store, rather than silently leaving it out.
+		 *
+		 * @param psArchive
+		 *   Stream to store the new archive in.  Any existing content is
+		 *   replaced, and the stream is truncated to the archive's length.
+		 *   Supplemental streams in suppData are written in the same way as by
+		 *   newArchive().
+		 *
+		 * @param suppData
+		 *   Any supplemental data required by this format (see getRequiredSupps()).
+		 *
+		 * @param files
+		 *   Files to put in the archive, in order.
+		 *
+		 * @param metadata
+		 *   Metadata to set on the new archive.  Items are set before any files
+		 *   are added, so values that affect how files are stored (such as the
+		 *   Blood RFF version) apply to every file.
+		 *
+		 * @return A pointer to an instance of the Archive class, just as if the
+		 *   new file had been opened by open().
+		 *
+		 * @throws stream::error if a file could not be added, e.g. because its
+		 *   name is too long for the format, or if a metadata item is not
+		 *   supported.  Formats that write their layout directly also throw if a
+		 *   file has a type or attributes they cannot store.
+		 */
+		virtual ArchivePtr build(stream::inout_sptr psArchive, SuppData& suppData,
+			const BuildList& files, const BuildMetadata& metadata) const;
+
 		/// Open an archive file.
 		/**
 		 * @pre Recommended that isInstance() has returned > DefinitelyNo.
@@ -122,6 +206,43 @@ class ArchiveType
 		virtual ArchivePtr open(stream::inout_sptr psArchive, SuppData& suppData)
 			const = 0;
 
+		/// Open an archive file, using a cached copy of its file list if possible.
+		/**
+		 * Some formats have no central FAT, so listing the archive means reading
+		 * the header in front of every file.  This function lets the caller keep
+		 * the resulting file list in a small sidecar stream, so that the next
+		 * time the same archive is opened only the sidecar needs to be read.
+		 *
+		 * The index is only used if it was written for an archive of the same
+		 * size, the same stamp, and matching data at the start and end of the
+		 * archive.  Otherwise the archive is read as usual and the index is
+		 * rewritten.  The index is emptied when the archive is flushed, as the
+		 * archive will have a new stamp once it has been written to.
+		 *
+		 * Note to format implementors: There is a default implementation of this
+		 * function which ignores the index and calls open().  Only formats that
+		 * would otherwise have to walk through the whole archive need to
+		 * override it.
+		 *
+		 * @param psArchive
+		 *   The archive file to read.
+		 *
+		 * @param suppData
+		 *   Any supplemental data required by this format (see getRequiredSupps()).
+		 *
+		 * @param index
+		 *   Stream holding the cached index.  It can be empty, in which case it
+		 *   will be filled in.  Only this library should write to it.
+		 *
+		 * @param stamp
+		 *   Any value that changes when the archive file is changed by something
+		 *   other than this library, typically the file's last-modified time.
+		 *
+		 * @return A pointer to an instance of the Archive class, as for open().
+		 */
+		virtual ArchivePtr openIndexed(stream::inout_sptr psArchive,
+			SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const;
+
 		/// Get a list of any required supplemental files.
 		/**
 		 * For some archive formats, data is stored externally to the archive file
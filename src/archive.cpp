@@ -19,12 +19,113 @@
  */
 
 #include <boost/iostreams/copy.hpp>
+#include <camoto/util.hpp>
 #include <camoto/gamearchive/archivetype.hpp>
 #include <camoto/gamearchive/archive.hpp>
+#include "archivebuild.hpp"
 
 namespace camoto {
 namespace gamearchive {
 
+ArchivePtr ArchiveType::build(stream::inout_sptr psArchive,
+	SuppData& suppData, const BuildList& files,
+	const BuildMetadata& metadata) const
+{
+	// TESTED BY: test_archive::test_new_build
+	// Don't leave anything behind from a longer stream
+	psArchive->truncate(0);
+	ArchivePtr arch = this->newArchive(psArchive, suppData);
+
+	for (BuildMetadata::const_iterator
+		i = metadata.begin(); i != metadata.end(); i++
+	) {
+		arch->setMetadata(i->first, i->second);
+	}
+
+	// Add every file while they are all empty, so growing the FAT doesn't have
+	// to move any file data.  The transaction means the files after each one
+	// don't have their FAT entries rewritten every time a file is enlarged.
+	std::vector<stream::len> lenData;
+	Archive::VC_ENTRYPTR ids;
+	arch->beginTransaction();
+	for (BuildList::const_iterator i = files.begin(); i != files.end(); i++) {
+		lenData.push_back(i->src->size() - i->src->tellg());
+		ids.push_back(arch->insert(Archive::EntryPtr(), i->name, 0, i->type,
+			i->attr));
+	}
+	for (unsigned int i = 0; i < files.size(); i++) {
+		stream::len lenReal = (files[i].attr & EA_COMPRESSED)
+			? files[i].realSize : lenData[i];
+		arch->resize(ids[i], lenData[i], lenReal);
+	}
+	arch->commitTransaction();
+
+	// Everything is in its final place now, so fill in the data
+	for (unsigned int i = 0; i < files.size(); i++) {
+		stream::inout_sptr dest = arch->open(ids[i]);
+		stream::copy(dest, files[i].src);
+		dest->flush();
+	}
+	arch->flush();
+	return arch;
+}
+
+stream::len measureBuildList(const ArchiveType::BuildList& files,
+	unsigned int lenMaxFilename, unsigned int maxFiles,
+	std::vector<stream::len> *lenData)
+{
+	if (files.size() > maxFiles) {
+		throw stream::error(createString("too many files, maximum is "
+			<< maxFiles));
+	}
+	stream::len lenTotal = 0;
+	lenData->clear();
+	for (ArchiveType::BuildList::const_iterator
+		i = files.begin(); i != files.end(); i++
+	) {
+		if (i->name.length() > lenMaxFilename) {
+			throw stream::error(createString("maximum filename length is "
+				<< lenMaxFilename << " chars"));
+		}
+		// Don't quietly lose anything the caller expects to be stored
+		if (!i->type.empty()) {
+			throw stream::error(createString("this archive format cannot store "
+				"file types, as given for " << i->name));
+		}
+		if (i->attr != EA_NONE) {
+			throw stream::error(createString("this archive format cannot store "
+				"file attributes, as given for " << i->name));
+		}
+		stream::len len = i->src->size() - i->src->tellg();
+		lenData->push_back(len);
+		lenTotal += len;
+	}
+	return lenTotal;
+}
+
+void writeBuild(stream::output_sptr psArchive,
+	const std::vector<uint8_t>& head, const ArchiveType::BuildList& files,
+	stream::len lenData)
+{
+	psArchive->seekp(0, stream::start);
+	if (!head.empty()) psArchive->write(&head[0], head.size());
+	for (ArchiveType::BuildList::const_iterator
+		i = files.begin(); i != files.end(); i++
+	) {
+		stream::copy(psArchive, i->src);
+	}
+	psArchive->truncate(head.size() + lenData);
+	psArchive->flush();
+	return;
+}
+
+ArchivePtr ArchiveType::openIndexed(stream::inout_sptr psArchive,
+	SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const
+{
+	// Reading the FAT is already cheap, so there's nothing worth caching
+	return this->open(psArchive, suppData);
+}
+
 Archive::FileEntry::FileEntry()
 {
 }
@@ -45,5 +146,77 @@ std::string Archive::FileEntry::getContent() const
 	return ss.str();
 }
 
+Archive::EntryPtr Archive::insert(const EntryPtr idBeforeThis,
+	const std::string& strFilename, stream::input_sptr src, std::string type,
+	int attr)
+{
+	stream::len lenData = src->size() - src->tellg();
+	EntryPtr id = this->insert(idBeforeThis, strFilename, lenData, type, attr);
+
+	// Fill the new file in through a substream
+	stream::inout_sptr dest = this->open(id);
+	stream::copy(dest, src);
+	dest->flush();
+	return id;
+}
+
+void Archive::compact(stream::inout_sptr dest)
+{
+	// No layout to squeeze by default, so this is just a rewrite
+	this->flushTo(dest);
+	return;
+}
+
+void Archive::flushTo(stream::inout_sptr dest)
+{
+	throw stream::error("This archive format cannot be written to a new file.");
+}
+
+bool Archive::setOutOfPlace(bool outOfPlace)
+{
+	// Changes are written into the original stream by default
+	return !outOfPlace;
+}
+
+bool Archive::setSparseLayout(bool sparse)
+{
+	// Only a packed layout is supported by default
+	return !sparse;
+}
+
+bool Archive::setDeduplication(bool dedup)
+{
+	// Every file has its own copy of its data by default
+	return !dedup;
+}
+
+stream::len Archive::getDeduplicatedSize() const
+{
+	return 0;
+}
+
+bool Archive::setDeferredFAT(bool defer)
+{
+	// The FAT is kept up to date as changes are made by default
+	return !defer;
+}
+
+void Archive::beginTransaction()
+{
+	// No-op default, changes are applied as they are made
+	return;
+}
+
+void Archive::commitTransaction()
+{
+	this->flush();
+	return;
+}
+
+void Archive::abortTransaction()
+{
+	throw stream::error("This archive format cannot roll back changes.");
+}
+
 } // namespace gamearchive
 } // namespace camoto
@@ -0,0 +1,85 @@
+/**
+ * @file  archivebuild.hpp
+ * @brief Helper functions for formats that write ArchiveType::build() output
+ *        directly.
+ *
+ * Copyright (C) 2010-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_ARCHIVEBUILD_HPP_
+#define _CAMOTO_ARCHIVEBUILD_HPP_
+
+#include <vector>
+#include <stdint.h>
+#include <camoto/stream.hpp>
+#include <camoto/gamearchive/archivetype.hpp>
+
+namespace camoto {
+namespace gamearchive {
+
+/// Check the files passed to ArchiveType::build() and measure their data.
+/**
+ * For formats that override build() to write their layout directly, and which
+ * only store a name and the position of each file.  Any file with a type or
+ * attributes is rejected, as the format would have nowhere to put them.
+ *
+ * @param files
+ *   Files passed to build().
+ *
+ * @param lenMaxFilename
+ *   Longest filename the format can store.
+ *
+ * @param maxFiles
+ *   Most files the format can store.
+ *
+ * @param lenData
+ *   On return, the number of bytes to copy from each file's source stream.
+ *
+ * @return Total length of all the file data.
+ *
+ * @throws stream::error if there are too many files, a name is too long, or a
+ *   file has a type or attributes, in which case nothing has been written.
+ */
+stream::len measureBuildList(const ArchiveType::BuildList& files,
+	unsigned int lenMaxFilename, unsigned int maxFiles,
+	std::vector<stream::len> *lenData);
+
+/// Write out an archive whose header and FAT have been built in memory.
+/**
+ * The header and FAT are written first, followed by the data of each file in
+ * order, so the stream is only ever written sequentially.  It is then
+ * truncated to end after the last file.
+ *
+ * @param psArchive
+ *   Stream passed to build().
+ *
+ * @param head
+ *   Everything in the archive before the first file's data.
+ *
+ * @param files
+ *   Files passed to build().
+ *
+ * @param lenData
+ *   Total length of all the file data, as returned by measureBuildList().
+ */
+void writeBuild(stream::output_sptr psArchive,
+	const std::vector<uint8_t>& head, const ArchiveType::BuildList& files,
+	stream::len lenData);
+
+} // namespace gamearchive
+} // namespace camoto
+
+#endif // _CAMOTO_ARCHIVEBUILD_HPP_
@@ -18,491 +18,3135 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h> // memcmp, memcpy, memset
 #include <boost/bind.hpp>
 #include <boost/algorithm/string.hpp>
+#include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp> // createString
 
 #include "fatarchive.hpp"
+#include "fatschema.hpp"
+
+/// Pending writes this close together are joined into a single write, by
+/// reading in the bytes between them.
+#define FAT_WRITE_GAP 512
+
+/// Signature at the start of a sidecar index written by saveIndex().
+#define FAT_INDEX_SIG         "Camoto index"
+#define FAT_INDEX_SIG_LEN     12
+
+/// Change this whenever the index layout changes, so old ones are ignored.
+#define FAT_INDEX_VERSION     1
+
+/// Number of bytes from each end of the archive hashed into the index.
+#define FAT_INDEX_SAMPLE_LEN  512
 
 namespace camoto {
 namespace gamearchive {
 
-FATArchive::FATEntry::FATEntry()
+/// Convert a filename into the key used by the filename index.
+static inline std::string nameIndexKey(const std::string& name)
 {
+	return boost::to_upper_copy(name);
 }
-FATArchive::FATEntry::~FATEntry()
+
+/// Node in the offset tree.
+struct FATArchive::OffsetNode {
+	FATEntry *entry;         ///< Entry at this position
+	OffsetNode *left;        ///< Entries before this one
+	OffsetNode *right;       ///< Entries after this one
+	OffsetNode *parent;      ///< NULL for the root node
+	unsigned long priority;  ///< Random heap priority to keep the tree balanced
+	unsigned int count;      ///< Number of nodes in this subtree
+
+	/// Offset change not yet applied to this node or any below it.
+	stream::delta offDelta;
+
+	/// Index change not yet applied to this node or any below it.
+	int indexDelta;
+
+	/// True if there is unused space between this entry and the next.
+	bool hasGap;
+
+	/// Where that space is listed in gapIndex, if hasGap is true.
+	FATArchive::GAP_INDEX::iterator gap;
+};
+
+typedef FATArchive::OffsetNode OffsetNode;
+
+/// Number of nodes in the given subtree.
+static inline unsigned int nodeCount(const OffsetNode *n)
 {
+	return n ? n->count : 0;
 }
-std::string FATArchive::FATEntry::getContent() const
+
+/// Apply a node's pending deltas to its entry, and pass them on to its
+/// children.
+static inline void pushNode(OffsetNode *n)
 {
-	std::ostringstream ss;
-	ss << this->FileEntry::getContent()
-		<< ";fatindex=" << iIndex
-		<< ";offset=" << iOffset
-		<< ";header=" << lenHeader
-	;
-	return ss.str();
+	if ((n->offDelta == 0) && (n->indexDelta == 0)) return;
+	n->entry->iOffset += n->offDelta;
+	n->entry->iIndex += n->indexDelta;
+	if (n->left) {
+		n->left->offDelta += n->offDelta;
+		n->left->indexDelta += n->indexDelta;
+	}
+	if (n->right) {
+		n->right->offDelta += n->offDelta;
+		n->right->indexDelta += n->indexDelta;
+	}
+	n->offDelta = 0;
+	n->indexDelta = 0;
+	return;
 }
 
-Archive::EntryPtr getFileAt(const Archive::VC_ENTRYPTR& files, unsigned int index)
+/// Recalculate a node's count and point its children back at it.
+static inline void updateNode(OffsetNode *n)
 {
-	for (Archive::VC_ENTRYPTR::const_iterator i = files.begin(); i != files.end(); i++) {
-		FATArchive::FATEntry *pEntry = dynamic_cast<FATArchive::FATEntry *>(i->get());
-		if (pEntry->iIndex == index) return *i;
+	n->count = 1 + nodeCount(n->left) + nodeCount(n->right);
+	if (n->left) n->left->parent = n;
+	if (n->right) n->right->parent = n;
+	return;
+}
+
+/// Join two trees, where every node in a comes before every node in b.
+static OffsetNode *mergeNodes(OffsetNode *a, OffsetNode *b)
+{
+	if (!a) return b;
+	if (!b) return a;
+	if (a->priority > b->priority) {
+		pushNode(a);
+		a->right = mergeNodes(a->right, b);
+		updateNode(a);
+		return a;
 	}
-	return Archive::EntryPtr();
+	pushNode(b);
+	b->left = mergeNodes(a, b->left);
+	updateNode(b);
+	return b;
 }
 
-FATArchive::FATArchive(stream::inout_sptr psArchive, stream::pos offFirstFile,
-	int lenMaxFilename)
-	:	psArchive(new stream::seg()),
-		offFirstFile(offFirstFile),
-		lenMaxFilename(lenMaxFilename)
+/// Split a tree so the first k nodes end up in *l and the rest in *r.
+static void splitNodes(OffsetNode *n, unsigned int k, OffsetNode **l,
+	OffsetNode **r)
 {
-	assert(psArchive);
+	if (!n) {
+		*l = *r = NULL;
+		return;
+	}
+	pushNode(n);
+	if (k <= nodeCount(n->left)) {
+		splitNodes(n->left, k, l, &n->left);
+		updateNode(n);
+		*r = n;
+	} else {
+		splitNodes(n->right, k - nodeCount(n->left) - 1, &n->right, r);
+		updateNode(n);
+		*l = n;
+	}
+	if (*l) (*l)->parent = NULL;
+	if (*r) (*r)->parent = NULL;
+	return;
+}
 
-	this->psArchive->open(psArchive);
+/// Apply all deltas pending above and at this node, so its entry is current.
+static void pushPath(OffsetNode *n)
+{
+	if (n->parent) pushPath(n->parent);
+	pushNode(n);
+	return;
 }
 
-FATArchive::~FATArchive()
+/// Apply every pending delta in the subtree.
+static void pushAll(OffsetNode *n)
 {
-	// Can't flush here as it could throw stream::error and we have no way
-	// of handling it.
-	//this->flush(); // make sure it saves on close just in case
+	if (!n) return;
+	pushNode(n);
+	pushAll(n->left);
+	pushAll(n->right);
+	return;
 }
 
-const FATArchive::VC_ENTRYPTR& FATArchive::getFileList() const
+/// Get the position of a node in the tree (number of nodes before it.)
+static unsigned int nodeRank(const OffsetNode *n)
 {
-	return this->vcFAT;
+	unsigned int rank = nodeCount(n->left);
+	for (const OffsetNode *p = n; p->parent; p = p->parent) {
+		if (p == p->parent->right) rank += nodeCount(p->parent->left) + 1;
+	}
+	return rank;
 }
 
-FATArchive::EntryPtr FATArchive::find(const std::string& strFilename) const
+/// Get the next node in offset order, or NULL if n is the last one.
+static OffsetNode *nextNode(OffsetNode *n)
 {
-	// TESTED BY: fmt_grp_duke3d_*
-	for (VC_ENTRYPTR::const_iterator i = this->vcFAT.begin();
-		i != this->vcFAT.end();
-		i++
-	) {
-		const FATEntry *pFAT = dynamic_cast<const FATEntry *>(i->get());
-		if (boost::iequals(pFAT->strName, strFilename)) {
-			return *i;  // *i is the original shared_ptr
+	if (n->right) {
+		n = n->right;
+		while (n->left) n = n->left;
+		return n;
+	}
+	while ((n->parent) && (n == n->parent->right)) n = n->parent;
+	return n->parent;
+}
+
+/// Get the previous node in offset order, or NULL if n is the first one.
+static OffsetNode *prevNode(OffsetNode *n)
+{
+	if (n->left) {
+		n = n->left;
+		while (n->right) n = n->right;
+		return n;
+	}
+	while ((n->parent) && (n == n->parent->left)) n = n->parent;
+	return n->parent;
+}
+
+/// Get the number of nodes whose entry is at an offset before off.
+static unsigned int countBefore(OffsetNode *n, stream::pos off)
+{
+	unsigned int rank = 0;
+	while (n) {
+		pushNode(n);
+		if (n->entry->iOffset < off) {
+			rank += nodeCount(n->left) + 1;
+			n = n->right;
+		} else {
+			n = n->left;
 		}
 	}
-	return EntryPtr();
+	return rank;
 }
 
-bool FATArchive::isValid(const EntryPtr id) const
+/// Add a delta to every node from position first onwards.
+static void addFrom(OffsetNode *n, unsigned int first, stream::delta offDelta,
+	int indexDelta)
 {
-	const FATEntry *id2 = dynamic_cast<const FATEntry *>(id.get());
-	return ((id2) && (id2->bValid));
+	while (n) {
+		unsigned int lenLeft = nodeCount(n->left);
+		if (first <= lenLeft) {
+			// This node and everything to its right are affected
+			n->entry->iOffset += offDelta;
+			n->entry->iIndex += indexDelta;
+			if (n->right) {
+				n->right->offDelta += offDelta;
+				n->right->indexDelta += indexDelta;
+			}
+			n = n->left;
+		} else {
+			first -= lenLeft + 1;
+			n = n->right;
+		}
+	}
+	return;
 }
 
-stream::inout_sptr FATArchive::open(const EntryPtr id)
+/// Get the node at the given position.
+static OffsetNode *nodeAt(OffsetNode *n, unsigned int rank)
 {
-	// TESTED BY: fmt_grp_duke3d_open
+	while (n) {
+		unsigned int lenLeft = nodeCount(n->left);
+		if (rank < lenLeft) {
+			n = n->left;
+		} else if (rank == lenLeft) {
+			return n;
+		} else {
+			rank -= lenLeft + 1;
+			n = n->right;
+		}
+	}
+	return NULL;
+}
 
-	// Make sure we're not trying to open a folder as a file
-	//assert((id->fAttr & EA_FOLDER) == 0);
-	// We can't do this because some folder formats have their FAT and
-	// everything stored as a "file" in the parent archive, so the subfolder
-	// code opens this file (even though it's flagged as a folder) and then
-	// passes the data to the Archive.
+/// Bring every entry from position first onwards up to date and append them
+/// to out, in offset order.
+static void collectFrom(OffsetNode *n, unsigned int first,
+	std::vector<FATArchive::FATEntry *> *out)
+{
+	if (!n) return;
+	pushNode(n);
+	unsigned int lenLeft = nodeCount(n->left);
+	if (first <= lenLeft) {
+		collectFrom(n->left, first, out);
+		out->push_back(n->entry);
+		collectFrom(n->right, 0, out);
+	} else {
+		collectFrom(n->right, first - lenLeft - 1, out);
+	}
+	return;
+}
 
-	// We are casting away const here, but that's because we need to maintain
-	// access to the EntryPtr, which we may need to "change" later (to update the
-	// offset if another file gets inserted before it, i.e. any change would not
-	// be visible externally.)
-	FATEntryPtr pFAT = boost::dynamic_pointer_cast<FATEntry>(id);
+/// Get the end of the data for the files at the same offset as n, where n is
+/// the last of them.
+/**
+ * A zero-length file can be ordered after a longer one at the same offset, so
+ * n is not always the one that ends last.
+ */
+static stream::pos groupEnd(OffsetNode *n)
+{
+	pushPath(n);
+	const FATArchive::FATEntry *pFAT = n->entry;
+	stream::pos offEnd = pFAT->iOffset + pFAT->lenHeader + pFAT->storedSize
+		+ pFAT->lenReserved;
+	for (OffsetNode *prev = prevNode(n); prev; prev = prevNode(prev)) {
+		pushPath(prev);
+		pFAT = prev->entry;
+		if (pFAT->iOffset != n->entry->iOffset) break;
+		offEnd = std::max(offEnd, pFAT->iOffset + pFAT->lenHeader
+			+ pFAT->storedSize + pFAT->lenReserved);
+	}
+	return offEnd;
+}
 
-	stream::sub_sptr psSub(new stream::sub());
-	stream::fn_truncate fnTrunc = boost::bind(&FATArchive::resizeSubstream, this, pFAT, _1);
-	psSub->open(
-		this->psArchive,
-		pFAT->iOffset + pFAT->lenHeader,
-		pFAT->storedSize,
-		fnTrunc
-	);
+/// Free every node in the subtree, detaching them from their entries.
+static void deleteNodes(OffsetNode *n)
+{
+	if (!n) return;
+	deleteNodes(n->left);
+	deleteNodes(n->right);
+	n->entry->offsetNode = NULL;
+	delete n;
+	return;
+}
 
-	// Add it to the list of open files, in case we need to shift the substream
-	// around later on as files are added/removed/resized.
-	this->openFiles.insert(OPEN_FILE(
-		pFAT,
-		psSub
-	));
-	return psSub;
+#ifdef DEBUG
+/// Check the structure of a subtree and the order of the entries in it.
+/**
+ * @param offDelta
+ *   Total offset change pending in the nodes above this one.
+ *
+ * @param offPrev
+ *   Offset of the entry before this subtree, updated to the offset of the
+ *   last entry in it.
+ *
+ * @return Number of nodes in the subtree.
+ */
+static unsigned int verifyNodes(const OffsetNode *n, const OffsetNode *parent,
+	stream::delta offDelta, stream::pos *offPrev)
+{
+	if (!n) return 0;
+	assert(n->parent == parent);
+	assert(n->entry->offsetNode == n);
+	assert(n->entry->bValid);
+	assert((!parent) || (parent->priority >= n->priority));
+	offDelta += n->offDelta;
+	unsigned int count = verifyNodes(n->left, n, offDelta, offPrev);
+	stream::pos offEntry = n->entry->iOffset + offDelta;
+	assert(offEntry >= *offPrev);
+	*offPrev = offEntry;
+	count += 1 + verifyNodes(n->right, n, offDelta, offPrev);
+	assert(n->count == count);
+	return count;
 }
+#endif
 
-ArchivePtr FATArchive::openFolder(const Archive::EntryPtr id)
+/// Sort entries by offset, falling back to index order for files sharing
+/// the same offset.
+static bool entryBefore(const FATArchive::FATEntry *a,
+	const FATArchive::FATEntry *b)
 {
-	// This function should only be called for folders (not files)
-	assert(id->fAttr & EA_FOLDER);
+	if (a->iOffset != b->iOffset) return a->iOffset < b->iOffset;
+	return a->iIndex < b->iIndex;
+}
 
-	// Throw an exception if assertions have been disabled.
-	throw stream::error("BUG: Archive format doesn't implement openFolder()");
+/// Hash the next len bytes of a stream (64-bit FNV-1a.)
+static uint64_t hashData(stream::input_sptr in, stream::len len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	uint8_t buf[4096];
+	while (len > 0) {
+		stream::len lenChunk = std::min<stream::len>(len, sizeof(buf));
+		in->read(buf, lenChunk);
+		for (stream::len i = 0; i < lenChunk; i++) {
+			hash = (hash ^ buf[i]) * 1099511628211ULL;
+		}
+		len -= lenChunk;
+	}
+	return hash;
 }
 
-FATArchive::EntryPtr FATArchive::insert(const EntryPtr idBeforeThis,
-	const std::string& strFilename, stream::pos storedSize, std::string type, int attr
-)
+/// Hash the start and end of an archive, to spot changes made elsewhere.
+static uint64_t sampleHash(stream::input_sptr in, stream::len lenArchive)
 {
-	// TESTED BY: fmt_grp_duke3d_insert2
-	// TESTED BY: fmt_grp_duke3d_remove_insert
-	// TESTED BY: fmt_grp_duke3d_insert_remove
+	stream::len lenSample = std::min<stream::len>(lenArchive,
+		FAT_INDEX_SAMPLE_LEN);
+	in->seekg(0, stream::start);
+	uint64_t hash = hashData(in, lenSample);
+	in->seekg(lenArchive - lenSample, stream::start);
+	return (hash * 1099511628211ULL) ^ hashData(in, lenSample);
+}
 
-	// Make sure filename is within the allowed limit
-	if (
-		(this->lenMaxFilename > 0) &&
-		(strFilename.length() > this->lenMaxFilename)
-	) {
-		throw stream::error(createString("maximum filename length is "
-			<< this->lenMaxFilename << " chars"));
+/// Compare the next len bytes of two streams.
+static bool sameData(stream::input_sptr a, stream::input_sptr b,
+	stream::len len)
+{
+	uint8_t bufA[4096], bufB[4096];
+	while (len > 0) {
+		stream::len lenChunk = std::min<stream::len>(len, sizeof(bufA));
+		a->read(bufA, lenChunk);
+		b->read(bufB, lenChunk);
+		if (memcmp(bufA, bufB, lenChunk) != 0) return false;
+		len -= lenChunk;
 	}
+	return true;
+}
 
-	FATEntry *pNewFile = this->createNewFATEntry();
-	EntryPtr ep(pNewFile);
+/// Substream for an open file, which keeps itself in its entry's list of open
+/// substreams until it is destroyed.
+class FATArchive::EntryStream: virtual public stream::sub {
+	public:
+		EntryStream()
+			:	archive(NULL),
+				entry(NULL),
+				grown(false),
+				prev(NULL),
+				next(NULL)
+		{
+		}
 
-	pNewFile->strName = strFilename;
-	pNewFile->storedSize = storedSize;
-	pNewFile->realSize = storedSize; // default to no filter
-	pNewFile->type = type;
-	pNewFile->fAttr = attr;
-	pNewFile->lenHeader = 0;
-	pNewFile->bValid = false; // not yet valid
+		virtual ~EntryStream()
+		{
+			if (this->archive) {
+				try {
+					this->archive->trimSubstream(this);
+				} catch (...) {
+					// Nowhere to report this, the file will just keep the extra space
+				}
+				this->archive->detachStream(this);
+			}
+		}
 
-	// Figure out where the new file is going to go
-	const FATEntry *pFATBeforeThis = NULL;
-	if (this->isValid(idBeforeThis)) {
-		// Insert at idBeforeThis
-		// TESTED BY: fmt_grp_duke3d_insert_mid
-		pFATBeforeThis = dynamic_cast<const FATEntry *>(idBeforeThis.get());
-		assert(pFATBeforeThis);
-		pNewFile->iOffset = pFATBeforeThis->iOffset;
-		pNewFile->iIndex = pFATBeforeThis->iIndex;
-	} else {
-		// Append to end of archive
-		// TESTED BY: fmt_grp_duke3d_insert_end
-		if (this->vcFAT.size()) {
-			const FATEntry *pFATAfterThis = dynamic_cast<const FATEntry *>(this->vcFAT.back().get());
-			assert(pFATAfterThis);
-			pNewFile->iOffset = pFATAfterThis->iOffset
-				+ pFATAfterThis->lenHeader + pFATAfterThis->storedSize;
-			pNewFile->iIndex = pFATAfterThis->iIndex + 1;
-		} else {
-			// There are no files in the archive
-			pNewFile->iOffset = this->offFirstFile;
-			pNewFile->iIndex = 0;
+		virtual stream::len try_write(const uint8_t *buffer, stream::len len)
+		{
+			// Don't change the data of any other files sharing it
+			if ((this->archive) && (this->entry->nextShared)) {
+				this->archive->unshareEntry(this->entry);
+			}
+			return this->stream::sub::try_write(buffer, len);
 		}
-	}
 
-	// Add the file's entry from the FAT.  May throw (e.g. filename too long),
-	// archive should be left untouched in this case.
-	FATEntry *returned = this->preInsertFile(pFATBeforeThis, pNewFile);
-	if (returned != pNewFile) {
-		ep.reset(returned);
-		pNewFile = returned;
-	}
+		virtual void flush()
+		{
+			if (this->archive) this->archive->trimSubstream(this);
+			this->stream::sub::flush();
+			return;
+		}
 
-	if (!pNewFile->filter.empty()) {
-		// The format handler wants us to apply a filter to this file.
+		FATArchive *archive;  ///< Archive to notify on close, or NULL if detached
+		FATEntry *entry;      ///< Entry this substream belongs to
+		FATEntryPtr id;       ///< Same as entry, for passing to resize()
+		bool grown;           ///< Has this substream been enlarged before?
+		EntryStream *prev;    ///< Previous substream open on the same entry
+		EntryStream *next;    ///< Next substream open on the same entry
+};
+
+FATArchive::FATEntry::FATEntry()
+	:	offsetNode(NULL),
+		offDisk(0),
+		openStreams(NULL),
+		prevOpen(NULL),
+		nextOpen(NULL),
+		prevShared(NULL),
+		nextShared(NULL),
+		lenReserved(0)
+{
+}
+FATArchive::FATEntry::~FATEntry()
+{
+}
+std::string FATArchive::FATEntry::getContent() const
+{
+	std::ostringstream ss;
+	ss << this->FileEntry::getContent()
+		<< ";fatindex=" << iIndex
+		<< ";offset=" << iOffset
+		<< ";header=" << lenHeader
+	;
+	return ss.str();
+}
+
+FATArchive::WriteCache::Batch::Batch(WriteCache *cache)
+	:	cache(cache)
+{
+	this->cache->beginBatch();
+}
+
+FATArchive::WriteCache::Batch::~Batch()
+{
+	if (this->cache) {
+		try {
+			this->cache->endBatch();
+		} catch (...) {
+			// Already handling an exception, nothing more we can do
+		}
 	}
+}
 
-	// Now it's mostly valid.  Really this is here so that it's invalid during
-	// preInsertFile(), so any calls in there to shiftFiles() will ignore the
-	// new file.  But we're about to call shiftFiles() now, and we need the file
-	// to be marked valid otherwise it won't be skipped/ignored.
-	pNewFile->bValid = true;
+void FATArchive::WriteCache::Batch::end()
+{
+	WriteCache *cache = this->cache;
+	this->cache = NULL;
+	cache->endBatch();
+	return;
+}
 
-	if (this->isValid(idBeforeThis)) {
-		// Update the offsets of any files located after this one (since they will
-		// all have been shifted forward to make room for the insert.)
-		this->shiftFiles(
-			pNewFile,
-			pNewFile->iOffset + pNewFile->lenHeader,
-			pNewFile->storedSize,
-			1
-		);
+FATArchive::WriteCache::WriteCache()
+	:	batchDepth(0),
+		offPending(0),
+		staging(false),
+		lenStaged(0),
+		lenOriginal(0),
+		offStaged(0)
+{
+}
 
-		// Add the new file to the vector now all the existing offsets have been
-		// updated.
-		// TESTED BY: fmt_grp_duke3d_insert_mid
-		VC_ENTRYPTR::iterator itBeforeThis = std::find(this->vcFAT.begin(),
-			this->vcFAT.end(), idBeforeThis);
-		assert(itBeforeThis != this->vcFAT.end());
-		this->vcFAT.insert(itBeforeThis, ep);
-	} else {
-		// TESTED BY: fmt_grp_duke3d_insert_end
-		this->vcFAT.push_back(ep);
+stream::len FATArchive::WriteCache::try_read(uint8_t *buffer, stream::len len)
+{
+	if (!this->staging) {
+		this->applyPending();
+		return this->stream::seg::try_read(buffer, len);
 	}
 
-	// Insert space for the file's data into the archive.  If there is a header
-	// (e.g. embedded FAT) then preInsertFile() will have inserted space for
-	// this and written the data, so our insert should start just after the
-	// header.
-	this->psArchive->seekp(pNewFile->iOffset + pNewFile->lenHeader, stream::start);
-	this->psArchive->insert(pNewFile->storedSize);
+	if (this->offStaged >= this->lenStaged) return 0;
+	len = std::min(len, this->lenStaged - this->offStaged);
 
-	this->postInsertFile(pNewFile);
+	// Find the extent holding the current position
+	unsigned int i = 0;
+	stream::pos offExtent = 0;
+	while (offExtent + this->extents[i].len <= this->offStaged) {
+		offExtent += this->extents[i].len;
+		i++;
+	}
 
-	return ep;
+	stream::len lenDone = 0;
+	while (lenDone < len) {
+		const Extent& e = this->extents[i];
+		stream::pos offInside = this->offStaged + lenDone - offExtent;
+		stream::len lenChunk = std::min(len - lenDone, e.len - offInside);
+		switch (e.source) {
+			case Extent::Original: {
+				this->stream::seg::seekg(e.src + offInside, stream::start);
+				stream::len lenRead = this->stream::seg::try_read(buffer + lenDone,
+					lenChunk);
+				if (lenRead != lenChunk) throw stream::incomplete_read(lenDone + lenRead);
+				break;
+			}
+			case Extent::Inserted:
+				memset(buffer + lenDone, 0, lenChunk);
+				break;
+			case Extent::Written:
+				memcpy(buffer + lenDone, e.data.data() + offInside, lenChunk);
+				break;
+		}
+		lenDone += lenChunk;
+		offExtent += e.len;
+		i++;
+	}
+	this->offStaged += len;
+	return len;
+}
+
+void FATArchive::WriteCache::seekg(stream::delta off, stream::seek_from from)
+{
+	if (this->staging) {
+		this->seekp(off, from);
+		return;
+	}
+	this->applyPending();
+	this->stream::seg::seekg(off, from);
+	return;
+}
+
+stream::pos FATArchive::WriteCache::tellg() const
+{
+	if (this->staging) return this->offStaged;
+	if (this->pending.empty()) return this->stream::seg::tellg();
+	return this->offPending;
+}
+
+stream::len FATArchive::WriteCache::try_write(const uint8_t *buffer,
+	stream::len len)
+{
+	if (this->staging) {
+		if (len == 0) return 0;
+		stream::pos offEnd = this->offStaged + len;
+		if (offEnd > this->lenStaged) this->truncate(offEnd);
+
+		// Replace whatever was there with the new data, joining it on to the
+		// end of the previous write if they touch, as sequential writes do.
+		unsigned int first = this->splitExtent(this->offStaged);
+		unsigned int last = this->splitExtent(offEnd);
+		this->extents.erase(this->extents.begin() + first,
+			this->extents.begin() + last);
+		if ((first > 0) && (this->extents[first - 1].source == Extent::Written)) {
+			Extent& prev = this->extents[first - 1];
+			prev.data.append((const char *)buffer, len);
+			prev.len += len;
+		} else {
+			Extent e;
+			e.source = Extent::Written;
+			e.src = 0;
+			e.len = len;
+			e.data.assign((const char *)buffer, len);
+			this->extents.insert(this->extents.begin() + first, e);
+		}
+		this->offStaged = offEnd;
+		return len;
+	}
+
+	if (this->batchDepth == 0) return this->stream::seg::try_write(buffer, len);
+
+	stream::pos off = this->tellp();
+	stream::pos offEnd = off + len;
+	if (offEnd > this->size()) {
+		// Writes that make the stream larger go straight through
+		this->applyPending();
+		return this->stream::seg::try_write(buffer, len);
+	}
+
+	// Join this write with any pending ones that it overlaps or touches
+	std::map<stream::pos, std::string>::iterator first =
+		this->pending.upper_bound(off);
+	if (first != this->pending.begin()) {
+		first--;
+		if (first->first + first->second.length() < off) first++;
+	}
+	stream::pos offStart = off, offStop = offEnd;
+	std::map<stream::pos, std::string>::iterator last = first;
+	for (; (last != this->pending.end()) && (last->first <= offEnd); last++) {
+		offStart = std::min(offStart, last->first);
+		offStop = std::max(offStop, (stream::pos)(last->first + last->second.length()));
+	}
+	std::string data(offStop - offStart, '\0');
+	for (std::map<stream::pos, std::string>::iterator i = first; i != last; i++) {
+		data.replace(i->first - offStart, i->second.length(), i->second);
+	}
+	data.replace(off - offStart, len, (const char *)buffer, len);
+	this->pending.erase(first, last);
+	this->pending[offStart].swap(data);
+
+	this->offPending = offEnd;
+	return len;
+}
+
+void FATArchive::WriteCache::seekp(stream::delta off, stream::seek_from from)
+{
+	if (this->staging) {
+		stream::delta target = off;
+		switch (from) {
+			case stream::start: break;
+			case stream::cur: target += this->offStaged; break;
+			case stream::end: target += this->lenStaged; break;
+		}
+		if ((target < 0) || ((stream::pos)target > this->lenStaged)) {
+			throw stream::seek_error("Cannot seek beyond end of stream");
+		}
+		this->offStaged = target;
+		return;
+	}
+	if (this->pending.empty()) {
+		this->stream::seg::seekp(off, from);
+		return;
+	}
+	stream::delta target = off;
+	switch (from) {
+		case stream::start: break;
+		case stream::cur: target += this->offPending; break;
+		case stream::end: target += this->size(); break;
+	}
+	if ((target < 0) || ((stream::pos)target > this->size())) {
+		// Let the underlying stream report the error
+		this->applyPending();
+		this->stream::seg::seekp(off, from);
+		return;
+	}
+	this->offPending = target;
+	return;
+}
+
+stream::pos FATArchive::WriteCache::tellp() const
+{
+	if (this->staging) return this->offStaged;
+	if (this->pending.empty()) return this->stream::seg::tellp();
+	return this->offPending;
+}
+
+stream::len FATArchive::WriteCache::size() const
+{
+	if (this->staging) return this->lenStaged;
+	return this->stream::seg::size();
+}
+
+void FATArchive::WriteCache::truncate(stream::pos size)
+{
+	if (this->staging) {
+		if (size < this->lenStaged) {
+			unsigned int first = this->splitExtent(size);
+			this->extents.erase(this->extents.begin() + first, this->extents.end());
+		} else if (size > this->lenStaged) {
+			Extent e;
+			e.source = Extent::Inserted;
+			e.src = 0;
+			e.len = size - this->lenStaged;
+			this->extents.push_back(e);
+		}
+		this->lenStaged = size;
+		if (this->offStaged > size) this->offStaged = size;
+		return;
+	}
+	this->applyPending();
+	this->stream::seg::truncate(size);
+	return;
+}
+
+void FATArchive::WriteCache::flush()
+{
+	// Nothing can go out until the staged changes are committed
+	if (this->staging) return;
+	this->applyPending();
+	this->stream::seg::flush();
+	return;
+}
+
+void FATArchive::WriteCache::open(stream::inout_sptr parent)
+{
+	assert(!this->staging);
+	this->applyPending();
+	this->stream::seg::open(parent);
+	return;
+}
+
+void FATArchive::WriteCache::insert(stream::len len)
+{
+	if (this->staging) {
+		if (len == 0) return;
+		Extent e;
+		e.source = Extent::Inserted;
+		e.src = 0;
+		e.len = len;
+		unsigned int at = this->splitExtent(this->offStaged);
+		this->extents.insert(this->extents.begin() + at, e);
+		this->lenStaged += len;
+		return;
+	}
+	this->applyPending();
+	this->stream::seg::insert(len);
+	return;
+}
+
+void FATArchive::WriteCache::remove(stream::len len)
+{
+	if (this->staging) {
+		if (len == 0) return;
+		if (this->offStaged + len > this->lenStaged) {
+			throw stream::seek_error("Cannot remove beyond end of stream");
+		}
+		unsigned int first = this->splitExtent(this->offStaged);
+		unsigned int last = this->splitExtent(this->offStaged + len);
+		this->extents.erase(this->extents.begin() + first,
+			this->extents.begin() + last);
+		this->lenStaged -= len;
+		return;
+	}
+	this->applyPending();
+	this->stream::seg::remove(len);
+	return;
+}
+
+void FATArchive::WriteCache::beginBatch()
+{
+	this->batchDepth++;
+	return;
+}
+
+void FATArchive::WriteCache::endBatch()
+{
+	assert(this->batchDepth > 0);
+	this->batchDepth--;
+	if (this->batchDepth == 0) this->applyPending();
+	return;
+}
+
+void FATArchive::WriteCache::beginStaging()
+{
+	if (this->staging) {
+		// Remember where to come back to if this level is discarded
+		Level level;
+		level.extents = this->extents;
+		level.lenStaged = this->lenStaged;
+		this->outer.push_back(level);
+		return;
+	}
+	this->applyPending();
+	this->lenOriginal = this->stream::seg::size();
+	this->lenStaged = this->lenOriginal;
+	this->offStaged = 0;
+	this->extents.clear();
+	if (this->lenOriginal) {
+		Extent e;
+		e.source = Extent::Original;
+		e.src = 0;
+		e.len = this->lenOriginal;
+		this->extents.push_back(e);
+	}
+	this->staging = true;
+	return;
+}
+
+void FATArchive::WriteCache::commitStaged()
+{
+	assert(this->staging);
+	if (!this->outer.empty()) {
+		// The changes carry on being staged in the level below
+		this->outer.pop_back();
+		return;
+	}
+	std::vector<Extent> content;
+	content.swap(this->extents);
+	this->staging = false;
+
+	// Work through the final content in order.  Between each run of original
+	// data that is being kept, the original data that isn't is overwritten by
+	// as much of the new data as will fit, with the rest inserted after it or
+	// the leftovers removed.  Inserted space needs no writing.
+	stream::pos out = 0;  // where the next extent goes in the final stream
+	stream::pos offKept = 0;  // end of the last original data kept
+	unsigned int i = 0;
+	for (;;) {
+		unsigned int next = i;
+		while ((next < content.size()) && (content[next].source != Extent::Original)) {
+			next++;
+		}
+		stream::len lenUnused = ((next < content.size())
+			? content[next].src : this->lenOriginal) - offKept;
+
+		for (; i < next; i++) {
+			const Extent& e = content[i];
+			if (e.source == Extent::Written) {
+				stream::len lenOver = std::min(lenUnused, e.len);
+				lenUnused -= lenOver;
+				if (e.len > lenOver) {
+					this->seekp(out + lenOver, stream::start);
+					this->insert(e.len - lenOver);
+				}
+				this->seekp(out, stream::start);
+				this->write(e.data);
+			} else {
+				this->seekp(out, stream::start);
+				this->insert(e.len);
+			}
+			out += e.len;
+		}
+		if (lenUnused) {
+			this->seekp(out, stream::start);
+			this->remove(lenUnused);
+		}
+		if (next == content.size()) break;
+		out += content[next].len;
+		offKept = content[next].src + content[next].len;
+		i = next + 1;
+	}
+	return;
+}
+
+void FATArchive::WriteCache::discardStaged()
+{
+	assert(this->staging);
+	if (!this->outer.empty()) {
+		// Go back to the content of the level below
+		Level& level = this->outer.back();
+		this->extents.swap(level.extents);
+		this->lenStaged = level.lenStaged;
+		if (this->offStaged > this->lenStaged) this->offStaged = this->lenStaged;
+		this->outer.pop_back();
+		return;
+	}
+	this->extents.clear();
+	this->staging = false;
+	return;
+}
+
+unsigned int FATArchive::WriteCache::splitExtent(stream::pos off)
+{
+	assert(off <= this->lenStaged);
+	unsigned int i = 0;
+	stream::pos offExtent = 0;
+	for (; i < this->extents.size(); i++) {
+		if (offExtent == off) return i;
+		Extent& e = this->extents[i];
+		if (offExtent + e.len > off) {
+			// Cut this extent in two
+			stream::len lenFirst = off - offExtent;
+			Extent second;
+			second.source = e.source;
+			second.src = e.src + lenFirst;
+			second.len = e.len - lenFirst;
+			if (e.source == Extent::Written) {
+				second.data = e.data.substr(lenFirst);
+				e.data.resize(lenFirst);
+			}
+			e.len = lenFirst;
+			this->extents.insert(this->extents.begin() + i + 1, second);
+			return i + 1;
+		}
+		offExtent += e.len;
+	}
+	return i;
+}
+
+void FATArchive::WriteCache::applyPending()
+{
+	if (this->pending.empty()) return;
+
+	// Take the list first, so seeking below sees nothing pending
+	std::map<stream::pos, std::string> writes;
+	writes.swap(this->pending);
+
+	std::map<stream::pos, std::string>::iterator i = writes.begin();
+	while (i != writes.end()) {
+		// Gather up the writes close enough together to be done as one
+		stream::pos offStart = i->first;
+		stream::pos offEnd = offStart + i->second.length();
+		std::map<stream::pos, std::string>::iterator j = i;
+		for (j++; (j != writes.end()) && (j->first <= offEnd + FAT_WRITE_GAP); j++) {
+			offEnd = j->first + j->second.length();
+		}
+
+		std::string block;
+		if (++std::map<stream::pos, std::string>::iterator(i) == j) {
+			block.swap(i->second);
+		} else {
+			// Read in what lies between the writes, then lay them over the top
+			block.resize(offEnd - offStart);
+			this->stream::seg::seekg(offStart, stream::start);
+			stream::len lenRead = this->stream::seg::try_read(
+				(uint8_t *)&block[0], block.length());
+			if (lenRead != block.length()) throw stream::incomplete_read(lenRead);
+			for (; i != j; i++) {
+				block.replace(i->first - offStart, i->second.length(), i->second);
+			}
+		}
+		this->stream::seg::seekp(offStart, stream::start);
+		stream::len lenWritten = this->stream::seg::try_write(
+			(const uint8_t *)block.data(), block.length());
+		if (lenWritten != block.length()) {
+			throw stream::incomplete_write(lenWritten);
+		}
+		i = j;
+	}
+	this->stream::seg::seekp(this->offPending, stream::start);
+	return;
+}
+
+Archive::EntryPtr getFileAt(const Archive::VC_ENTRYPTR& files, unsigned int index)
+{
+	for (Archive::VC_ENTRYPTR::const_iterator i = files.begin(); i != files.end(); i++) {
+		FATArchive::FATEntry *pEntry = dynamic_cast<FATArchive::FATEntry *>(i->get());
+		if (pEntry->iIndex == index) return *i;
+	}
+	return Archive::EntryPtr();
+}
+
+FATArchive::FATArchive(stream::inout_sptr psArchive, stream::pos offFirstFile,
+	int lenMaxFilename)
+	:	psArchive(new WriteCache()),
+		offFirstFile(offFirstFile),
+		lenMaxFilename(lenMaxFilename),
+		deferFAT(false),
+		psParent(psArchive),
+		sparse(false),
+		dedup(false),
+		lenShared(0),
+		outOfPlace(false),
+		gapsCurrent(false),
+		inTransaction(false),
+		offsetRoot(NULL),
+		offsetSeed(1),
+		offsetsPending(false),
+		offsetsUnwritten(false),
+		lenLazyFAT(0),
+		offLazyFAT(0),
+		lenLazyRecord(0),
+		lazyPageFirst(0),
+		fatRevision(1),
+		revNameIndex(0),
+		revTypedFAT(0),
+		openEntries(NULL),
+		indexStamp(0)
+{
+	assert(psArchive);
+
+	this->psArchive->open(psArchive);
+}
+
+FATArchive::~FATArchive()
+{
+	// Can't flush here as it could throw stream::error and we have no way
+	// of handling it.
+	//this->flush(); // make sure it saves on close just in case
+
+	// Any substreams still open can no longer tell us when they close
+	while (this->openEntries) this->detachEntryStreams(this->openEntries);
+
+	deleteNodes(this->offsetRoot);
+}
+
+const FATArchive::VC_ENTRYPTR& FATArchive::getFileList() const
+{
+	this->loadAllEntries();
+
+	// Make sure the caller doesn't see any stale offsets
+	this->resolveAllEntries();
+	return this->vcFAT;
+}
+
+FATArchive::EntryPtr FATArchive::find(const std::string& strFilename) const
+{
+	// TESTED BY: fmt_grp_duke3d_*
+	// TESTED BY: test_archive::test_find
+	if (this->lenLazyFAT) {
+		// Look the name up without creating any entries except the one found, so
+		// opening a large archive to get one file stays cheap.  The names can't
+		// change until the whole FAT is loaded, so the index stays current.
+		// TESTED BY: test_archive::test_find_then_list
+		if (this->lazyNameIndex.empty()) this->buildLazyNameIndex();
+		LAZY_NAME_INDEX::const_iterator i =
+			this->lazyNameIndex.find(nameIndexKey(strFilename));
+		if (i == this->lazyNameIndex.end()) return EntryPtr();
+		EntryPtr& slot = this->lazyEntries[i->second];
+		if (!slot) {
+			FATEntryPtr pEntry = const_cast<FATArchive *>(this)->createNewFATEntry();
+			slot = pEntry;
+			this->readLazyEntry(i->second, pEntry.get());
+		}
+		return slot;
+	}
+
+	if (!this->isNameIndexCurrent()) this->rebuildNameIndex();
+
+	NAME_INDEX::const_iterator i = this->nameIndex.find(nameIndexKey(strFilename));
+	if (i == this->nameIndex.end()) return EntryPtr();
+	assert(!i->second.empty());
+	this->resolveEntry(dynamic_cast<const FATEntry *>(i->second.front().get()));
+	return i->second.front();
+}
+
+bool FATArchive::isValid(const EntryPtr id) const
+{
+	const FATEntry *id2 = dynamic_cast<const FATEntry *>(id.get());
+	return ((id2) && (id2->bValid));
+}
+
+stream::inout_sptr FATArchive::open(const EntryPtr id)
+{
+	// TESTED BY: fmt_grp_duke3d_open
+
+	// Make sure we're not trying to open a folder as a file
+	//assert((id->fAttr & EA_FOLDER) == 0);
+	// We can't do this because some folder formats have their FAT and
+	// everything stored as a "file" in the parent archive, so the subfolder
+	// code opens this file (even though it's flagged as a folder) and then
+	// passes the data to the Archive.
+
+	// We are casting away const here, but that's because we need to maintain
+	// access to the EntryPtr, which we may need to "change" later (to update the
+	// offset if another file gets inserted before it, i.e. any change would not
+	// be visible externally.)
+	FATEntryPtr pFAT = boost::dynamic_pointer_cast<FATEntry>(id);
+	this->resolveEntry(pFAT.get());
+
+	boost::shared_ptr<EntryStream> psSub(new EntryStream());
+	psSub->id = pFAT;
+	stream::fn_truncate fnTrunc = boost::bind(&FATArchive::resizeSubstream,
+		this, psSub.get(), _1);
+	psSub->open(
+		this->psArchive,
+		pFAT->iOffset + pFAT->lenHeader,
+		pFAT->storedSize,
+		fnTrunc
+	);
+
+	// Add it to the list of open files, in case we need to shift the substream
+	// around later on as files are added/removed/resized.
+	this->attachStream(pFAT.get(), psSub.get());
+	return psSub;
+}
+
+ArchivePtr FATArchive::openFolder(const Archive::EntryPtr id)
+{
+	// This function should only be called for folders (not files)
+	assert(id->fAttr & EA_FOLDER);
+
+	// Throw an exception if assertions have been disabled.
+	throw stream::error("BUG: Archive format doesn't implement openFolder()");
+}
+
+FATArchive::EntryPtr FATArchive::insert(const EntryPtr idBeforeThis,
+	const std::string& strFilename, stream::pos storedSize, std::string type, int attr
+)
+{
+	return this->insertEntry(idBeforeThis, strFilename, storedSize, type, attr,
+		stream::input_sptr());
+}
+
+FATArchive::EntryPtr FATArchive::insert(const EntryPtr idBeforeThis,
+	const std::string& strFilename, stream::input_sptr src, std::string type,
+	int attr)
+{
+	// TESTED BY: test_archive::test_insert_src
+	assert(src);
+	stream::len lenData = src->size() - src->tellg();
+	return this->insertEntry(idBeforeThis, strFilename, lenData, type, attr, src);
+}
+
+FATArchive::EntryPtr FATArchive::insertEntry(const EntryPtr idBeforeThis,
+	const std::string& strFilename, stream::pos storedSize, std::string type,
+	int attr, stream::input_sptr src)
+{
+	this->loadAllEntries();
+	// TESTED BY: fmt_grp_duke3d_insert2
+	// TESTED BY: fmt_grp_duke3d_remove_insert
+	// TESTED BY: fmt_grp_duke3d_insert_remove
+
+	// Make sure filename is within the allowed limit
+	if (
+		(this->lenMaxFilename > 0) &&
+		(strFilename.length() > this->lenMaxFilename)
+	) {
+		throw stream::error(createString("maximum filename length is "
+			<< this->lenMaxFilename << " chars"));
+	}
+
+	this->checkOffsetTree();
+
+	// Files being written may have space set aside after them, which the new
+	// file's position doesn't allow for
+	this->trimOpenStreams();
+
+	FATEntryPtr pNew = this->createNewFATEntry();
+	FATEntry *pNewFile = pNew.get();
+	EntryPtr ep = pNew;
+
+	pNewFile->strName = strFilename;
+	pNewFile->storedSize = storedSize;
+	pNewFile->realSize = storedSize; // default to no filter
+	pNewFile->type = type;
+	pNewFile->fAttr = attr;
+	pNewFile->lenHeader = 0;
+	pNewFile->bValid = false; // not yet valid
+
+	// Figure out where the new file is going to go
+	const FATEntry *pFATBeforeThis = NULL;
+	if (this->isValid(idBeforeThis)) {
+		// Insert at idBeforeThis
+		// TESTED BY: fmt_grp_duke3d_insert_mid
+		pFATBeforeThis = dynamic_cast<const FATEntry *>(idBeforeThis.get());
+		assert(pFATBeforeThis);
+		this->resolveEntry(pFATBeforeThis);
+		pNewFile->iOffset = pFATBeforeThis->iOffset;
+		pNewFile->iIndex = pFATBeforeThis->iIndex;
+	} else {
+		// Append to end of archive
+		// TESTED BY: fmt_grp_duke3d_insert_end
+		if (this->vcFAT.size()) {
+			const FATEntry *pFATAfterThis = dynamic_cast<const FATEntry *>(this->vcFAT.back().get());
+			assert(pFATAfterThis);
+			this->resolveEntry(pFATAfterThis);
+			pNewFile->iOffset = pFATAfterThis->iOffset
+				+ pFATAfterThis->lenHeader + pFATAfterThis->storedSize;
+			pNewFile->iIndex = pFATAfterThis->iIndex + 1;
+		} else {
+			// There are no files in the archive
+			pNewFile->iOffset = this->offFirstFile;
+			pNewFile->iIndex = 0;
+		}
+	}
+
+	// In a sparse archive the data can go anywhere, so look for a gap it will
+	// fit in before resorting to the end of the archive.
+	// If the same data is already in the archive, point the new file at that
+	// instead.
+	bool inGap = false;
+	FATEntry *pOriginal = NULL;
+	uint64_t hash = 0;
+	if ((this->dedup) && (src) && (storedSize > 0)) {
+		// TESTED BY: test_archive::test_dedup
+		pOriginal = this->findDuplicate(src, storedSize, &hash);
+	}
+	if (pOriginal) {
+		pNewFile->iOffset = pOriginal->iOffset;
+	} else if (this->sparse) {
+		// TESTED BY: test_archive::test_sparse_layout
+		inGap = (storedSize > 0)
+			&& this->findGap(storedSize, NULL, &pNewFile->iOffset);
+		if (!inGap) pNewFile->iOffset = this->getDataEnd();
+	}
+
+	// Add the file's entry from the FAT.  May throw (e.g. filename too long),
+	// archive should be left untouched in this case.
+	FATEntry *returned = this->preInsertFile(pFATBeforeThis, pNewFile);
+	if (returned != pNewFile) {
+		ep.reset(returned);
+		pNewFile = returned;
+	}
+
+	if (!pNewFile->filter.empty()) {
+		// The format handler wants us to apply a filter to this file.
+	}
+
+	// Now it's mostly valid.  Really this is here so that it's invalid during
+	// preInsertFile(), so any calls in there to shiftFiles() will ignore the
+	// new file.  But we're about to call shiftFiles() now, and we need the file
+	// to be marked valid otherwise it won't be skipped/ignored.
+	pNewFile->bValid = true;
+
+	// Only maintain the filename index and typed entry list if they were in sync
+	// before the insert, otherwise leave them to be rebuilt on demand.
+	bool updateNameIndex = this->isNameIndexCurrent();
+	bool updateTypedFAT = this->isTypedFATCurrent();
+	unsigned int pos = this->vcFAT.size();
+
+	if (this->isValid(idBeforeThis)) {
+		if (this->sparse) {
+			// Nothing has to move, but the following files are now one entry
+			// further along in the FAT.
+			this->renumberFrom(pNewFile->iIndex, 1);
+		} else {
+			// Update the offsets of any files located after this one (since they
+			// will all have been shifted forward to make room for the insert.)
+			this->shiftFiles(
+				pNewFile,
+				pNewFile->iOffset + pNewFile->lenHeader,
+				pNewFile->storedSize,
+				1
+			);
+		}
+
+		// Add the new file to the vector now all the existing offsets have been
+		// updated.
+		// TESTED BY: fmt_grp_duke3d_insert_mid
+		VC_ENTRYPTR::iterator itBeforeThis = std::find(this->vcFAT.begin(),
+			this->vcFAT.end(), idBeforeThis);
+		assert(itBeforeThis != this->vcFAT.end());
+		pos = itBeforeThis - this->vcFAT.begin();
+		this->vcFAT.insert(itBeforeThis, ep);
+	} else {
+		// TESTED BY: fmt_grp_duke3d_insert_end
+		this->vcFAT.push_back(ep);
+	}
+
+	this->fatChanged();
+	if (updateTypedFAT) {
+		this->typedFAT.insert(this->typedFAT.begin() + pos, pNewFile);
+		this->revTypedFAT = this->fatRevision;
+	}
+	this->addToOffsetTree(pNewFile);
+	if (updateNameIndex) {
+		this->addToNameIndex(ep, pNewFile);
+		this->revNameIndex = this->fatRevision;
+	}
+
+	// Insert space for the file's data into the archive.  If there is a header
+	// (e.g. embedded FAT) then preInsertFile() will have inserted space for
+	// this and written the data, so our insert should start just after the
+	// header.
+	if (pOriginal) {
+		// The data is already there
+	} else if (inGap) {
+		// Anything left in the gap will be overwritten if there is data to add
+		if (!src) {
+			this->zeroFill(pNewFile->iOffset + pNewFile->lenHeader,
+				pNewFile->storedSize);
+		}
+	} else {
+		this->psArchive->seekp(pNewFile->iOffset + pNewFile->lenHeader, stream::start);
+		this->psArchive->insert(pNewFile->storedSize);
+	}
+
+	this->postInsertFile(pNewFile);
+
+	// preInsertFile() will have written the offset into the FAT
+	pNewFile->offDisk = pNewFile->iOffset;
+
+	if (this->inTransaction) {
+		UndoRecord undo;
+		undo.action = UndoRecord::Inserted;
+		undo.id = ep;
+		this->undoLog.push_back(undo);
+	}
+
+	if (pOriginal) {
+		this->linkShared(pNewFile, pOriginal);
+	} else if (src) {
+		// postInsertFile() may have moved things around, so find the data again
+		this->resolveEntry(pNewFile);
+		this->psArchive->seekp(pNewFile->iOffset + pNewFile->lenHeader,
+			stream::start);
+		stream::copy(this->psArchive, src);
+		if (this->dedup) {
+			this->hashIndex.insert(HASH_INDEX::value_type(hash, ep));
+		}
+	}
+
+	return ep;
+}
+
+void FATArchive::remove(EntryPtr id)
+{
+	this->loadAllEntries();
+	// TESTED BY: fmt_grp_duke3d_remove
+	// TESTED BY: fmt_grp_duke3d_remove2
+	// TESTED BY: fmt_grp_duke3d_remove_insert
+	// TESTED BY: fmt_grp_duke3d_insert_remove
+
+	// Make sure the caller doesn't try to remove something that doesn't exist!
+	assert(this->isValid(id));
+
+	FATEntry *pFATDel = dynamic_cast<FATEntry *>(id.get());
+	assert(pFATDel);
+	this->checkOffsetTree();
+	this->resolveEntry(pFATDel);
+
+	// The file may still be open and have space set aside after it
+	this->trimOpenStreams();
+
+	UndoRecord undo;
+	if (this->inTransaction) {
+		// Keep everything needed to put the file's FAT entry back again.  The
+		// data itself is still in the original stream underneath.
+		// TESTED BY: test_archive::test_transaction_abort
+		undo.action = UndoRecord::Removed;
+		undo.id = id;
+		undo.index = pFATDel->iIndex;
+		undo.name = pFATDel->strName;
+		undo.type = pFATDel->type;
+		undo.attr = pFATDel->fAttr;
+		undo.storedSize = pFATDel->storedSize;
+		undo.realSize = pFATDel->realSize;
+	}
+
+	// Remove the file's entry from the FAT
+	this->preRemoveFile(pFATDel);
+
+	// Data still used by other files has to stay where it is
+	bool shared = pFATDel->nextShared;
+	this->unlinkShared(pFATDel);
+
+	// In a sparse archive the file's space is left as a gap, unless there are
+	// no files after it, in which case the archive is trimmed back to the end
+	// of the previous file.
+	bool trim = false;
+	stream::pos offTrim = 0;
+	if ((this->sparse) && (!shared)) {
+		OffsetNode *node = pFATDel->offsetNode;
+		pushPath(node);
+		if (!nextNode(node)) {
+			// A longer file at the same offset may still be using the space
+			offTrim = this->offFirstFile;
+			if (OffsetNode *prev = prevNode(node)) offTrim = groupEnd(prev);
+			trim = offTrim < pFATDel->iOffset + pFATDel->lenHeader
+				+ pFATDel->storedSize;
+		}
+	}
+
+	// Remove the entry from the vector.  This also brings its offset up to date
+	// in case preRemoveFile() shifted it.
+	this->removeFromOffsetTree(pFATDel);
+	bool updateNameIndex = this->isNameIndexCurrent();
+	bool updateTypedFAT = this->isTypedFATCurrent();
+	VC_ENTRYPTR::iterator itErase = std::find(this->vcFAT.begin(), this->vcFAT.end(), id);
+	assert(itErase != this->vcFAT.end());
+	this->fatChanged();
+	if (updateNameIndex) {
+		this->removeFromNameIndex(id, pFATDel->strName);
+		this->revNameIndex = this->fatRevision;
+	}
+	if (updateTypedFAT) {
+		this->typedFAT.erase(this->typedFAT.begin() + (itErase - this->vcFAT.begin()));
+		this->revTypedFAT = this->fatRevision;
+	}
+	this->vcFAT.erase(itErase);
+
+	if (this->sparse) {
+		// TESTED BY: test_archive::test_sparse_layout
+		this->renumberFrom(pFATDel->iIndex + 1, -1);
+		if (trim) {
+			this->psArchive->seekp(offTrim, stream::start);
+			this->psArchive->remove(pFATDel->iOffset + pFATDel->lenHeader
+				+ pFATDel->storedSize - offTrim);
+		}
+	} else {
+		// Update the offsets of any files located after this one (since they will
+		// all have been shifted back to fill the gap made by the removal.)
+		this->shiftFiles(
+			pFATDel,
+			pFATDel->iOffset,
+			-((stream::delta)pFATDel->storedSize + (stream::delta)pFATDel->lenHeader),
+			-1
+		);
+
+		// Remove the file's data from the archive
+		this->psArchive->seekp(pFATDel->iOffset, stream::start);
+		this->psArchive->remove(pFATDel->storedSize + pFATDel->lenHeader);
+	}
+
+	// Mark it as invalid in case some other code is still holding on to it.
+	pFATDel->bValid = false;
+
+	// Leave any open substreams where they are, since the file is gone
+	this->detachEntryStreams(pFATDel);
+
+	this->postRemoveFile(pFATDel);
+
+	if (this->inTransaction) this->undoLog.push_back(undo);
+
+	return;
+}
+
+void FATArchive::rename(EntryPtr id, const std::string& strNewName)
+{
+	this->loadAllEntries();
+	// TESTED BY: fmt_grp_duke3d_rename
+	assert(this->isValid(id));
+	FATEntry *pFAT = dynamic_cast<FATEntry *>(id.get());
+	this->resolveEntry(pFAT);
+
+	// Make sure filename is within the allowed limit
+	if (
+		(this->lenMaxFilename > 0) &&
+		(strNewName.length() > this->lenMaxFilename)
+	) {
+		throw stream::error(createString("maximum filename length is "
+			<< this->lenMaxFilename << " chars"));
+	}
+
+	this->updateFileName(pFAT, strNewName);
+
+	if (this->inTransaction) {
+		UndoRecord undo;
+		undo.action = UndoRecord::Renamed;
+		undo.id = id;
+		undo.name = pFAT->strName;
+		this->undoLog.push_back(undo);
+	}
+
+	bool updateNameIndex = this->isNameIndexCurrent();
+	bool updateTypedFAT = this->isTypedFATCurrent();
+	this->fatChanged();
+	if (updateNameIndex) {
+		// TESTED BY: test_archive::test_find
+		this->removeFromNameIndex(id, pFAT->strName);
+		pFAT->strName = strNewName;
+		this->addToNameIndex(id, pFAT);
+		this->revNameIndex = this->fatRevision;
+	} else {
+		pFAT->strName = strNewName;
+	}
+	if (updateTypedFAT) this->revTypedFAT = this->fatRevision;
+	return;
+}
+
+void FATArchive::move(const EntryPtr idBeforeThis, EntryPtr id)
+{
+	// TESTED BY: test_archive::test_move
+	assert(this->isValid(id));
+	this->loadAllEntries();
+	this->trimOpenStreams(); // only the data itself is moved
+	if (this->moveInPlace(idBeforeThis, id)) return;
+
+	// Open the file we want to move
+	stream::inout_sptr src(this->open(id));
+	assert(src);
+
+	// Insert a new file at the destination index
+	EntryPtr n = this->insert(idBeforeThis, id->strName, id->storedSize,
+		id->type, id->fAttr);
+	assert(n->bValid);
+
+	if (n->filter.compare(id->filter) != 0) {
+		this->remove(n);
+		throw stream::error("Cannot move file to this position (filter change)"
+			" - try removing and then adding it instead");
+	}
+
+	stream::inout_sptr dst(this->open(n));
+	assert(dst);
+
+	// Copy the data into the new file's position
+	stream::copy(dst, src);
+	dst->flush();
+
+	// If there's a filter set then bring the unfiltered size across too.
+	if (!n->filter.empty()) {
+		this->resize(n, n->storedSize, id->realSize);
+	}
+
+	this->remove(id);
+
+	return;
+}
+
+void FATArchive::resize(EntryPtr id, stream::len newStoredSize,
+	stream::len newRealSize)
+{
+	this->loadAllEntries();
+	assert(this->isValid(id));
+	stream::delta iDelta = newStoredSize - id->storedSize;
+	FATEntry *pFAT = dynamic_cast<FATEntry *>(id.get());
+	this->resolveEntry(pFAT);
+
+	// The other files sharing this one's data must keep their current size
+	if ((iDelta != 0) && (pFAT->nextShared)) this->unshareEntry(pFAT);
+
+	stream::len oldStoredSize = pFAT->storedSize;
+	stream::len oldRealSize = pFAT->realSize;
+
+	// Growing into any space set aside after the file doesn't move anything
+	// TESTED BY: test_archive::test_write_growing
+	stream::len lenUsed = 0;
+	if (iDelta > 0) lenUsed = std::min<stream::len>(iDelta, pFAT->lenReserved);
+	stream::delta iShift = iDelta - lenUsed;
+
+	UndoRecord undo;
+	if (this->inTransaction) {
+		if ((iDelta == 0) && (oldRealSize == newRealSize)) return; // no change
+		undo.action = UndoRecord::Resized;
+		undo.id = id;
+		undo.storedSize = oldStoredSize;
+		undo.realSize = oldRealSize;
+	}
+
+	pFAT->storedSize = newStoredSize;
+	pFAT->realSize = newRealSize;
+	this->refreshGap(pFAT->offsetNode);
+
+	try {
+		// Update the FAT with the file's new sizes
+		this->updateFileSize(pFAT, iShift);
+	} catch (stream::error) {
+		// Undo and abort the resize
+		pFAT->storedSize = oldStoredSize;
+		pFAT->realSize = oldRealSize;
+		this->refreshGap(pFAT->offsetNode);
+		throw;
+	}
+	pFAT->lenReserved -= lenUsed;
+	if (this->inTransaction) this->undoLog.push_back(undo);
+
+	if (this->sparse && (iDelta != 0)) {
+		// TESTED BY: test_archive::test_sparse_layout
+		this->resizeSparse(pFAT, oldStoredSize);
+		this->refreshGap(pFAT->offsetNode);
+		return;
+	}
+
+	// Add or remove the data in the underlying stream
+	stream::pos iStart;
+	if (iDelta > 0) { // inserting data
+		// TESTED BY: fmt_grp_duke3d_resize_larger
+		iStart = pFAT->iOffset + pFAT->lenHeader + oldStoredSize;
+		if (iShift) {
+			this->psArchive->seekp(iStart + lenUsed, stream::start);
+			this->psArchive->insert(iShift);
+		}
+	} else if (iDelta < 0) { // removing data
+		// TESTED BY: fmt_grp_duke3d_resize_smaller
+		iStart = pFAT->iOffset + pFAT->lenHeader + newStoredSize;
+		this->psArchive->seekp(iStart, stream::start);
+		this->psArchive->remove(-iDelta);
+	} else if (pFAT->realSize == newRealSize) {
+		// Not resizing the internal size, and the external/real size
+		// hasn't changed either, so nothing to do.
+		return;
+	}
+
+	if (iDelta != 0) {
+		// The internal file size is changing, so adjust the offsets etc. of the
+		// rest of the files in the archive, including any open streams.
+		if (iShift != 0) this->shiftFiles(pFAT, iStart, iShift, 0);
+
+		// Resize any open substreams for this file
+		for (EntryStream *sub = pFAT->openStreams; sub; sub = sub->next) {
+			sub->resize(newStoredSize);
+		}
+	} // else only realSize changed
+
+	return;
+}
+
+void FATArchive::flush()
+{
+	// Formats with a cached FAT have already written it out by the time we get
+	// here, so it's too late to apply any held back offset changes.
+	if (this->inTransaction) {
+		throw stream::error("BUG: Cannot flush an archive during a transaction, "
+			"commit the transaction instead.");
+	}
+
+	// Files still open for writing may have space reserved past their data,
+	// which must not be written out as part of the file, and files that have
+	// moved still need their new offsets written to the FAT.  Formats with a
+	// cached FAT have already done this before writing it.
+	this->prepareFlush();
+
+	// Writing to the archive will change the caller's stamp for it, so any
+	// sidecar index is out of date from here on.  The next open rebuilds it.
+	if (this->indexCache) {
+		this->indexCache->truncate(0);
+		this->indexCache->flush();
+		this->indexCache.reset();
+	}
+
+	// A deferred FAT goes back in, after all the file data, just for the write
+	if (this->deferFAT) this->attachFAT();
+
+	// Write out to the underlying stream
+	if (this->psRewrite) this->rewriteArchive();
+	else this->psArchive->flush();
+
+	if (this->deferFAT) this->detachFAT();
+	return;
+}
+
+void FATArchive::compact(stream::inout_sptr dest)
+{
+	// TESTED BY: test_archive::test_compact
+	assert(dest);
+	assert(dest != this->psParent);
+	this->flushRewrite(dest);
+	return;
+}
+
+void FATArchive::flushTo(stream::inout_sptr dest)
+{
+	// TESTED BY: test_archive::test_flush_to
+	assert(dest);
+	assert(dest != this->psParent);
+	this->flushRewrite(dest);
+	return;
+}
+
+void FATArchive::flushRewrite(stream::inout_sptr dest)
+{
+	if (this->inTransaction) {
+		throw stream::error("BUG: Cannot rewrite an archive during a transaction, "
+			"commit the transaction first.");
+	}
+
+	this->loadAllEntries();
+	this->trimOpenStreams();
+
+	// Squeeze out any gaps before the format handler writes out its FAT
+	if (this->sparse) this->closeGaps();
+
+	// Go through the usual flush() so the format handler writes out any cached
+	// FAT first, but have it rewrite the archive instead of patching it.
+	this->psRewrite = dest;
+	try {
+		this->flush();
+	} catch (...) {
+		this->psRewrite.reset();
+		this->rewriteExtents.clear();
+		throw;
+	}
+	this->psRewrite.reset();
+	return;
+}
+
+bool FATArchive::setOutOfPlace(bool outOfPlace)
+{
+	// TESTED BY: test_archive::test_flush_to_write
+	if (this->inTransaction) {
+		throw stream::error("BUG: Cannot change where changes are written during "
+			"a transaction.");
+	}
+	if (outOfPlace == this->outOfPlace) return true;
+	if (outOfPlace) {
+		// From here on psArchive only records changes on top of psParent, which
+		// is left alone until rewriteArchive() writes everything to a new stream.
+		this->psArchive->beginStaging();
+	} else {
+		// Put everything held back into the original stream after all
+		this->psArchive->commitStaged();
+	}
+	this->outOfPlace = outOfPlace;
+	return true;
+}
+
+bool FATArchive::setSparseLayout(bool sparse)
+{
+	if (this->inTransaction) {
+		throw stream::error("BUG: Cannot change the archive layout during a "
+			"transaction.");
+	}
+	if (sparse && !this->canBeSparse()) return false;
+	if (!sparse) {
+		// Files can't overlap in a packed archive
+		this->setDeduplication(false);
+		if (this->lenShared) {
+			this->resolveAllEntries();
+			const VC_FATENTRY& entries = this->getFATEntries();
+			for (VC_FATENTRY::const_iterator i = entries.begin();
+				i != entries.end();
+				i++
+			) {
+				this->unshareEntry(*i);
+			}
+		}
+		this->clearGapIndex();
+	}
+	this->sparse = sparse;
+	return true;
+}
+
+bool FATArchive::setDeduplication(bool dedup)
+{
+	if (this->inTransaction) {
+		throw stream::error("BUG: Cannot change the archive layout during a "
+			"transaction.");
+	}
+	if (!dedup) {
+		this->dedup = false;
+		this->hashIndex.clear();
+		return true;
+	}
+	if (this->dedup) return true;
+	if (!this->setSparseLayout(true)) return false;
+
+	// Index the files already in the archive, linking up any that already
+	// point at the same data.
+	this->loadAllEntries();
+	this->resolveAllEntries();
+	std::map<EXTENT, FATEntry *> seen;
+	for (VC_ENTRYPTR::const_iterator i = this->vcFAT.begin();
+		i != this->vcFAT.end();
+		i++
+	) {
+		FATEntry *pFAT = dynamic_cast<FATEntry *>(i->get());
+		if ((pFAT->storedSize == 0) || (pFAT->lenHeader != 0)) continue;
+		EXTENT data(pFAT->iOffset, pFAT->storedSize);
+		std::map<EXTENT, FATEntry *>::iterator s = seen.find(data);
+		if (s != seen.end()) {
+			if (!pFAT->nextShared) this->linkShared(pFAT, s->second);
+			continue;
+		}
+		seen[data] = pFAT;
+		this->psArchive->seekg(pFAT->iOffset, stream::start);
+		uint64_t hash = hashData(this->psArchive, pFAT->storedSize);
+		this->hashIndex.insert(HASH_INDEX::value_type(hash, *i));
+	}
+	this->dedup = true;
+	return true;
+}
+
+stream::len FATArchive::getDeduplicatedSize() const
+{
+	return this->lenShared;
+}
+
+bool FATArchive::setDeferredFAT(bool defer)
+{
+	// TESTED BY: test_archive::test_deferred_fat
+	if (this->inTransaction) {
+		throw stream::error("BUG: Cannot change the archive layout during a "
+			"transaction.");
+	}
+	if (defer == this->deferFAT) return true;
+	if (defer) {
+		if (!this->detachFAT()) return false;
+	} else {
+		this->attachFAT();
+	}
+	this->deferFAT = defer;
+	return true;
+}
+
+int FATArchive::getSupportedAttributes() const
+{
+	return 0;
+}
+
+void FATArchive::beginTransaction()
+{
+	// TESTED BY: test_archive::test_transaction_*
+	assert(!this->inTransaction);
+
+	// Aborting puts the archive back without any space set aside for files
+	// being written, so there mustn't be any to begin with.
+	this->trimOpenStreams();
+
+	// From here on psArchive only records changes, the stream underneath keeps
+	// the archive as it is now until the transaction is committed.
+	this->psArchive->beginStaging();
+
+	if (this->sparse) {
+		// Putting back a file's FAT entry may not put it back in the same gap,
+		// so remember where everything is.
+		this->resolveAllEntries();
+		for (VC_ENTRYPTR::const_iterator i = this->vcFAT.begin();
+			i != this->vcFAT.end();
+			i++
+		) {
+			this->txnOffsets[*i] = dynamic_cast<const FATEntry *>(i->get())->iOffset;
+		}
+	}
+	this->inTransaction = true;
+	return;
+}
+
+void FATArchive::commitTransaction()
+{
+	// TESTED BY: test_archive::test_transaction_commit
+	assert(this->inTransaction);
+
+	// Apply the final layout to the stream in one pass, then bring the FAT
+	// into line with it.
+	this->psArchive->commitStaged();
+	this->writeChangedOffsets();
+	this->undoLog.clear();
+	this->txnOffsets.clear();
+	this->inTransaction = false;
+
+	this->flush();
+	return;
+}
+
+void FATArchive::abortTransaction()
+{
+	// TESTED BY: test_archive::test_transaction_abort
+	assert(this->inTransaction);
+
+	UNDO_LOG log;
+	log.swap(this->undoLog);
+	std::map<EntryPtr, stream::pos> offsets;
+	offsets.swap(this->txnOffsets);
+
+	// The archive data will be put back by discarding the staged changes, but
+	// the FAT entries and anything the format handler keeps outside psArchive
+	// (cached or external FATs, file counts) are only put back by reversing
+	// each change.  Since nothing is written, none of the file data needs to
+	// be restored along the way.
+
+	// Files that were removed and have now been put back, so later (earlier)
+	// changes referring to the old entry can find the new one.
+	std::map<EntryPtr, EntryPtr> restored;
+
+	// Any space set aside since the transaction began goes too
+	this->trimOpenStreams();
+
+	for (UNDO_LOG::reverse_iterator i = log.rbegin(); i != log.rend(); i++) {
+		EntryPtr id = i->id;
+		std::map<EntryPtr, EntryPtr>::iterator r = restored.find(id);
+		if (r != restored.end()) id = r->second;
+
+		switch (i->action) {
+			case UndoRecord::Inserted:
+				this->remove(id);
+				break;
+
+			case UndoRecord::Removed: {
+				// The archive is now as it was just after the removal, so whichever
+				// file has taken over the removed file's index is the one it was
+				// originally in front of.
+				EntryPtr idBeforeThis;
+				this->resolveAllEntries();
+				const VC_FATENTRY& entries = this->getFATEntries();
+				for (unsigned int j = 0; j < entries.size(); j++) {
+					if (entries[j]->iIndex == i->index) {
+						idBeforeThis = this->vcFAT[j];
+						break;
+					}
+				}
+				EntryPtr n = this->insert(idBeforeThis, i->name, i->storedSize,
+					i->type, i->attr);
+				if (n->realSize != i->realSize) {
+					this->resize(n, i->storedSize, i->realSize);
+				}
+				restored[i->id] = n;
+				break;
+			}
+
+			case UndoRecord::Resized:
+				this->resize(id, i->storedSize, i->realSize);
+				break;
+
+			case UndoRecord::Renamed:
+				this->rename(id, i->name);
+				break;
+
+			case UndoRecord::Moved: {
+				// Put it back in front of whichever file is now at its old index, or
+				// the one after that if it has to move further down the FAT.
+				const FATEntry *pFAT = dynamic_cast<const FATEntry *>(id.get());
+				this->resolveAllEntries();
+				unsigned int indexBefore = i->index;
+				if (indexBefore > pFAT->iIndex) indexBefore++;
+				EntryPtr idBeforeThis;
+				const VC_FATENTRY& entries = this->getFATEntries();
+				for (unsigned int j = 0; j < entries.size(); j++) {
+					if (entries[j]->iIndex == indexBefore) {
+						idBeforeThis = this->vcFAT[j];
+						break;
+					}
+				}
+				this->move(idBeforeThis, id);
+				break;
+			}
+		}
+	}
+
+	// Discard the changes recorded while undoing
+	this->undoLog.clear();
+
+	// Bring any cached FAT into line with the offsets, then throw away every
+	// change made to the archive data, leaving it exactly as it was.
+	this->writeChangedOffsets();
+	this->psArchive->discardStaged();
+	this->inTransaction = false;
+
+	if (!offsets.empty()) {
+		// Sparse archives may have put files back somewhere else, but their data
+		// is still where it was to begin with.
+		for (std::map<EntryPtr, stream::pos>::const_iterator
+			o = offsets.begin(); o != offsets.end(); o++
+		) {
+			EntryPtr id = o->first;
+			std::map<EntryPtr, EntryPtr>::iterator r = restored.find(id);
+			if (r != restored.end()) id = r->second;
+			FATEntry *pFAT = dynamic_cast<FATEntry *>(id.get());
+			this->resolveEntry(pFAT);
+			if (pFAT->iOffset == o->second) continue;
+			stream::delta delta = o->second - pFAT->iOffset;
+			this->removeFromOffsetTree(pFAT);
+			pFAT->iOffset = o->second;
+			this->addToOffsetTree(pFAT);
+			for (EntryStream *sub = pFAT->openStreams; sub; sub = sub->next) {
+				sub->relocate(delta);
+			}
+		}
+		this->writeChangedOffsets();
+	}
+	return;
+}
+
+void FATArchive::shiftFiles(const FATEntry *fatSkip, stream::pos offStart,
+	stream::delta deltaOffset, int deltaIndex)
+{
+	this->checkOffsetTree();
+
+	// Work out which open substreams will need relocating, before any of the
+	// offsets change.
+	std::vector<FATEntry *> moveEntries;
+	for (FATEntry *pFAT = this->openEntries; pFAT; pFAT = pFAT->nextOpen) {
+		this->resolveEntry(pFAT);
+		if (this->entryInRange(pFAT, offStart, fatSkip)) {
+			moveEntries.push_back(pFAT);
+		}
+	}
+
+	// Everything from the first file at or after offStart gets shifted, except
+	// for fatSkip and any zero-length files sharing its offset that come before
+	// it.  These are all next to each other in the tree, so find them now and
+	// put them back after the shift.
+	std::vector<FATEntry *> skipped;
+	if ((fatSkip) && (fatSkip->bValid)) {
+		this->resolveEntry(fatSkip);
+		if (fatSkip->iOffset >= offStart) {
+			OffsetNode *n = nodeAt(this->offsetRoot,
+				countBefore(this->offsetRoot, fatSkip->iOffset));
+			for (; n; n = nextNode(n)) {
+				pushPath(n);
+				if (n->entry->iOffset != fatSkip->iOffset) break;
+				if (!this->entryInRange(n->entry, offStart, fatSkip)) {
+					skipped.push_back(n->entry);
+				}
+			}
+		}
+	}
+
+	unsigned int first = countBefore(this->offsetRoot, offStart);
+	addFrom(this->offsetRoot, first, deltaOffset, deltaIndex);
+	for (std::vector<FATEntry *>::iterator i = skipped.begin();
+		i != skipped.end();
+		i++
+	) {
+		(*i)->iOffset -= deltaOffset;
+		(*i)->iIndex -= deltaIndex;
+	}
+
+	// Only the gaps either side of the files that didn't move have changed
+	if (this->gapsCurrent) {
+		if (first > 0) this->refreshGap(nodeAt(this->offsetRoot, first - 1));
+		for (std::vector<FATEntry *>::iterator i = skipped.begin();
+			i != skipped.end();
+			i++
+		) {
+			OffsetNode *n = (*i)->offsetNode;
+			if (OffsetNode *prev = prevNode(n)) this->refreshGap(prev);
+			this->refreshGap(n);
+			if (OffsetNode *next = nextNode(n)) this->refreshGap(next);
+		}
+	}
+
+	// Leave the shift pending, entries will pick it up as they are accessed.
+	// The FAT is brought up to date for every file that moved in one go, when
+	// the transaction is committed or the archive is flushed.
+	// TESTED BY: test_archive::test_remove, test_archive::test_insert_mid
+	// TESTED BY: test_archive::test_transaction_*
+	this->offsetsPending = true;
+	this->offsetsUnwritten = true;
+
+	// Relocate any open substreams
+	for (std::vector<FATEntry *>::iterator i = moveEntries.begin();
+		i != moveEntries.end();
+		i++
+	) {
+		for (EntryStream *sub = (*i)->openStreams; sub; sub = sub->next) {
+			sub->relocate(deltaOffset);
+		}
+	}
+
+	return;
+}
+
+FATArchive::FATEntry *FATArchive::preInsertFile(const FATEntry *idBeforeThis,
+	FATEntry *pNewEntry)
+{
+	// No-op default
+	return NULL;
+}
+
+void FATArchive::postInsertFile(FATEntry *pNewEntry)
+{
+	// No-op default
+}
+
+void FATArchive::preRemoveFile(const FATEntry *pid)
+{
+	// No-op default
+}
+
+void FATArchive::postRemoveFile(const FATEntry *pid)
+{
+	// No-op default
+}
+
+FATArchive::FATEntryPtr FATArchive::createNewFATEntry()
+{
+	return FATArchive::newFATEntry();
+}
+
+FATArchive::FATEntryPtr FATArchive::newFATEntry()
+{
+	return FATArchive::allocEntry<FATEntry>();
+}
+
+bool FATArchive::canBeSparse() const
+{
+	return false;
+}
+
+bool FATArchive::detachFAT()
+{
+	return false;
+}
+
+void FATArchive::attachFAT()
+{
+	return;
+}
+
+void FATArchive::setLazyFAT(unsigned int numFiles, stream::pos offFAT,
+	stream::len lenRecord)
+{
+	assert(this->vcFAT.empty());
+	this->lenLazyFAT = numFiles;
+	this->offLazyFAT = offFAT;
+	this->lenLazyRecord = lenRecord;
+	this->lazyEntries.clear();
+	this->lazyEntries.resize(numFiles);
+	this->lazyPage.clear();
+	this->lazyNameIndex.clear();
+	return;
+}
+
+void FATArchive::loadFATEntry(const uint8_t *record, FATEntry *pEntry) const
+{
+	throw stream::error("BUG: Archive format uses setLazyFAT() but doesn't "
+		"implement loadFATEntry()");
+}
+
+std::string FATArchive::loadFATName(const uint8_t *record) const
+{
+	FATEntryPtr scratch = const_cast<FATArchive *>(this)->createNewFATEntry();
+	this->loadFATEntry(record, scratch.get());
+	return scratch->strName;
+}
+
+bool FATArchive::loadIndex(stream::inout_sptr index, uint64_t stamp)
+{
+	// TESTED BY: test_archive::test_open_indexed
+	assert(this->vcFAT.empty());
+	this->indexCache = index;
+	this->indexStamp = stamp;
+	if (!index) return false;
+
+	stream::len lenIndex = index->size();
+	if (lenIndex < FAT_INDEX_SIG_LEN) return false;
+
+	// Pull the whole index into memory with a single read
+	std::string raw(lenIndex, '\0');
+	index->seekg(0, stream::start);
+	index->read(&raw[0], lenIndex);
+	stream::string_sptr content(new stream::string());
+	content->write(raw);
+	content->seekg(0, stream::start);
+
+	VC_ENTRYPTR entries;
+	stream::len lenArchive = this->psArchive->size();
+	try {
+		std::string sig;
+		uint16_t version;
+		uint64_t stampIndex, lenIndexed, hash;
+		uint32_t numFiles;
+		content
+			>> nullPadded(sig, FAT_INDEX_SIG_LEN)
+			>> u16le(version)
+			>> u64le(stampIndex)
+			>> u64le(lenIndexed)
+			>> u64le(hash)
+			>> u32le(numFiles)
+		;
+		if (
+			(sig.compare(FAT_INDEX_SIG) != 0)
+			|| (version != FAT_INDEX_VERSION)
+			|| (stampIndex != stamp)
+			|| (lenIndexed != lenArchive)
+			|| (hash != sampleHash(this->psArchive, lenArchive))
+		) {
+			// Index is for a different archive, or this one has changed since
+			return false;
+		}
+
+		for (unsigned int i = 0; i < numFiles; i++) {
+			FATEntryPtr fatEntry = FATArchive::newFATEntry();
+			EntryPtr ep(fatEntry);
+
+			uint32_t attr;
+			uint16_t lenName, lenType, lenFilter;
+			content
+				>> u64le(fatEntry->iOffset)
+				>> u64le(fatEntry->lenHeader)
+				>> u64le(fatEntry->storedSize)
+				>> u64le(fatEntry->realSize)
+				>> u32le(attr)
+				>> u16le(lenName)
+			;
+			content >> fixedLength(fatEntry->strName, lenName) >> u16le(lenType);
+			content >> fixedLength(fatEntry->type, lenType) >> u16le(lenFilter);
+			content >> fixedLength(fatEntry->filter, lenFilter);
+
+			if (fatEntry->iOffset + fatEntry->lenHeader + fatEntry->storedSize
+				> lenArchive
+			) {
+				return false;
+			}
+			fatEntry->iIndex = i;
+			fatEntry->fAttr = attr;
+			fatEntry->bValid = true;
+			entries.push_back(ep);
+		}
+	} catch (const stream::error&) {
+		// Truncated index
+		return false;
+	}
+	this->vcFAT.swap(entries);
+	this->fatChanged();
+	return true;
+}
+
+void FATArchive::saveIndex()
+{
+	// TESTED BY: test_archive::test_open_indexed
+	if (!this->indexCache) return;
+
+	stream::len lenArchive = this->psArchive->size();
+	stream::string_sptr content(new stream::string());
+	content
+		<< nullPadded(FAT_INDEX_SIG, FAT_INDEX_SIG_LEN)
+		<< u16le(FAT_INDEX_VERSION)
+		<< u64le(this->indexStamp)
+		<< u64le(lenArchive)
+		<< u64le(sampleHash(this->psArchive, lenArchive))
+		<< u32le(this->vcFAT.size())
+	;
+	for (VC_ENTRYPTR::const_iterator i = this->vcFAT.begin(); i != this->vcFAT.end(); i++) {
+		const FATEntry *pFAT = dynamic_cast<const FATEntry *>(i->get());
+		content
+			<< u64le(pFAT->iOffset)
+			<< u64le(pFAT->lenHeader)
+			<< u64le(pFAT->storedSize)
+			<< u64le(pFAT->realSize)
+			<< u32le(pFAT->fAttr)
+			<< u16le(pFAT->strName.length())
+			<< nullPadded(pFAT->strName, pFAT->strName.length())
+			<< u16le(pFAT->type.length())
+			<< nullPadded(pFAT->type, pFAT->type.length())
+			<< u16le(pFAT->filter.length())
+			<< nullPadded(pFAT->filter, pFAT->filter.length())
+		;
+	}
+
+	// Replace the old index with a single write
+	const std::string& data = *content->str();
+	this->indexCache->seekp(0, stream::start);
+	this->indexCache->write(data);
+	this->indexCache->truncate(data.length());
+	this->indexCache->flush();
+	return;
+}
+
+bool FATArchive::moveFATEntry(const FATEntry *pid, unsigned int newIndex)
+{
+	return false;
+}
+
+void FATArchive::moveRecord(stream::inout_sptr content, stream::pos offTable,
+	stream::len lenRecord, unsigned int oldIndex, unsigned int newIndex)
+{
+	if (newIndex > oldIndex) {
+		FATArchive::swapBlocks(content, offTable + oldIndex * lenRecord,
+			lenRecord, (newIndex - oldIndex) * lenRecord);
+	} else {
+		FATArchive::swapBlocks(content, offTable + newIndex * lenRecord,
+			(oldIndex - newIndex) * lenRecord, lenRecord);
+	}
+	return;
+}
+
+void FATArchive::swapBlocks(stream::inout_sptr content, stream::pos off,
+	stream::len lenFirst, stream::len lenSecond)
+{
+	if ((lenFirst == 0) || (lenSecond == 0)) return;
+
+	const stream::len lenChunk = 65536;
+	std::string buf;
+	if (lenFirst <= lenSecond) {
+		// Keep the first block and slide the second one down over it
+		std::string first(lenFirst, '\0');
+		content->seekg(off, stream::start);
+		content->read(&first[0], lenFirst);
+		for (stream::len done = 0; done < lenSecond; ) {
+			buf.resize(std::min(lenChunk, lenSecond - done));
+			content->seekg(off + lenFirst + done, stream::start);
+			content->read(&buf[0], buf.length());
+			content->seekp(off + done, stream::start);
+			content->write(buf.data(), buf.length());
+			done += buf.length();
+		}
+		content->seekp(off + lenSecond, stream::start);
+		content->write(first.data(), lenFirst);
+	} else {
+		// Keep the second block and slide the first one up, starting at the end
+		// so it doesn't overwrite itself.
+		std::string second(lenSecond, '\0');
+		content->seekg(off + lenFirst, stream::start);
+		content->read(&second[0], lenSecond);
+		for (stream::len left = lenFirst; left > 0; ) {
+			buf.resize(std::min(lenChunk, left));
+			left -= buf.length();
+			content->seekg(off + left, stream::start);
+			content->read(&buf[0], buf.length());
+			content->seekp(off + lenSecond + left, stream::start);
+			content->write(buf.data(), buf.length());
+		}
+		content->seekp(off, stream::start);
+		content->write(second.data(), lenSecond);
+	}
+	return;
+}
+
+void FATArchive::writeChangedOffsets()
+{
+	this->offsetsUnwritten = false;
+	this->checkOffsetTree();
+	this->resolveAllEntries();
+	const VC_FATENTRY& entries = this->getFATEntries();
+	WriteCache::Batch batch(this->psArchive.get());
+	for (VC_FATENTRY::const_iterator i = entries.begin(); i != entries.end(); i++) {
+		FATEntry *pFAT = *i;
+		if (pFAT->iOffset != pFAT->offDisk) {
+			this->updateFileOffset(pFAT, pFAT->iOffset - pFAT->offDisk);
+			pFAT->offDisk = pFAT->iOffset;
+		}
+	}
+	batch.end();
+	return;
+}
+
+void FATArchive::resolveEntry(const FATEntry *pid) const
+{
+	if (pid->offsetNode) pushPath(pid->offsetNode);
+	return;
+}
+
+void FATArchive::checkOffsetTree() const
+{
+	if (nodeCount(this->offsetRoot) == this->vcFAT.size()) {
+#ifdef DEBUG
+		// Counting the nodes only catches entries added behind our back, so make
+		// sure the tree itself is sound and really holds every entry.
+		stream::pos offPrev = 0;
+		unsigned int count = verifyNodes(this->offsetRoot, NULL, 0, &offPrev);
+		assert(count == this->vcFAT.size());
+		const VC_FATENTRY& entries = this->getFATEntries();
+		for (VC_FATENTRY::const_iterator i = entries.begin(); i != entries.end(); i++) {
+			assert((*i)->offsetNode);
+		}
+		for (GAP_INDEX::const_iterator i = this->gapIndex.begin();
+			i != this->gapIndex.end();
+			i++
+		) {
+			OffsetNode *n = i->second;
+			OffsetNode *next = nextNode(n);
+			assert(n->hasGap && next);
+			pushPath(next);
+			assert(next->entry->iOffset == groupEnd(n) + i->first);
+		}
+		if (this->gapsCurrent && this->offsetRoot) {
+			// ...and that no gap has been missed
+			unsigned int numGaps = 0;
+			OffsetNode *n = this->offsetRoot;
+			while (n->left) n = n->left;
+			for (OffsetNode *next; n; n = next) {
+				next = nextNode(n);
+				if (n->hasGap) numGaps++;
+				if (!next) break;
+				pushPath(next);
+				if (next->entry->iOffset == n->entry->iOffset) continue;
+				assert(n->hasGap == (next->entry->iOffset > groupEnd(n)));
+			}
+			assert(numGaps == this->gapIndex.size());
+		}
+#endif
+		return;
+	}
+
+	// The format handler has added entries to vcFAT directly, so start again.
+	// Any entry not already in the tree has its offset straight from the FAT.
+	this->resolveAllEntries();
+	std::vector<FATEntry *> entries(this->getFATEntries());
+	for (std::vector<FATEntry *>::iterator i = entries.begin();
+		i != entries.end();
+		i++
+	) {
+		if (!(*i)->offsetNode) (*i)->offDisk = (*i)->iOffset;
+	}
+	this->clearGapIndex();
+	deleteNodes(this->offsetRoot);
+	this->offsetRoot = NULL;
+
+	std::stable_sort(entries.begin(), entries.end(), entryBefore);
+	for (std::vector<FATEntry *>::iterator i = entries.begin();
+		i != entries.end();
+		i++
+	) {
+		this->addToOffsetTree(*i);
+	}
+	return;
+}
+
+void FATArchive::resolveAllEntries() const
+{
+	if (!this->offsetsPending) return;
+	pushAll(this->offsetRoot);
+	this->offsetsPending = false;
+	return;
+}
+
+void FATArchive::addToOffsetTree(FATEntry *pid) const
+{
+	assert(!pid->offsetNode);
+
+	OffsetNode *node = new OffsetNode();
+	node->entry = pid;
+	node->left = node->right = node->parent = NULL;
+	this->offsetSeed = this->offsetSeed * 1103515245 + 12345;
+	node->priority = this->offsetSeed >> 8;
+	node->count = 1;
+	node->offDelta = 0;
+	node->indexDelta = 0;
+	node->hasGap = false;
+	pid->offsetNode = node;
+
+	// Find where it goes
+	unsigned int rank = 0;
+	for (OffsetNode *n = this->offsetRoot; n; ) {
+		pushNode(n);
+		if (entryBefore(n->entry, pid)) {
+			rank += nodeCount(n->left) + 1;
+			n = n->right;
+		} else {
+			n = n->left;
+		}
+	}
+
+	OffsetNode *l, *r;
+	splitNodes(this->offsetRoot, rank, &l, &r);
+	this->offsetRoot = mergeNodes(mergeNodes(l, node), r);
+	this->offsetRoot->parent = NULL;
+
+	if (this->gapsCurrent) {
+		// TESTED BY: test_archive::test_sparse_layout
+		if (OffsetNode *prev = prevNode(node)) this->refreshGap(prev);
+		this->refreshGap(node);
+	}
+	return;
+}
+
+void FATArchive::removeFromOffsetTree(FATEntry *pid) const
+{
+	OffsetNode *node = pid->offsetNode;
+	assert(node);
+	pushPath(node);
+	OffsetNode *prev = prevNode(node);
+	OffsetNode *next = nextNode(node);
+	if (node->hasGap) {
+		this->gapIndex.erase(node->gap);
+		node->hasGap = false;
+	}
+
+	OffsetNode *l, *mid, *r;
+	splitNodes(this->offsetRoot, nodeRank(node), &l, &r);
+	splitNodes(r, 1, &mid, &r);
+	assert(mid == node);
+	this->offsetRoot = mergeNodes(l, r);
+	if (this->offsetRoot) this->offsetRoot->parent = NULL;
+
+	pid->offsetNode = NULL;
+	delete node;
+
+	if (prev) this->refreshGap(prev);
+	if (next) this->refreshGap(next);
+	return;
+}
+
+std::string FATArchive::readEntryData(const FATEntry *pFAT, stream::pos off,
+	stream::len len)
+{
+	std::string data;
+	if (len == 0) return data;
+	this->resolveEntry(pFAT);
+	data.resize(len);
+	this->psArchive->seekg(pFAT->iOffset + pFAT->lenHeader + off, stream::start);
+	this->psArchive->read(&data[0], len);
+	return data;
+}
+
+void FATArchive::writeEntryData(const FATEntry *pFAT, stream::pos off,
+	const std::string& data)
+{
+	if (data.empty()) return;
+	this->resolveEntry(pFAT);
+	this->psArchive->seekp(pFAT->iOffset + pFAT->lenHeader + off, stream::start);
+	this->psArchive->write(data.data(), data.length());
+	return;
+}
+
+void FATArchive::readLazyEntry(unsigned int index, FATEntry *pEntry) const
+{
+	// Number of FAT records read from the archive at a time
+	const unsigned int lenPage = 256;
+
+	if ((this->lazyPage.empty())
+		|| (index < this->lazyPageFirst)
+		|| (index >= this->lazyPageFirst
+			+ this->lazyPage.size() / this->lenLazyRecord)
+	) {
+		this->lazyPageFirst = index - index % lenPage;
+		unsigned int numRecords = std::min(lenPage,
+			this->lenLazyFAT - this->lazyPageFirst);
+		readFATRecords(this->psArchive,
+			this->offLazyFAT + this->lazyPageFirst * this->lenLazyRecord,
+			numRecords, this->lenLazyRecord, &this->lazyPage);
+	}
+
+	pEntry->iIndex = index;
+	pEntry->bValid = true;
+	this->loadFATEntry(
+		&this->lazyPage[(index - this->lazyPageFirst) * this->lenLazyRecord],
+		pEntry);
+	return;
+}
+
+void FATArchive::loadAllEntries() const
+{
+	if (!this->lenLazyFAT) return;
+
+	// TESTED BY: test_archive::test_find_then_list
+	assert(this->vcFAT.empty());
+	VC_ENTRYPTR entries;
+	entries.reserve(this->lenLazyFAT);
+	for (unsigned int i = 0; i < this->lenLazyFAT; i++) {
+		EntryPtr& slot = this->lazyEntries[i];
+		if (!slot) {
+			FATEntryPtr pEntry = const_cast<FATArchive *>(this)->createNewFATEntry();
+			slot = pEntry;
+			this->readLazyEntry(i, pEntry.get());
+		}
+		entries.push_back(slot);
+	}
+	this->vcFAT.swap(entries);
+	this->fatChanged();
+	this->lenLazyFAT = 0;
+	this->lazyEntries.clear();
+	this->lazyPage.clear();
+	this->lazyNameIndex.clear();
+	return;
 }
 
-void FATArchive::remove(EntryPtr id)
+void FATArchive::buildLazyNameIndex() const
 {
-	// TESTED BY: fmt_grp_duke3d_remove
-	// TESTED BY: fmt_grp_duke3d_remove2
-	// TESTED BY: fmt_grp_duke3d_remove_insert
-	// TESTED BY: fmt_grp_duke3d_insert_remove
-
-	// Make sure the caller doesn't try to remove something that doesn't exist!
-	assert(this->isValid(id));
-
-	FATEntry *pFATDel = dynamic_cast<FATEntry *>(id.get());
-	assert(pFATDel);
+	// Number of FAT records read from the archive at a time
+	const unsigned int lenPage = 256;
+
+	std::vector<uint8_t> page;
+	for (unsigned int first = 0; first < this->lenLazyFAT; first += lenPage) {
+		unsigned int numRecords = std::min(lenPage, this->lenLazyFAT - first);
+		readFATRecords(this->psArchive,
+			this->offLazyFAT + (stream::pos)first * this->lenLazyRecord,
+			numRecords, this->lenLazyRecord, &page);
+		for (unsigned int i = 0; i < numRecords; i++) {
+			// Keep the first file with each name, as a search would find
+			std::string key = nameIndexKey(
+				this->loadFATName(&page[i * this->lenLazyRecord]));
+			this->lazyNameIndex.insert(LAZY_NAME_INDEX::value_type(key, first + i));
+		}
+	}
+	return;
+}
 
-	// Remove the file's entry from the FAT
-	this->preRemoveFile(pFATDel);
+const FATArchive::VC_FATENTRY& FATArchive::getFATEntries() const
+{
+	if (!this->isTypedFATCurrent()) {
+		// The format handler has changed vcFAT directly, so start again.
+		this->typedFAT.clear();
+		this->typedFAT.reserve(this->vcFAT.size());
+		for (VC_ENTRYPTR::const_iterator i = this->vcFAT.begin();
+			i != this->vcFAT.end();
+			i++
+		) {
+			FATEntry *pFAT = dynamic_cast<FATEntry *>(i->get());
+			assert(pFAT);
+			this->typedFAT.push_back(pFAT);
+		}
+		this->revTypedFAT = this->fatRevision;
+	}
+	return this->typedFAT;
+}
 
-	// Remove the entry from the vector
-	VC_ENTRYPTR::iterator itErase = std::find(this->vcFAT.begin(), this->vcFAT.end(), id);
-	assert(itErase != this->vcFAT.end());
-	this->vcFAT.erase(itErase);
+void FATArchive::fatChanged() const
+{
+	this->fatRevision++;
+	return;
+}
 
-	// Update the offsets of any files located after this one (since they will
-	// all have been shifted back to fill the gap made by the removal.)
-	this->shiftFiles(
-		pFATDel,
-		pFATDel->iOffset,
-		-((stream::delta)pFATDel->storedSize + (stream::delta)pFATDel->lenHeader),
-		-1
-	);
+bool FATArchive::isNameIndexCurrent() const
+{
+	return this->revNameIndex == this->fatRevision;
+}
 
-	// Remove the file's data from the archive
-	this->psArchive->seekp(pFATDel->iOffset, stream::start);
-	this->psArchive->remove(pFATDel->storedSize + pFATDel->lenHeader);
+bool FATArchive::isTypedFATCurrent() const
+{
+	return this->revTypedFAT == this->fatRevision;
+}
 
-	// Mark it as invalid in case some other code is still holding on to it.
-	pFATDel->bValid = false;
+void FATArchive::rebuildNameIndex() const
+{
+	this->nameIndex.clear();
+	const VC_FATENTRY& entries = this->getFATEntries();
+	for (unsigned int i = 0; i < entries.size(); i++) {
+		this->addToNameIndex(this->vcFAT[i], entries[i]);
+	}
+	this->revNameIndex = this->fatRevision;
+	return;
+}
 
-	this->postRemoveFile(pFATDel);
+void FATArchive::addToNameIndex(const EntryPtr& id, const FATEntry *pFAT) const
+{
+	VC_ENTRYPTR& matches = this->nameIndex[nameIndexKey(pFAT->strName)];
+
+	// Keep duplicate names sorted by their position in the FAT.  Entries are
+	// usually loaded in order, so start looking from the end.
+	VC_ENTRYPTR::iterator i = matches.end();
+	this->resolveEntry(pFAT);
+	while (i != matches.begin()) {
+		const FATEntry *pPrev = dynamic_cast<const FATEntry *>((i - 1)->get());
+		this->resolveEntry(pPrev);
+		if (pPrev->iIndex <= pFAT->iIndex) break;
+		i--;
+	}
+	matches.insert(i, id);
+	return;
+}
 
+void FATArchive::removeFromNameIndex(const EntryPtr& id,
+	const std::string& name) const
+{
+	NAME_INDEX::iterator i = this->nameIndex.find(nameIndexKey(name));
+	assert(i != this->nameIndex.end());
+	VC_ENTRYPTR::iterator j = std::find(i->second.begin(), i->second.end(), id);
+	assert(j != i->second.end());
+	i->second.erase(j);
+	if (i->second.empty()) this->nameIndex.erase(i);
 	return;
 }
 
-void FATArchive::rename(EntryPtr id, const std::string& strNewName)
+void FATArchive::rewriteArchive()
 {
-	// TESTED BY: fmt_grp_duke3d_rename
-	assert(this->isValid(id));
-	FATEntry *pFAT = dynamic_cast<FATEntry *>(id.get());
+	// psArchive already holds the FAT followed by each file's data, in their
+	// final order, so reading it from start to end assembles the new archive.
+	std::vector<EXTENT> parts;
+	parts.swap(this->rewriteExtents);
+	if (parts.empty()) parts.push_back(EXTENT(0, this->psArchive->size()));
+
+	// Only copy the parts of the archive in use, leaving out any gaps, writing
+	// the whole thing out in one pass.
+	stream::len lenTotal = 0;
+	for (std::vector<EXTENT>::iterator i = parts.begin(); i != parts.end(); i++) {
+		lenTotal += i->second;
+	}
+	this->psRewrite->truncate(lenTotal);
+	this->psRewrite->seekp(0, stream::start);
+	for (std::vector<EXTENT>::iterator i = parts.begin(); i != parts.end(); i++) {
+		stream::input_sub_sptr part(new stream::input_sub());
+		part->open(this->psArchive, i->first, i->second);
+		stream::copy(this->psRewrite, part);
+	}
+	this->psRewrite->flush();
+
+	// Start again with no pending changes.  Open substreams are still valid as
+	// the content hasn't changed.  Out-of-place changes have all been written
+	// out now, so carry on staging from the new stream.
+	this->psParent = this->psRewrite;
+	if (this->outOfPlace) this->psArchive->discardStaged();
+	this->psArchive->open(this->psParent);
+	if (this->outOfPlace) this->psArchive->beginStaging();
+	return;
+}
 
-	// Make sure filename is within the allowed limit
-	if (
-		(this->lenMaxFilename > 0) &&
-		(strNewName.length() > this->lenMaxFilename)
+void FATArchive::closeGaps()
+{
+	this->checkOffsetTree();
+	this->clearGapIndex();
+	std::vector<FATEntry *> entries;
+	collectFrom(this->offsetRoot, 0, &entries);
+	if (entries.empty()) return;
+
+	// Everything before the first file (header, FAT) stays where it is
+	stream::pos offNext = entries.front()->iOffset;
+	this->rewriteExtents.clear();
+	this->rewriteExtents.push_back(EXTENT(0, offNext));
+
+	// Where the data shared by more than one file has been moved to, keyed by
+	// its original offset.
+	std::map<stream::pos, stream::pos> sharedMoved;
+
+	WriteCache::Batch batch(this->psArchive.get());
+	for (std::vector<FATEntry *>::iterator i = entries.begin();
+		i != entries.end();
+		i++
 	) {
-		throw stream::error(createString("maximum filename length is "
-			<< this->lenMaxFilename << " chars"));
+		FATEntry *pFAT = *i;
+		stream::len lenEntry = pFAT->lenHeader + pFAT->storedSize;
+		stream::pos offNew = offNext;
+		bool placed = false;
+		if (pFAT->nextShared) {
+			// TESTED BY: test_archive::test_dedup
+			std::map<stream::pos, stream::pos>::iterator s =
+				sharedMoved.find(pFAT->iOffset);
+			if (s != sharedMoved.end()) {
+				// Another file using this data has already been put somewhere
+				offNew = s->second;
+				placed = true;
+			} else {
+				sharedMoved[pFAT->iOffset] = offNew;
+			}
+		}
+		if (!placed) {
+			this->rewriteExtents.push_back(EXTENT(pFAT->iOffset, lenEntry));
+			offNext += lenEntry;
+		}
+		if (pFAT->iOffset != offNew) {
+			// The tree order doesn't change, so the entry can be updated in place
+			stream::delta offDelta = offNew - pFAT->iOffset;
+			pFAT->iOffset = offNew;
+			this->updateFileOffset(pFAT, offDelta);
+			pFAT->offDisk = pFAT->iOffset;
+			for (EntryStream *sub = pFAT->openStreams; sub; sub = sub->next) {
+				sub->relocate(offDelta);
+			}
+		}
 	}
+	batch.end();
 
-	this->updateFileName(pFAT, strNewName);
-	pFAT->strName = strNewName;
+	// Keep anything after the last file too
+	stream::pos offEnd = this->getDataEnd();
+	stream::len lenArchive = this->psArchive->size();
+	if (offEnd < lenArchive) {
+		this->rewriteExtents.push_back(EXTENT(offEnd, lenArchive - offEnd));
+	}
 	return;
 }
 
-void FATArchive::move(const EntryPtr idBeforeThis, EntryPtr id)
+bool FATArchive::findGap(stream::len len, const FATEntry *pIgnore,
+	stream::pos *off) const
 {
-	// Open the file we want to move
-	stream::inout_sptr src(this->open(id));
-	assert(src);
+	this->checkOffsetTree();
+	if (!this->gapsCurrent) this->rebuildGapIndex();
+
+	// Take pIgnore out of the tree while looking, so its space joins the gaps
+	// either side of it.
+	FATEntry *pHidden = const_cast<FATEntry *>(pIgnore);
+	if (pHidden) this->removeFromOffsetTree(pHidden);
+
+	// The first gap big enough is the smallest one that will do
+	// TESTED BY: test_archive::test_sparse_layout
+	GAP_INDEX::const_iterator i = this->gapIndex.lower_bound(len);
+	bool found = i != this->gapIndex.end();
+	if (found) *off = groupEnd(i->second);
+
+	if (pHidden) this->addToOffsetTree(pHidden);
+	return found;
+}
 
-	// Insert a new file at the destination index
-	EntryPtr n = this->insert(idBeforeThis, id->strName, id->storedSize,
-		id->type, id->fAttr);
-	assert(n->bValid);
+void FATArchive::rebuildGapIndex() const
+{
+	this->clearGapIndex();
+	this->gapsCurrent = true;
+	OffsetNode *n = this->offsetRoot;
+	if (!n) return;
+	while (n->left) n = n->left;
+	for (; n; n = nextNode(n)) this->refreshGap(n);
+	return;
+}
 
-	if (n->filter.compare(id->filter) != 0) {
-		this->remove(n);
-		throw stream::error("Cannot move file to this position (filter change)"
-			" - try removing and then adding it instead");
+void FATArchive::clearGapIndex() const
+{
+	for (GAP_INDEX::iterator i = this->gapIndex.begin();
+		i != this->gapIndex.end();
+		i++
+	) {
+		i->second->hasGap = false;
 	}
+	this->gapIndex.clear();
+	this->gapsCurrent = false;
+	return;
+}
 
-	stream::inout_sptr dst(this->open(n));
-	assert(dst);
-
-	// Copy the data into the new file's position
-	stream::copy(dst, src);
-	dst->flush();
-
-	// If there's a filter set then bring the unfiltered size across too.
-	if (!n->filter.empty()) {
-		this->resize(n, n->storedSize, id->realSize);
+void FATArchive::refreshGap(OffsetNode *n) const
+{
+	if (!this->gapsCurrent) return;
+	if (n->hasGap) {
+		this->gapIndex.erase(n->gap);
+		n->hasGap = false;
 	}
 
-	this->remove(id);
+	// Only the last of the files at the same offset holds the gap after them
+	pushPath(n);
+	OffsetNode *next;
+	while ((next = nextNode(n))) {
+		pushPath(next);
+		if (next->entry->iOffset != n->entry->iOffset) break;
+		n = next;
+		if (n->hasGap) {
+			this->gapIndex.erase(n->gap);
+			n->hasGap = false;
+		}
+	}
+	if (!next) return; // space after the last file isn't a gap
 
+	stream::pos offEnd = groupEnd(n);
+	if (next->entry->iOffset <= offEnd) return;
+	n->gap = this->gapIndex.insert(GAP_INDEX::value_type(
+		next->entry->iOffset - offEnd, n));
+	n->hasGap = true;
 	return;
 }
 
-void FATArchive::resize(EntryPtr id, stream::len newStoredSize,
-	stream::len newRealSize)
+stream::pos FATArchive::getDataEnd() const
 {
-	assert(this->isValid(id));
-	stream::delta iDelta = newStoredSize - id->storedSize;
-	FATEntry *pFAT = dynamic_cast<FATEntry *>(id.get());
-
-	stream::len oldStoredSize = pFAT->storedSize;
-	stream::len oldRealSize = pFAT->realSize;
-	pFAT->storedSize = newStoredSize;
-	pFAT->realSize = newRealSize;
+	OffsetNode *n = this->offsetRoot;
+	if (!n) return this->offFirstFile;
+	while (n->right) n = n->right;
+	return groupEnd(n);
+}
 
-	try {
-		// Update the FAT with the file's new sizes
-		this->updateFileSize(pFAT, iDelta);
-	} catch (stream::error) {
-		// Undo and abort the resize
-		pFAT->storedSize = oldStoredSize;
-		pFAT->realSize = oldRealSize;
-		throw;
+void FATArchive::renumberFrom(unsigned int index, int delta)
+{
+	this->resolveAllEntries();
+	const VC_FATENTRY& entries = this->getFATEntries();
+	for (VC_FATENTRY::const_iterator i = entries.begin(); i != entries.end(); i++) {
+		if ((*i)->iIndex >= index) (*i)->iIndex += delta;
 	}
+	return;
+}
 
-	// Add or remove the data in the underlying stream
-	stream::pos iStart;
-	if (iDelta > 0) { // inserting data
-		// TESTED BY: fmt_grp_duke3d_resize_larger
-		iStart = pFAT->iOffset + pFAT->lenHeader + oldStoredSize;
-		this->psArchive->seekp(iStart, stream::start);
-		this->psArchive->insert(iDelta);
-	} else if (iDelta < 0) { // removing data
-		// TESTED BY: fmt_grp_duke3d_resize_smaller
-		iStart = pFAT->iOffset + pFAT->lenHeader + newStoredSize;
-		this->psArchive->seekp(iStart, stream::start);
-		this->psArchive->remove(-iDelta);
-	} else if (pFAT->realSize == newRealSize) {
-		// Not resizing the internal size, and the external/real size
-		// hasn't changed either, so nothing to do.
-		return;
+void FATArchive::resizeSparse(FATEntry *pFAT, stream::len oldStoredSize)
+{
+	this->checkOffsetTree();
+	stream::len newStoredSize = pFAT->storedSize;
+	stream::pos offData = pFAT->iOffset + pFAT->lenHeader;
+
+	// Other files at the same offset, such as zero-length files that have since
+	// grown, may be using the space this file is growing into or giving up.
+	// TESTED BY: test_archive::test_sparse_zero_length
+	stream::pos offKeep = offData + std::min(oldStoredSize, newStoredSize);
+	bool blocked = false;
+	OffsetNode *node = pFAT->offsetNode;
+	pushPath(node);
+	for (OffsetNode *n = prevNode(node); n; n = prevNode(n)) {
+		pushPath(n);
+		if (n->entry->iOffset != pFAT->iOffset) break;
+		if (n->entry->iOffset + n->entry->lenHeader + n->entry->storedSize
+			> offKeep) blocked = true;
+	}
+	OffsetNode *next = nextNode(node);
+	for (; next; next = nextNode(next)) {
+		pushPath(next);
+		if (next->entry->iOffset != pFAT->iOffset) break;
+		if (next->entry->iOffset + next->entry->lenHeader + next->entry->storedSize
+			> offKeep) blocked = true;
 	}
 
-	if (iDelta != 0) {
-		// The internal file size is changing, so adjust the offsets etc. of the
-		// rest of the files in the archive, including any open streams.
-		this->shiftFiles(pFAT, iStart, iDelta, 0);
-
-		// Resize any open substreams for this file
-		for (OPEN_FILES::iterator i = this->openFiles.begin();
-			i != this->openFiles.end();
-			i++
-		) {
-			if (i->first.get() == pFAT) {
-				if (stream::sub_sptr sub = i->second.lock()) {
-					sub->resize(newStoredSize);
-					// no break, could be multiple opens for same entry
-				}
+	if (!next && !blocked) {
+		// Last file in the archive, so it can change size without affecting any
+		// others.
+		if (newStoredSize > oldStoredSize) {
+			this->psArchive->seekp(offData + oldStoredSize, stream::start);
+			this->psArchive->insert(newStoredSize - oldStoredSize);
+		} else {
+			this->psArchive->seekp(offData + newStoredSize, stream::start);
+			this->psArchive->remove(oldStoredSize - newStoredSize);
+		}
+	} else if (newStoredSize > oldStoredSize) {
+		if (!blocked && (offData + newStoredSize <= next->entry->iOffset)) {
+			// There's enough unused space after the file to grow into
+			this->zeroFill(offData + oldStoredSize, newStoredSize - oldStoredSize);
+		} else {
+			// Move it somewhere with more room, past the other files if need be
+			stream::pos offNew;
+			if (!this->findGap(pFAT->lenHeader + newStoredSize, pFAT, &offNew)) {
+				this->removeFromOffsetTree(pFAT);
+				offNew = this->getDataEnd();
+				this->addToOffsetTree(pFAT);
+				this->psArchive->seekp(offNew, stream::start);
+				this->psArchive->insert(pFAT->lenHeader + newStoredSize);
 			}
+			this->moveEntryData(pFAT, offNew, oldStoredSize);
 		}
-	} // else only realSize changed
+	} // else shrinking, so leave the space as room to grow back into later
 
+	// Resize any open substreams for this file
+	for (EntryStream *sub = pFAT->openStreams; sub; sub = sub->next) {
+		sub->resize(newStoredSize);
+	}
 	return;
 }
 
-void FATArchive::flush()
+void FATArchive::moveEntryData(FATEntry *pFAT, stream::pos offNew,
+	stream::len lenData)
 {
-	// Write out to the underlying stream
-	this->psArchive->flush();
+	// Sparse formats don't have embedded headers
+	assert(pFAT->lenHeader == 0);
+
+	// The new location may overlap the old one, so read it all in first
+	std::string data = this->readEntryData(pFAT, 0, lenData);
+
+	stream::pos offOld = pFAT->iOffset;
+	this->removeFromOffsetTree(pFAT);
+	pFAT->iOffset = offNew;
+	this->addToOffsetTree(pFAT);
+	this->updateFileOffset(pFAT, offNew - offOld);
+	pFAT->offDisk = pFAT->iOffset;
+
+	this->writeEntryData(pFAT, 0, data);
+	this->zeroFill(offNew + lenData, pFAT->storedSize - lenData);
+
+	for (EntryStream *sub = pFAT->openStreams; sub; sub = sub->next) {
+		sub->relocate(offNew - offOld);
+	}
 	return;
 }
 
-int FATArchive::getSupportedAttributes() const
+bool FATArchive::moveInPlace(const EntryPtr& idBeforeThis, const EntryPtr& id)
 {
-	return 0;
-}
+	FATEntry *pFAT = dynamic_cast<FATEntry *>(id.get());
+	const FATEntry *pBefore = NULL;
+	if (this->isValid(idBeforeThis)) {
+		pBefore = dynamic_cast<const FATEntry *>(idBeforeThis.get());
+	}
+	if (pBefore == pFAT) return true;
 
-void FATArchive::shiftFiles(const FATEntry *fatSkip, stream::pos offStart,
-	stream::delta deltaOffset, int deltaIndex)
-{
-	for (VC_ENTRYPTR::iterator i = this->vcFAT.begin(); i != this->vcFAT.end(); i++) {
-		FATEntry *pFAT = dynamic_cast<FATEntry *>(i->get());
-		if (this->entryInRange(pFAT, offStart, fatSkip)) {
-			// This file is located after the one we're deleting, so tweak its offset
-			pFAT->iOffset += deltaOffset;
+	this->checkOffsetTree();
+	this->resolveAllEntries();
 
-			// We have to update the index first, as this is used when inserting
-			// files, and it's called *after* the FAT has been updated on-disk.  So
-			// the index needs to be adjusted before any further on-disk updates to
-			// ensure the right place in the file gets changed.
-			pFAT->iIndex += deltaIndex;
+	VC_ENTRYPTR::iterator itOld = std::find(this->vcFAT.begin(),
+		this->vcFAT.end(), id);
+	assert(itOld != this->vcFAT.end());
+	VC_ENTRYPTR::iterator itNew = this->vcFAT.end();
+	if (pBefore) {
+		itNew = std::find(this->vcFAT.begin(), this->vcFAT.end(), idBeforeThis);
+	}
+	if (itNew > itOld) itNew--; // position once pFAT has been taken out
+	if (itNew == itOld) return true; // already there
+
+	// Work out where the data has to go, before anything changes
+	const FATEntry *pLast = dynamic_cast<const FATEntry *>(this->vcFAT.back().get());
+	stream::pos offTarget = pBefore ? pBefore->iOffset
+		: pLast->iOffset + pLast->lenHeader + pLast->storedSize;
+
+	unsigned int oldIndex = pFAT->iIndex;
+	unsigned int newIndex = dynamic_cast<const FATEntry *>(itNew->get())->iIndex;
+	if (!this->moveFATEntry(pFAT, newIndex)) return false;
+
+	if (this->inTransaction) {
+		UndoRecord undo;
+		undo.action = UndoRecord::Moved;
+		undo.id = id;
+		undo.index = oldIndex;
+		this->undoLog.push_back(undo);
+	}
 
-			this->updateFileOffset(pFAT, deltaOffset);
+	// Reorder vcFAT and the typed list to match the on-disk FAT.  Duplicate
+	// names are indexed in FAT order, so the moved entry is indexed again once
+	// its new position is known.
+	bool updateNameIndex = this->isNameIndexCurrent();
+	bool updateTypedFAT = this->isTypedFATCurrent();
+	if (updateNameIndex) this->removeFromNameIndex(id, pFAT->strName);
+	this->fatChanged();
+	unsigned int posOld = itOld - this->vcFAT.begin();
+	unsigned int posNew = itNew - this->vcFAT.begin();
+	if (posNew > posOld) {
+		std::rotate(itOld, itOld + 1, itNew + 1);
+		if (updateTypedFAT) {
+			std::rotate(this->typedFAT.begin() + posOld,
+				this->typedFAT.begin() + posOld + 1,
+				this->typedFAT.begin() + posNew + 1);
+		}
+		for (VC_ENTRYPTR::iterator i = itOld; i != itNew; i++) {
+			dynamic_cast<FATEntry *>(i->get())->iIndex--;
+		}
+	} else {
+		std::rotate(itNew, itOld, itOld + 1);
+		if (updateTypedFAT) {
+			std::rotate(this->typedFAT.begin() + posNew,
+				this->typedFAT.begin() + posOld,
+				this->typedFAT.begin() + posOld + 1);
+		}
+		for (VC_ENTRYPTR::iterator i = itNew + 1; i != itOld + 1; i++) {
+			dynamic_cast<FATEntry *>(i->get())->iIndex++;
 		}
 	}
+	pFAT->iIndex = newIndex;
+	if (updateNameIndex) {
+		this->addToNameIndex(id, pFAT);
+		this->revNameIndex = this->fatRevision;
+	}
+	if (updateTypedFAT) this->revTypedFAT = this->fatRevision;
+
+	// Files in a sparse archive can stay where they are
+	if (this->sparse) return true;
+
+	// Otherwise keep the data in the same order as the FAT, by swapping the
+	// file with the data of the files it has moved past.
+	stream::pos offStart = pFAT->iOffset;
+	stream::len lenEntry = pFAT->lenHeader + pFAT->storedSize;
+	stream::pos offRange, offRangeEnd;
+	stream::delta deltaOthers, deltaEntry;
+	if (offTarget > offStart + lenEntry) {
+		offRange = offStart + lenEntry;
+		offRangeEnd = offTarget;
+		deltaOthers = -(stream::delta)lenEntry;
+		deltaEntry = offTarget - offRange;
+		FATArchive::swapBlocks(this->psArchive, offStart, lenEntry,
+			offRangeEnd - offRange);
+	} else if (offTarget < offStart) {
+		offRange = offTarget;
+		offRangeEnd = offStart;
+		deltaOthers = lenEntry;
+		deltaEntry = -(stream::delta)(offStart - offTarget);
+		FATArchive::swapBlocks(this->psArchive, offTarget, offStart - offTarget,
+			lenEntry);
+	} else {
+		// The file is already next to where it needs to be
+		return true;
+	}
 
-	// Relocate any open substreams
-	bool clean = false;
-	for (OPEN_FILES::iterator i = this->openFiles.begin();
-		i != this->openFiles.end();
-		i++
-	) {
-		if (i->first->bValid) {
-			if (this->entryInRange(i->first.get(), offStart, fatSkip)) {
-				if (stream::sub_sptr sub = i->second.lock()) {
-					sub->relocate(deltaOffset);
-				}
-			}
-		} else clean = true;
+	// Everything between the old and new positions moves by the size of the file
+	this->removeFromOffsetTree(pFAT);
+	unsigned int first = countBefore(this->offsetRoot, offRange);
+	unsigned int count = countBefore(this->offsetRoot, offRangeEnd) - first;
+	OffsetNode *n = nodeAt(this->offsetRoot, first);
+	WriteCache::Batch batch(this->psArchive.get());
+	for (unsigned int i = 0; i < count; i++, n = nextNode(n)) {
+		// Relative order within the tree is unchanged, so update in place
+		FATEntry *pShifted = n->entry;
+		pShifted->iOffset += deltaOthers;
+		this->updateFileOffset(pShifted, deltaOthers);
+		pShifted->offDisk = pShifted->iOffset;
+		for (EntryStream *sub = pShifted->openStreams; sub; sub = sub->next) {
+			sub->relocate(deltaOthers);
+		}
+	}
+	pFAT->iOffset += deltaEntry;
+	this->addToOffsetTree(pFAT);
+	this->updateFileOffset(pFAT, deltaEntry);
+	pFAT->offDisk = pFAT->iOffset;
+	batch.end();
+	for (EntryStream *sub = pFAT->openStreams; sub; sub = sub->next) {
+		sub->relocate(deltaEntry);
 	}
+	return true;
+}
 
-	// If one substream has closed, clean up
-	if (clean) this->cleanOpenSubstreams();
+FATArchive::FATEntry *FATArchive::findDuplicate(stream::input_sptr src,
+	stream::len len, uint64_t *hash)
+{
+	stream::pos offSrc = src->tellg();
+	*hash = hashData(src, len);
+
+	std::pair<HASH_INDEX::iterator, HASH_INDEX::iterator> matches =
+		this->hashIndex.equal_range(*hash);
+	FATEntry *pFound = NULL;
+	for (HASH_INDEX::iterator i = matches.first; i != matches.second; ) {
+		FATEntry *pFAT = dynamic_cast<FATEntry *>(i->second.get());
+		if (!pFAT->bValid) {
+			// File has been removed since it was indexed
+			this->hashIndex.erase(i++);
+			continue;
+		}
+		i++;
+		this->resolveEntry(pFAT);
+		if ((pFAT->storedSize != len) || (pFAT->lenHeader != 0)) continue;
+
+		// The file may have changed since it was hashed, so check the data
+		src->seekg(offSrc, stream::start);
+		this->psArchive->seekg(pFAT->iOffset, stream::start);
+		if (sameData(src, this->psArchive, len)) {
+			pFound = pFAT;
+			break;
+		}
+	}
+	src->seekg(offSrc, stream::start);
+	return pFound;
+}
 
+void FATArchive::linkShared(FATEntry *pFAT, FATEntry *pOriginal)
+{
+	if (!pOriginal->nextShared) {
+		pOriginal->prevShared = pOriginal->nextShared = pOriginal;
+	}
+	pFAT->prevShared = pOriginal;
+	pFAT->nextShared = pOriginal->nextShared;
+	pOriginal->nextShared->prevShared = pFAT;
+	pOriginal->nextShared = pFAT;
+	this->lenShared += pFAT->storedSize;
 	return;
 }
 
-FATArchive::FATEntry *FATArchive::preInsertFile(const FATEntry *idBeforeThis,
-	FATEntry *pNewEntry)
+void FATArchive::unlinkShared(FATEntry *pFAT)
 {
-	// No-op default
-	return NULL;
+	if (!pFAT->nextShared) return;
+	this->lenShared -= pFAT->storedSize;
+	if (pFAT->nextShared == pFAT->prevShared) {
+		// Only one other file left, which now has the data to itself
+		FATEntry *pOther = pFAT->nextShared;
+		pOther->prevShared = pOther->nextShared = NULL;
+	} else {
+		pFAT->prevShared->nextShared = pFAT->nextShared;
+		pFAT->nextShared->prevShared = pFAT->prevShared;
+	}
+	pFAT->prevShared = pFAT->nextShared = NULL;
+	return;
 }
 
-void FATArchive::postInsertFile(FATEntry *pNewEntry)
+void FATArchive::unshareEntry(FATEntry *pFAT)
 {
-	// No-op default
+	if (!pFAT->nextShared) return;
+	// TESTED BY: test_archive::test_dedup
+	this->unlinkShared(pFAT);
+
+	// Copy the data somewhere else, leaving the original for the other files
+	this->resolveEntry(pFAT);
+	stream::len lenData = pFAT->storedSize;
+	stream::pos offNew;
+	if (!this->findGap(lenData, NULL, &offNew)) {
+		offNew = this->getDataEnd();
+		this->psArchive->seekp(offNew, stream::start);
+		this->psArchive->insert(lenData);
+	}
+	this->moveEntryData(pFAT, offNew, lenData);
+	return;
 }
 
-void FATArchive::preRemoveFile(const FATEntry *pid)
+void FATArchive::zeroFill(stream::pos off, stream::len len)
 {
-	// No-op default
+	if (len == 0) return;
+	std::string zero(std::min<stream::len>(len, 4096), '\0');
+	this->psArchive->seekp(off, stream::start);
+	while (len > 0) {
+		stream::len lenChunk = std::min<stream::len>(len, zero.length());
+		this->psArchive->write(zero.data(), lenChunk);
+		len -= lenChunk;
+	}
+	return;
 }
 
-void FATArchive::postRemoveFile(const FATEntry *pid)
+void FATArchive::attachStream(FATEntry *pFAT, EntryStream *sub)
 {
-	// No-op default
+	sub->archive = this;
+	sub->entry = pFAT;
+	sub->prev = NULL;
+	sub->next = pFAT->openStreams;
+	if (sub->next) {
+		sub->next->prev = sub;
+	} else {
+		// First substream open on this entry
+		pFAT->prevOpen = NULL;
+		pFAT->nextOpen = this->openEntries;
+		if (pFAT->nextOpen) pFAT->nextOpen->prevOpen = pFAT;
+		this->openEntries = pFAT;
+	}
+	pFAT->openStreams = sub;
+	return;
 }
 
-FATArchive::FATEntry *FATArchive::createNewFATEntry()
+void FATArchive::detachStream(EntryStream *sub)
 {
-	return new FATEntry();
+	FATEntry *pFAT = sub->entry;
+	if (sub->prev) sub->prev->next = sub->next;
+	else pFAT->openStreams = sub->next;
+	if (sub->next) sub->next->prev = sub->prev;
+	sub->archive = NULL;
+	sub->prev = sub->next = NULL;
+
+	if (!pFAT->openStreams) {
+		// That was the last one, so we don't need to check this entry any more
+		if (pFAT->prevOpen) pFAT->prevOpen->nextOpen = pFAT->nextOpen;
+		else this->openEntries = pFAT->nextOpen;
+		if (pFAT->nextOpen) pFAT->nextOpen->prevOpen = pFAT->prevOpen;
+		pFAT->prevOpen = pFAT->nextOpen = NULL;
+	}
+	return;
 }
 
-void FATArchive::cleanOpenSubstreams()
+void FATArchive::detachEntryStreams(FATEntry *pFAT)
 {
-	bool clean;
-	do {
-		clean = true;
-		// Run through the list looking for the first expired item
-		for (OPEN_FILES::iterator i = this->openFiles.begin();
-			i != this->openFiles.end();
-			i++
-		) {
-			if (i->second.expired()) {
-				// Found one so remove it and restart the search (since removing an
-				// item invalidates the iterator.)
-				this->openFiles.erase(i);
-				clean = false;
-				break;
-			}
-		}
-	} while (!clean);
-
+	while (pFAT->openStreams) this->detachStream(pFAT->openStreams);
 	return;
 }
 
@@ -539,9 +3183,10 @@ bool FATArchive::entryInRange(const FATEntry *fat, stream::pos offStart,
 	return true;
 }
 
-void FATArchive::resizeSubstream(FATEntryPtr id, stream::len newSize)
+void FATArchive::resizeSubstream(EntryStream *sub, stream::len newSize)
 {
 	// An open substream belonging to file entry 'id' wants to be resized.
+	FATEntryPtr id = sub->id;
 
 	// Resize the file in the archive.  This function will also tell the
 	// substream it can now write to a larger area.
@@ -552,16 +3197,84 @@ void FATArchive::resizeSubstream(FATEntryPtr id, stream::len newSize)
 	// the filtered data out should call us first, then call the archive's
 	// resize() function with the correct real/extracted size.
 	//this->resize(id, newSize, newSize);
-	stream::len newRealSize;
-	if (id->fAttr & EA_COMPRESSED) {
-		// We're compressed, so the real and stored sizes are both valid
-		newRealSize = id->realSize;
-	} else {
-		// We're not compressed, so the real size won't be updated by a filter,
-		// so we need to update it here.
-		newRealSize = newSize;
+	if (newSize > id->storedSize) {
+		if (sub->grown && !this->sparse) {
+			// This is at least the second time the file has grown, so it is
+			// probably being written in pieces.  Set aside double the space each
+			// time, so the files after it only get shifted a handful of times.  A
+			// file in a sparse archive that outgrows its space is moved to a gap
+			// or the end of the archive instead, so it needs no extra room.
+			// TESTED BY: test_archive::test_write_growing
+			stream::len lenAlloc = std::max(newSize, id->storedSize * 2);
+			this->reserveSpace(sub->entry, lenAlloc - id->storedSize);
+		}
+		sub->grown = true;
+	}
+
+	if (newSize != id->storedSize) {
+		stream::len newRealSize;
+		if (id->fAttr & EA_COMPRESSED) {
+			// We're compressed, so the real and stored sizes are both valid
+			newRealSize = id->realSize;
+		} else {
+			// We're not compressed, so the real size won't be updated by a filter,
+			// so we need to update it here.
+			newRealSize = newSize;
+		}
+		this->resize(id, newSize, newRealSize);
+	}
+	return;
+}
+
+void FATArchive::prepareFlush()
+{
+	this->trimOpenStreams();
+	if (this->offsetsUnwritten) this->writeChangedOffsets();
+	return;
+}
+
+void FATArchive::trimOpenStreams()
+{
+	// TESTED BY: test_archive::test_write_growing_flush
+	for (FATEntry *pFAT = this->openEntries; pFAT; pFAT = pFAT->nextOpen) {
+		this->releaseSpace(pFAT);
 	}
-	this->resize(id, newSize, newRealSize);
+	return;
+}
+
+void FATArchive::trimSubstream(EntryStream *sub)
+{
+	this->releaseSpace(sub->entry);
+	return;
+}
+
+void FATArchive::reserveSpace(FATEntry *pFAT, stream::len lenReserve)
+{
+	if (lenReserve <= pFAT->lenReserved) return;
+	stream::len lenExtra = lenReserve - pFAT->lenReserved;
+
+	stream::pos offEnd = pFAT->iOffset + pFAT->lenHeader + pFAT->storedSize
+		+ pFAT->lenReserved;
+	// Like resize(), the FAT goes first as it may be after the file
+	this->updateFileSize(pFAT, lenExtra);
+	this->psArchive->seekp(offEnd, stream::start);
+	this->psArchive->insert(lenExtra);
+	pFAT->lenReserved = lenReserve;
+	this->shiftFiles(pFAT, offEnd, lenExtra, 0);
+	return;
+}
+
+void FATArchive::releaseSpace(FATEntry *pFAT)
+{
+	if (pFAT->lenReserved == 0) return;
+	stream::delta lenRelease = pFAT->lenReserved;
+
+	stream::pos offEnd = pFAT->iOffset + pFAT->lenHeader + pFAT->storedSize;
+	this->updateFileSize(pFAT, -lenRelease);
+	this->psArchive->seekp(offEnd, stream::start);
+	this->psArchive->remove(lenRelease);
+	pFAT->lenReserved = 0;
+	this->shiftFiles(pFAT, offEnd, -lenRelease, 0);
 	return;
 }
 
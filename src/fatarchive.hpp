@@ -23,9 +23,13 @@
 
 #include <map>
 #include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/pool/pool_alloc.hpp>
 
 #include <camoto/stream_sub.hpp>
 #include <camoto/stream_seg.hpp>
+#include <camoto/stream_string.hpp>
 #include <camoto/gamearchive/archive.hpp>
 
 namespace camoto {
@@ -37,6 +41,11 @@ namespace gamearchive {
 class FATArchive: virtual public Archive {
 
 	public:
+		/// Node in the tree of entries kept in on-disk order.
+		struct OffsetNode;
+
+		/// Substream returned by open(), which tracks its own entry.
+		class EntryStream;
 
 		/// FAT-related fields to add to EntryPtr.
 		/**
@@ -54,6 +63,44 @@ class FATArchive: virtual public Archive {
 			stream::pos iOffset;    ///< Offset of file in archive
 			stream::len lenHeader;  ///< Size of embedded FAT entry at start of file data
 
+			/// Position of this entry in FATArchive's offset tree.
+			/**
+			 * Used internally by FATArchive, do not use.  NULL if the entry isn't
+			 * in the tree.
+			 */
+			OffsetNode *offsetNode;
+
+			/// Offset last written to the on-disk FAT via updateFileOffset().
+			/**
+			 * Used internally by FATArchive, do not use.
+			 */
+			stream::pos offDisk;
+
+			/// First substream currently open on this entry.
+			/**
+			 * Used internally by FATArchive, do not use.  Each substream removes
+			 * itself from this list when it is destroyed.
+			 */
+			EntryStream *openStreams;
+
+			/// Neighbouring entries in FATArchive's list of entries with open
+			/// substreams.  Used internally by FATArchive, do not use.
+			FATEntry *prevOpen, *nextOpen;
+
+			/// Neighbouring entries in a ring of entries whose data is stored in
+			/// the same place.  Used internally by FATArchive, do not use.  NULL if
+			/// the entry has its own copy of its data.
+			FATEntry *prevShared, *nextShared;
+
+			/// Unused space set aside after the file's data.
+			/**
+			 * Used internally by FATArchive, do not use.  A file being written a
+			 * piece at a time is given room to grow into, which is kept out of
+			 * storedSize so the file's size is still correct while it is open.  It
+			 * is zero again once the file's substreams are flushed or closed.
+			 */
+			stream::len lenReserved;
+
 			/// Empty constructor
 			FATEntry();
 
@@ -70,11 +117,160 @@ class FATArchive: virtual public Archive {
 		/// Shared pointer of FAT-specific file entry.
 		typedef boost::shared_ptr<FATEntry> FATEntryPtr;
 
+		/// Segmented stream that can hold back small writes and apply them
+		/// together.
+		/**
+		 * Between beginBatch() and endBatch(), writes that land inside the
+		 * existing data are kept in memory instead of being passed on.  Writes
+		 * close to each other are merged, so rewriting the offset of every FAT
+		 * entry after a file has been shifted costs one read and one write,
+		 * rather than a seek and write per field.  Any other operation applies
+		 * the pending writes first, so the stream always behaves as if each
+		 * write had gone through immediately.
+		 *
+		 * Between beginStaging() and commitStaged() or discardStaged(), nothing
+		 * at all is passed on.  Instead the content is tracked as a list of
+		 * extents, each either a run of the underlying stream's existing data,
+		 * space that has been inserted, or data that has been written.  Reads
+		 * are served from this list, and committing applies it with one remove
+		 * or insert per changed range, writing each new byte once.  Discarding
+		 * it leaves the underlying stream exactly as it was.  Staging can be
+		 * nested, in which case committing the inner level keeps its changes
+		 * staged in the outer one, and discarding it goes back to how the outer
+		 * level was when the inner one began.
+		 */
+		class WriteCache: virtual public stream::seg {
+			public:
+				/// Hold back writes to a WriteCache while this object exists.
+				class Batch {
+					public:
+						Batch(WriteCache *cache);
+
+						/// Apply the writes if end() hasn't been called.
+						/**
+						 * Errors are ignored, as this only happens when unwinding after
+						 * an exception.
+						 */
+						~Batch();
+
+						/// Finish the batch, applying the writes held back.
+						void end();
+
+					private:
+						WriteCache *cache;  ///< NULL once end() has been called
+				};
+
+				WriteCache();
+
+				virtual stream::len try_read(uint8_t *buffer, stream::len len);
+				virtual void seekg(stream::delta off, stream::seek_from from);
+				virtual stream::pos tellg() const;
+				virtual stream::len try_write(const uint8_t *buffer, stream::len len);
+				virtual void seekp(stream::delta off, stream::seek_from from);
+				virtual stream::pos tellp() const;
+				virtual stream::len size() const;
+				virtual void truncate(stream::pos size);
+				virtual void flush();
+
+				void open(stream::inout_sptr parent);
+				void insert(stream::len len);
+				void remove(stream::len len);
+
+				/// Start holding back writes.  Calls may be nested.
+				void beginBatch();
+
+				/// Apply the writes held back since the outermost beginBatch().
+				void endBatch();
+
+				/// Start recording all changes in memory instead of passing them on.
+				/**
+				 * flush() does nothing until the changes are committed or discarded.
+				 * If changes are already being staged, a new level is started on top
+				 * of them.
+				 */
+				void beginStaging();
+
+				/// Apply the changes recorded since beginStaging() in one pass.
+				/**
+				 * If this is a nested level, the changes are kept staged in the level
+				 * below instead.
+				 */
+				void commitStaged();
+
+				/// Forget the changes recorded since beginStaging().
+				void discardStaged();
+
+			protected:
+				/// Pass any held-back writes on to the underlying stream.
+				void applyPending();
+
+				/// Number of beginBatch() calls without a matching endBatch().
+				unsigned int batchDepth;
+
+				/// Stream position, used in place of the underlying stream's while
+				/// there are writes pending.
+				stream::pos offPending;
+
+				/// Data waiting to be written, keyed by offset.  The ranges never
+				/// overlap or touch.
+				std::map<stream::pos, std::string> pending;
+
+				/// A run of bytes in the stream, while changes are being staged.
+				struct Extent {
+					/// Where the bytes come from.
+					enum Source {
+						Original,  ///< The underlying stream, starting at src
+						Inserted,  ///< Newly inserted space, reading as zeroes
+						Written,   ///< The bytes in data
+					};
+
+					Source source;     ///< Where the bytes come from
+					stream::pos src;   ///< Original: offset in the underlying stream
+					stream::len len;   ///< Number of bytes in this run
+					std::string data;  ///< Written: the bytes themselves
+				};
+
+				/// Make sure an extent starts at the given offset.
+				/**
+				 * @return Index of the extent starting at off, which is the number of
+				 *   extents if off is the end of the stream.
+				 */
+				unsigned int splitExtent(stream::pos off);
+
+				/// True between beginStaging() and commitStaged()/discardStaged().
+				bool staging;
+
+				/// Content of the stream while staging, in order.  Original extents
+				/// are always in increasing order of src and never overlap.
+				std::vector<Extent> extents;
+
+				/// Length of the stream while staging.
+				stream::len lenStaged;
+
+				/// Length of the underlying stream when staging began.
+				stream::len lenOriginal;
+
+				/// Stream position while staging.
+				stream::pos offStaged;
+
+				/// Staged content of an outer level, while a nested one is in use.
+				struct Level {
+					std::vector<Extent> extents;  ///< Content of the stream
+					stream::len lenStaged;        ///< Length of the stream
+				};
+
+				/// Outer staging levels, innermost last.
+				std::vector<Level> outer;
+		};
+
+		/// Shared pointer to a WriteCache.
+		typedef boost::shared_ptr<WriteCache> WriteCachePtr;
+
 	protected:
 		/// The archive stream must be mutable, because we need to change it by
 		/// seeking and reading data in our get() functions, which don't logically
 		/// change the archive's state.
-		mutable stream::seg_sptr psArchive;
+		mutable WriteCachePtr psArchive;
 
 		/// Offset of the first file in an empty archive.
 		stream::pos offFirstFile;
@@ -88,26 +284,46 @@ class FATArchive: virtual public Archive {
 		 *
 		 * The entries in this vector can be in any order (not necessarily the
 		 * order on-disk.  Use the iIndex member for that.)
+		 *
+		 * If the format handler called setLazyFAT() this will be empty until
+		 * the whole FAT is first needed, which may be inside a const function.
 		 */
-		VC_ENTRYPTR vcFAT;
+		mutable VC_ENTRYPTR vcFAT;
+
+		/// Vector of FAT entries as their concrete type.
+		typedef std::vector<FATEntry *> VC_FATENTRY;
 
-		/// Vector of substream references.
+		/// Get every entry in vcFAT, in the same order, as a FATEntry.
 		/**
-		 * These are weak pointers so that we don't hold a file open simply because
-		 * we're keeping track of it.  We need to keep track of it so that open
-		 * files can be moved around as other files are inserted, resized, etc.
+		 * Because FATEntry inherits virtually from FileEntry, getting from one
+		 * to the other needs a dynamic_cast.  This list is kept alongside vcFAT
+		 * so loops over every entry don't have to do that for each one.  Like
+		 * the other indices it is rebuilt if a format handler changes vcFAT
+		 * directly.
+		 *
+		 * @return Reference to the list, valid until vcFAT is next changed.
 		 */
-		typedef std::multimap< FATEntryPtr, boost::weak_ptr<stream::sub> > OPEN_FILES;
-
-		/// Helper type when inserting elements into openFiles.
-		typedef std::pair< FATEntryPtr, boost::weak_ptr<stream::sub> > OPEN_FILE;
-
-		/// List of substreams currently open.
-		OPEN_FILES openFiles;
+		const VC_FATENTRY& getFATEntries() const;
 
 		/// Maximum length of filenames in this archive format.
 		unsigned int lenMaxFilename;
 
+		/// True while setDeferredFAT() has taken the FAT out of psArchive.
+		/**
+		 * Format handlers implementing detachFAT() check this in their FAT
+		 * callbacks, which must only change in-memory state while it is set.
+		 */
+		bool deferFAT;
+
+		/// Index of filenames to entries, used by find().
+		/**
+		 * The key is the filename converted to uppercase, so lookups are case
+		 * insensitive.  Each value lists every entry with that name, sorted by
+		 * iIndex so that find() returns the first one in FAT order if there are
+		 * duplicates.
+		 */
+		typedef boost::unordered_map<std::string, VC_ENTRYPTR> NAME_INDEX;
+
 		/// Create a new FATArchive.
 		/**
 		 * @param psArchive
@@ -140,22 +356,45 @@ class FATArchive: virtual public Archive {
 		virtual EntryPtr insert(const EntryPtr idBeforeThis,
 			const std::string& strFilename, stream::pos storedSize, std::string type,
 			int attr);
+		virtual EntryPtr insert(const EntryPtr idBeforeThis,
+			const std::string& strFilename, stream::input_sptr src, std::string type,
+			int attr);
 		virtual void remove(EntryPtr id);
 		virtual void rename(EntryPtr id, const std::string& strNewName);
 		virtual void move(const EntryPtr idBeforeThis, EntryPtr id);
 		virtual void resize(EntryPtr id, stream::pos newStoredSize,
 			stream::pos newRealSize);
 		virtual void flush();
+		virtual void compact(stream::inout_sptr dest);
+		virtual void flushTo(stream::inout_sptr dest);
+		virtual bool setOutOfPlace(bool outOfPlace);
+		virtual bool setSparseLayout(bool sparse);
+		virtual bool setDeduplication(bool dedup);
+		virtual stream::len getDeduplicatedSize() const;
+		virtual bool setDeferredFAT(bool defer);
 		virtual int getSupportedAttributes() const;
+		virtual void beginTransaction();
+		virtual void commitTransaction();
+		virtual void abortTransaction();
 
 	protected:
 		/// Shift any files *starting* at or after offStart by delta bytes.
 		/**
-		 * This updates the internal offsets and index numbers.  The FAT is updated
-		 * by calling updateFileOffset().  If offStart is in the middle of a file
-		 * (which should never happen) that file won't be affected, only those
-		 * following it.  This function must notify any open files that their offset
-		 * has moved.
+		 * This updates the internal offsets and index numbers.  If offStart is in
+		 * the middle of a file (which should never happen) that file won't be
+		 * affected, only those following it.  This function must notify any open
+		 * files that their offset has moved.
+		 *
+		 * The shift is recorded against a range of the offset tree in O(log n)
+		 * time, and individual entries only pick up their new offset and index
+		 * when they are next accessed.  Code that reads the iOffset or iIndex
+		 * fields of entries other than the one passed to a callback must call
+		 * resolveEntry() first.  The FAT is not updated here, instead
+		 * updateFileOffset() is called once for each file that has moved when
+		 * the archive is flushed or a transaction is committed.
+		 *
+		 * Open files still have to be relocated straight away, so the cost
+		 * grows with the number of files open at the time.
 		 *
 		 * @param fatSkip
 		 *   Do not alter this entry, even if it is located in the area to be
@@ -222,7 +461,12 @@ class FATArchive: virtual public Archive {
 		 *   The entry to update.  pid->size is already set to the new size.
 		 *
 		 * @param sizeDelta
-		 *   Amount the size has changed, in case this value is needed.
+		 *   Number of bytes the space taken up by the file has grown (or shrunk
+		 *   if negative) by, for anything stored after it that has moved.  This
+		 *   includes the space set aside for a file being written (see
+		 *   FATEntry::lenReserved), so it can differ from the change in size,
+		 *   and this function is also called with the size unchanged when only
+		 *   that space is added or removed.
 		 *
 		 * @throws stream::error on I/O error.
 		 *
@@ -318,23 +562,658 @@ class FATArchive: virtual public Archive {
 		 * additional information, you will need to replace this function with one
 		 * that allocates your extended class instead, otherwise the EntryPtrs
 		 * passed to the other functions will be a mixture of FATEntry and whatever
-		 * your extended class is.  See fmt-dat-hugo.cpp for an example.
+		 * your extended class is.  Use allocEntry() so your entries come from the
+		 * same pool as everyone else's.  See fmt-dat-hugo.cpp for an example.
+		 */
+		virtual FATEntryPtr createNewFATEntry();
+
+		/// Allocate a FAT entry, or a format's extension of it, from the pool.
+		/**
+		 * The entry and its reference count are allocated together from a pool
+		 * of blocks of the same size, which avoids the overhead of two separate
+		 * heap blocks per file when large archives are opened.  Every entry
+		 * created by this library comes from here.
+		 *
+		 * The pool is shared by all archives and only ever grows.  Entries freed
+		 * when an archive is closed go back to the pool for the next archive to
+		 * use, rather than back to the system, so a program's memory use stays at
+		 * the most entries it has had open at once.
+		 *
+		 * @return The new entry, which is freed when the last EntryPtr to it
+		 *   goes away, even if that is after the archive has been closed.
+		 */
+		template <class T>
+		static boost::shared_ptr<T> allocEntry()
+		{
+			return boost::allocate_shared<T>(boost::fast_pool_allocator<T>());
+		}
+
+		/// Allocate a plain FATEntry for a file being read in from the FAT.
+		/**
+		 * Same as allocEntry<FATEntry>(), for format handlers which don't extend
+		 * FATEntry and so don't override createNewFATEntry().
 		 */
-		virtual FATEntry *createNewFATEntry();
+		static FATEntryPtr newFATEntry();
+
+		/// Can files in this format be stored in any order with gaps between them?
+		/**
+		 * This should be overridden to return true by formats where every file's
+		 * offset is stored in the FAT, the FAT comes before all the file data,
+		 * and files have no embedded headers (lenHeader is always zero.)  When
+		 * the user enables a sparse layout, files will be given offsets anywhere
+		 * after the FAT via updateFileOffset() and preInsertFile(), and removing
+		 * a file will not shift any others.
+		 *
+		 * @return true if setSparseLayout() should be allowed.  The default
+		 *   implementation returns false.
+		 */
+		virtual bool canBeSparse() const;
+
+		/// Take the FAT out of psArchive for setDeferredFAT().
+		/**
+		 * Formats that store their FAT after the file data can override this to
+		 * remove the FAT from psArchive, so files added or enlarged at the end
+		 * of the archive are appended to the stream rather than pushing the
+		 * FAT along in front of them.  It is called when deferring is enabled,
+		 * and again after each flush() while it stays enabled.
+		 *
+		 * @return true if the FAT was removed, false if the format does not
+		 *   support deferring its FAT.  The default implementation returns
+		 *   false.
+		 */
+		virtual bool detachFAT();
+
+		/// Write out a FAT removed by detachFAT().
+		/**
+		 * Called by flush() before psArchive is written out, and when deferring
+		 * is disabled.  The whole FAT must be written from vcFAT, in the place
+		 * it belongs now that all the file data is in position.  The default
+		 * implementation does nothing, for formats like RFF whose own flush()
+		 * always rewrites the whole FAT anyway.
+		 */
+		virtual void attachFAT();
+
+		/// Bring the FAT up to date before the archive is written out.
+		/**
+		 * This gives up the extra space reserved after files still open for
+		 * writing (a file written a piece at a time is given room to grow into,
+		 * which is only handed back when its stream is flushed or closed), and
+		 * writes the new offset of every file that has moved since the last
+		 * flush.
+		 *
+		 * flush() calls this, but format handlers that override flush() to
+		 * write out a cached FAT must call it first themselves, so the FAT holds
+		 * the final file offsets.
+		 */
+		void prepareFlush();
+
+		/// Give up the extra space reserved for files still open for writing.
+		/**
+		 * Also called before files are inserted, removed or moved, so only
+		 * resize() ever has to allow for the reserved space.
+		 */
+		void trimOpenStreams();
+
+		/// Read the FAT on demand instead of in the constructor.
+		/**
+		 * Format handlers with fixed-length FAT records can call this from their
+		 * constructor instead of populating vcFAT.  The first find() indexes
+		 * every filename straight from the FAT records with loadFATName(), and
+		 * find() then only ever creates the entry it returns.  The rest of the
+		 * FAT is loaded into vcFAT via loadFATEntry() the first time the whole
+		 * list is needed, such as by getFileList().
+		 *
+		 * Any change to the archive needs the whole list too, so this only
+		 * saves time when files are looked up and read.  Opening an archive to
+		 * change it still costs O(n) in the number of files.
+		 *
+		 * @param numFiles
+		 *   Number of records in the FAT.
+		 *
+		 * @param offFAT
+		 *   Offset of the first FAT record.
+		 *
+		 * @param lenRecord
+		 *   Length of each FAT record, in bytes.
+		 */
+		void setLazyFAT(unsigned int numFiles, stream::pos offFAT,
+			stream::len lenRecord);
+
+		/// Decode one FAT record, for formats using setLazyFAT().
+		/**
+		 * @param record
+		 *   The record's bytes, already read into memory.  Use the fields
+		 *   from fatschema.hpp to decode them.
+		 *
+		 * @param pEntry
+		 *   Entry to fill in, as returned by createNewFATEntry().  The iIndex and
+		 *   bValid fields have already been set.
+		 *
+		 * @throws stream::error if the record is invalid.
+		 */
+		virtual void loadFATEntry(const uint8_t *record, FATEntry *pEntry) const;
+
+		/// Decode just the filename from a FAT record, for setLazyFAT().
+		/**
+		 * The default implementation decodes the whole record with
+		 * loadFATEntry(), so formats should override this if getting the name
+		 * on its own is any cheaper.
+		 *
+		 * @param record
+		 *   The record's bytes, already read into memory.
+		 *
+		 * @return The filename, exactly as loadFATEntry() would set it.
+		 *
+		 * @throws stream::error if the record is invalid.
+		 */
+		virtual std::string loadFATName(const uint8_t *record) const;
+
+		/// Fill vcFAT from a sidecar index instead of walking the archive.
+		/**
+		 * Formats with no central FAT have to visit every file's header to list
+		 * the archive, which is slow on cold storage.  Their constructors call
+		 * this first, and only walk the archive (followed by saveIndex()) when
+		 * it returns false.  See ArchiveType::openIndexed().
+		 *
+		 * @param index
+		 *   Sidecar stream supplied by the caller, or a null pointer if there
+		 *   isn't one.  It is kept so saveIndex() can rewrite it.
+		 *
+		 * @param stamp
+		 *   Caller's stamp for the archive, such as its last-modified time.
+		 *
+		 * @return true if the index matched the archive and vcFAT has been
+		 *   filled in from it, false if the archive has to be read as usual.
+		 *   A damaged or out of date index is not an error, it just returns
+		 *   false.
+		 *
+		 * @throws stream::error on I/O error reading the archive.
+		 */
+		bool loadIndex(stream::inout_sptr index, uint64_t stamp);
+
+		/// Write the file list out to the index passed to loadIndex().
+		/**
+		 * Does nothing if no index was supplied.
+		 *
+		 * @throws stream::error on I/O error.
+		 */
+		void saveIndex();
+
+		/// Move an entry to a different position in the on-disk FAT.
+		/**
+		 * This is called by move() before any file data is touched.  Only the
+		 * FAT record needs to move, as the offsets of any files whose data moves
+		 * will be updated afterwards via updateFileOffset().  When this function
+		 * returns, the iIndex fields of pid and the files between its old and new
+		 * positions will be updated to match.
+		 *
+		 * Formats where iIndex does not always match an entry's position in vcFAT
+		 * must leave this function alone.
+		 *
+		 * @param pid
+		 *   The entry to move.  pid->iIndex is its current position in the FAT.
+		 *
+		 * @param newIndex
+		 *   Index the entry will have after the move, counting from the start of
+		 *   the FAT as it will be once the entry has been taken out.
+		 *
+		 * @return true if the FAT record was moved, false if move() should fall
+		 *   back to inserting a copy of the file and removing the original.  The
+		 *   default implementation returns false.
+		 *
+		 * @throws stream::error on I/O error.
+		 */
+		virtual bool moveFATEntry(const FATEntry *pid, unsigned int newIndex);
+
+		/// Move a fixed-length record to a new index within a table.
+		/**
+		 * Helper function for moveFATEntry() implementations.
+		 *
+		 * @param content
+		 *   Stream holding the table.
+		 *
+		 * @param offTable
+		 *   Offset of the first record in the table.
+		 *
+		 * @param lenRecord
+		 *   Length of each record, in bytes.
+		 *
+		 * @param oldIndex
+		 *   Index of the record to move.
+		 *
+		 * @param newIndex
+		 *   Index of the record once it has been moved.
+		 */
+		static void moveRecord(stream::inout_sptr content, stream::pos offTable,
+			stream::len lenRecord, unsigned int oldIndex, unsigned int newIndex);
+
+		/// Swap two adjacent blocks of data in a stream.
+		/**
+		 * The smaller block is held in memory while the larger one is copied
+		 * over it in chunks, so no data following the blocks is affected.
+		 *
+		 * @param content
+		 *   Stream holding the data.
+		 *
+		 * @param off
+		 *   Offset of the first block.
+		 *
+		 * @param lenFirst
+		 *   Length of the first block.  The second block starts immediately after
+		 *   it.
+		 *
+		 * @param lenSecond
+		 *   Length of the second block.
+		 */
+		static void swapBlocks(stream::inout_sptr content, stream::pos off,
+			stream::len lenFirst, stream::len lenSecond);
+
+		/// Bring an entry's iOffset and iIndex fields up to date.
+		/**
+		 * Entries passed to the callback functions above are always up to date,
+		 * but during a transaction any others may still have shifts pending.
+		 * This applies them in O(log n) time.
+		 *
+		 * @param pid
+		 *   Entry to update.
+		 */
+		void resolveEntry(const FATEntry *pid) const;
+
+		/// Note that vcFAT has been changed by the format handler.
+		/**
+		 * The filename index and the list returned by getFATEntries() are kept
+		 * up to date by insert(), remove(), rename() and move(), but any other
+		 * change made to vcFAT directly, outside the constructor, must be
+		 * followed by a call to this function so both are rebuilt when next
+		 * needed.
+		 */
+		void fatChanged() const;
 
 	/// Test code only, do not use, see below.
 	friend EntryPtr getFileAt(const VC_ENTRYPTR& files, unsigned int index);
 
 	private:
-		/// Remove any substreams from the cached list if they have closed.
-		void cleanOpenSubstreams();
+		/// A change made during a transaction, recorded so it can be undone.
+		struct UndoRecord {
+			/// Type of change made.
+			enum Action {
+				Inserted,  ///< id was inserted
+				Removed,   ///< id was removed
+				Resized,   ///< id changed size
+				Renamed,   ///< id changed name
+				Moved,     ///< id moved to a different position in the FAT
+			};
+
+			Action action;           ///< What was done
+			EntryPtr id;             ///< Entry that was changed
+			unsigned int index;      ///< Removed, Moved: index of entry in the FAT
+			std::string name;        ///< Removed, Renamed: original filename
+			std::string type;        ///< Removed: original file type
+			int attr;                ///< Removed: original attributes
+			stream::len storedSize;  ///< Removed, Resized: original stored size
+			stream::len realSize;    ///< Removed, Resized: original real size
+		};
+
+		/// List of changes in the order they were made.
+		typedef std::vector<UndoRecord> UNDO_LOG;
+
+		/// Stream the archive was opened on, underneath psArchive.
+		stream::inout_sptr psParent;
+
+		/// Set by compact() and flushTo() to have flush() rewrite the archive
+		/// into this stream, which is never psParent.
+		stream::inout_sptr psRewrite;
+
+		/// Write psArchive's content out to psRewrite in one pass.
+		/**
+		 * psArchive is only read from, so psParent is left untouched.
+		 * psRewrite then becomes the new psParent.
+		 */
+		void rewriteArchive();
+
+		/// Call flush() with psRewrite set to the given stream.
+		void flushRewrite(stream::inout_sptr dest);
+
+		/// Area of psArchive, as offset and length.
+		typedef std::pair<stream::pos, stream::len> EXTENT;
+
+		/// Areas of psArchive to copy when rewriting the archive, if not all of it.
+		std::vector<EXTENT> rewriteExtents;
+
+		/// True if setSparseLayout() has been enabled.
+		bool sparse;
+
+		/// True if setDeduplication() has been enabled.
+		bool dedup;
+
+		/// Total size of the files sharing the data of another file.
+		stream::len lenShared;
+
+		/// True if setOutOfPlace() has been enabled, so psArchive is staging
+		/// every change instead of passing it on to psParent.
+		bool outOfPlace;
+
+		/// Files keyed by a hash of their content, for finding duplicates.
+		/**
+		 * Files are not removed when they change, so every match must be
+		 * checked against the actual data.  Files which are no longer valid are
+		 * dropped as they are found.
+		 */
+		typedef std::multimap<uint64_t, EntryPtr> HASH_INDEX;
+
+		/// Hash of every file's content, only kept while dedup is true.
+		HASH_INDEX hashIndex;
+
+		/// Find a file whose data is identical to the next len bytes of src.
+		/**
+		 * @param src
+		 *   Data to look for.  The read position is left unchanged.
+		 *
+		 * @param len
+		 *   Number of bytes of src to compare.
+		 *
+		 * @param hash
+		 *   On return, the hash of the data from src.
+		 *
+		 * @return The matching file, or NULL if there is no file with the same
+		 *   content.
+		 */
+		FATEntry *findDuplicate(stream::input_sptr src, stream::len len,
+			uint64_t *hash);
+
+		/// Add an entry to the ring of entries sharing another's data.
+		void linkShared(FATEntry *pFAT, FATEntry *pOriginal);
+
+		/// Take an entry out of the ring of entries sharing its data.
+		void unlinkShared(FATEntry *pFAT);
+
+		/// Give an entry sharing its data with others a copy of its own.
+		void unshareEntry(FATEntry *pFAT);
+
+		/// Work out where each file will go once the gaps between them have been
+		/// removed, and update the FAT and rewriteExtents to match.
+		void closeGaps();
+
+		/// Find the smallest gap between files that will hold len bytes.
+		/**
+		 * @param len
+		 *   Number of bytes needed.
+		 *
+		 * @param pIgnore
+		 *   Treat the space taken up by this entry as free.  May be NULL.
+		 *
+		 * @param off
+		 *   On return, the offset of the gap if one was found.
+		 *
+		 * @return true if a gap was found, false if the data will have to go at
+		 *   the end of the archive.
+		 */
+		bool findGap(stream::len len, const FATEntry *pIgnore,
+			stream::pos *off) const;
+
+		/// Unused space between files, keyed by its length.
+		/**
+		 * Each gap is stored against the node of the file just before it (the
+		 * last one, if several files share that offset), so the gaps follow the
+		 * files through any pending shifts in the offset tree.  This lets
+		 * findGap() pick the smallest gap that fits in O(log n) time.
+		 */
+		typedef std::multimap<stream::len, OffsetNode *> GAP_INDEX;
+
+		/// Every gap between files in a sparse archive, built by findGap().
+		mutable GAP_INDEX gapIndex;
+
+		/// True if gapIndex is in use and must be kept up to date.
+		mutable bool gapsCurrent;
+
+		/// Populate gapIndex from the offset tree.
+		void rebuildGapIndex() const;
+
+		/// Discard gapIndex, until findGap() next needs it.
+		void clearGapIndex() const;
+
+		/// Update the gap recorded after the given node, once it or the node
+		/// after it has changed.
+		void refreshGap(OffsetNode *n) const;
+
+		/// Get the offset just past the end of the last file in the archive.
+		stream::pos getDataEnd() const;
+
+		/// Change iIndex for every entry at or after the given index.
+		void renumberFrom(unsigned int index, int delta);
+
+		/// Resize a file's data in a sparse archive, moving it if needed.
+		void resizeSparse(FATEntry *pFAT, stream::len oldStoredSize);
+
+		/// Copy a file's data to a new location in a sparse archive.
+		void moveEntryData(FATEntry *pFAT, stream::pos offNew,
+			stream::len lenData);
+
+		/// Overwrite part of the archive with zeroes.
+		void zeroFill(stream::pos off, stream::len len);
+
+		/// Add a new file, for both versions of insert().
+		/**
+		 * @param src
+		 *   If not NULL, the data to write into the new file, which must be
+		 *   storedSize bytes long.  If NULL, the new file is filled with zeroes.
+		 */
+		EntryPtr insertEntry(const EntryPtr idBeforeThis,
+			const std::string& strFilename, stream::pos storedSize, std::string type,
+			int attr, stream::input_sptr src);
+
+		/// Move a file without copying it, if the format allows.
+		/**
+		 * The FAT record is moved by moveFATEntry().  In a sparse archive the
+		 * data stays where it is, otherwise it is swapped with the data of the
+		 * files it is moving past, so nothing outside that range is touched.
+		 *
+		 * @return false if the format does not support this, in which case
+		 *   nothing has been changed.
+		 */
+		bool moveInPlace(const EntryPtr& idBeforeThis, const EntryPtr& id);
+
+		/// True between beginTransaction() and commit/abortTransaction().
+		bool inTransaction;
+
+		/// Changes made during the current transaction.
+		UNDO_LOG undoLog;
+
+		/// Sparse archives only: offset of every file when the current
+		/// transaction began.
+		std::map<EntryPtr, stream::pos> txnOffsets;
+
+		/// Call updateFileOffset() for every entry whose offset has changed
+		/// since it was last written to the on-disk FAT.
+		void writeChangedOffsets();
+
+		/// Read part of an entry's stored data.
+		std::string readEntryData(const FATEntry *pFAT, stream::pos off,
+			stream::len len);
+
+		/// Overwrite part of an entry's stored data.
+		void writeEntryData(const FATEntry *pFAT, stream::pos off,
+			const std::string& data);
+
+		/// Root of the offset tree.
+		/**
+		 * This is a treap holding every entry in vcFAT, ordered by offset, where
+		 * each node can carry an offset and index delta that has yet to be
+		 * applied to every entry below it.  This lets shiftFiles() move a whole
+		 * range of files in O(log n) time.  Like nameIndex, it is built on demand
+		 * because format handlers populate vcFAT directly.
+		 */
+		mutable OffsetNode *offsetRoot;
+
+		/// Seed for the offset tree node priorities.
+		mutable unsigned long offsetSeed;
+
+		/// True if a shift has been left pending in the offset tree.
+		mutable bool offsetsPending;
+
+		/// True if files have moved without their new offsets being written to
+		/// the FAT.
+		bool offsetsUnwritten;
+
+		/// Make sure the offset tree holds every entry in vcFAT.
+		void checkOffsetTree() const;
+
+		/// Apply all pending deltas, bringing every entry up to date.
+		void resolveAllEntries() const;
+
+		/// Add a new entry to the offset tree, in position by offset.
+		void addToOffsetTree(FATEntry *pid) const;
+
+		/// Remove an entry from the offset tree.
+		void removeFromOffsetTree(FATEntry *pid) const;
+
+		/// Number of FAT records set by setLazyFAT() that are not yet in vcFAT.
+		/**
+		 * Zero once vcFAT holds the whole FAT, which is always the case for
+		 * formats that don't use setLazyFAT().
+		 */
+		mutable unsigned int lenLazyFAT;
+
+		/// Offset of the first FAT record, for setLazyFAT().
+		stream::pos offLazyFAT;
+
+		/// Length of each FAT record, for setLazyFAT().
+		stream::len lenLazyRecord;
+
+		/// Entries already created from the lazy FAT, in FAT order.
+		/**
+		 * Slots are empty for records that haven't been asked for yet.  Keeping
+		 * them here means loadAllEntries() hands out the same EntryPtrs.
+		 */
+		mutable VC_ENTRYPTR lazyEntries;
+
+		/// Block of FAT records most recently read by readLazyEntry().
+		mutable std::vector<uint8_t> lazyPage;
+
+		/// Index of the first record in lazyPage.
+		mutable unsigned int lazyPageFirst;
+
+		/// Fill in an entry from the given record in the lazy FAT.
+		void readLazyEntry(unsigned int index, FATEntry *pEntry) const;
+
+		/// Index of filenames in the lazy FAT, from the key used by nameIndex to
+		/// the first record with that name.
+		typedef boost::unordered_map<std::string, unsigned int> LAZY_NAME_INDEX;
+
+		/// Filename index for the lazy FAT, built by the first find().
+		mutable LAZY_NAME_INDEX lazyNameIndex;
+
+		/// Fill lazyNameIndex from the FAT records.
+		void buildLazyNameIndex() const;
+
+		/// Put every record from the lazy FAT into vcFAT.
+		void loadAllEntries() const;
+
+		/// Filename index, built on demand by find().
+		mutable NAME_INDEX nameIndex;
+
+		/// Number of changes made to vcFAT, see fatChanged().
+		/**
+		 * Format handlers populate vcFAT directly in their constructors, so this
+		 * starts out ahead of revNameIndex and revTypedFAT to mark both caches
+		 * as stale.
+		 */
+		mutable unsigned long fatRevision;
+
+		/// Value of fatRevision when nameIndex was last brought up to date.
+		mutable unsigned long revNameIndex;
+
+		/// Value of fatRevision when typedFAT was last brought up to date.
+		mutable unsigned long revTypedFAT;
+
+		/// Is nameIndex in sync with vcFAT?
+		bool isNameIndexCurrent() const;
+
+		/// Is typedFAT in sync with vcFAT?
+		bool isTypedFATCurrent() const;
+
+		/// Discard nameIndex and populate it again from vcFAT.
+		void rebuildNameIndex() const;
+
+		/// Add an entry to nameIndex, keeping duplicates in FAT order.
+		/**
+		 * @param id
+		 *   Entry to add.
+		 *
+		 * @param pFAT
+		 *   Same entry as id, as a FATEntry.
+		 */
+		void addToNameIndex(const EntryPtr& id, const FATEntry *pFAT) const;
+
+		/// Remove an entry from nameIndex.
+		/**
+		 * @param id
+		 *   Entry to remove.
+		 *
+		 * @param name
+		 *   Filename the entry was indexed under, which may differ from
+		 *   id->strName during a rename.
+		 */
+		void removeFromNameIndex(const EntryPtr& id, const std::string& name) const;
+
+		/// Cached result of getFATEntries().
+		mutable VC_FATENTRY typedFAT;
+
+		/// First entry with at least one substream open.
+		/**
+		 * Entries are linked through FATEntry::nextOpen, and each one holds its
+		 * own list of substreams in FATEntry::openStreams.  This way open files
+		 * can be moved around as other files are inserted, resized, etc. without
+		 * keeping them open simply because we're keeping track of them, and
+		 * without searching through unrelated substreams.
+		 */
+		FATEntry *openEntries;
+
+		/// Sidecar index given to loadIndex(), if any.
+		stream::inout_sptr indexCache;
+
+		/// Caller's stamp for the archive, as given to loadIndex().
+		uint64_t indexStamp;
+
+		/// Add a newly opened substream to its entry's list.
+		void attachStream(FATEntry *pFAT, EntryStream *sub);
+
+		/// Remove a substream from its entry's list, called as it is destroyed.
+		void detachStream(EntryStream *sub);
+
+		/// Stop tracking every substream open on an entry.
+		/**
+		 * The substreams will no longer be moved or resized along with the
+		 * archive, and will not notify the archive when they are destroyed.
+		 */
+		void detachEntryStreams(FATEntry *pFAT);
 
 		/// Should the given entry be moved during an insert/resize operation?
 		bool entryInRange(const FATEntry *fat, stream::pos offStart,
 			const FATEntry *fatSkip);
 
 		/// Substream truncate callback to resize the substream.
-		void resizeSubstream(FATEntryPtr id, stream::len newSize);
+		/**
+		 * If the substream has been enlarged before, space is set aside after
+		 * the file's data for it to grow into, so a file being written a bit at
+		 * a time doesn't shift the rest of the archive along with every write.
+		 * The file's size is always the amount of data in the substream, and
+		 * the extra space is removed again by trimSubstream().
+		 */
+		void resizeSubstream(EntryStream *sub, stream::len newSize);
+
+		/// Give up any extra space resizeSubstream() reserved for a substream.
+		/**
+		 * Called when the substream is flushed or closed.
+		 */
+		void trimSubstream(EntryStream *sub);
+
+		/// Make sure there are at least lenReserve bytes set aside after a file.
+		void reserveSpace(FATEntry *pFAT, stream::len lenReserve);
+
+		/// Remove the space set aside after a file, moving the files after it
+		/// back again.
+		void releaseSpace(FATEntry *pFAT);
 };
 
 /// Function for test code only, do not use.  Searches for files based on the
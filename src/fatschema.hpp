@@ -0,0 +1,210 @@
+/**
+ * @file  fatschema.hpp
+ * @brief Compile-time layout of fixed-length FAT records.
+ *
+ * Copyright (C) 2010-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_FATSCHEMA_HPP_
+#define _CAMOTO_FATSCHEMA_HPP_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <string.h> // memcpy, memset
+#include <stdint.h>
+#include <boost/static_assert.hpp>
+#include <camoto/stream.hpp>
+
+namespace camoto {
+namespace gamearchive {
+
+/// Unsigned integer field at a fixed position within a FAT record.
+/**
+ * Format handlers describe each field of their FAT record once, as a typedef
+ * of this template (or FATFieldString) alongside the other format constants:
+ *
+ * @code
+ * typedef FATFieldString< 0, 12> GRPFieldName;
+ * typedef FATFieldInt   <12,  4> GRPFieldSize;
+ * @endcode
+ *
+ * The whole FAT can then be read with readFATRecords() and each record
+ * decoded in memory with get(), while update() rewrites a single field in
+ * the archive when a file is renamed, moved or resized.
+ *
+ * @param Offset
+ *   Position of the field from the start of the record, in bytes.
+ *
+ * @param Width
+ *   Length of the field, from 1 to 4 bytes.
+ *
+ * @param BigEndian
+ *   true if the most significant byte is stored first.
+ */
+template <unsigned int Offset, unsigned int Width, bool BigEndian = false>
+struct FATFieldInt
+{
+	BOOST_STATIC_ASSERT((Width >= 1) && (Width <= 4));
+
+	enum {
+		offset = Offset, ///< Position of the field within the record
+		width = Width    ///< Length of the field in bytes
+	};
+
+	/// Decode the field from a record in memory.
+	static uint32_t get(const uint8_t *record)
+	{
+		const uint8_t *field = record + Offset;
+		uint32_t value = 0;
+		for (unsigned int i = 0; i < Width; i++) {
+			value |= (uint32_t)field[BigEndian ? Width - 1 - i : i] << (i * 8);
+		}
+		return value;
+	}
+
+	/// Encode the field into a record in memory.
+	static void set(uint8_t *record, uint32_t value)
+	{
+		encode(record + Offset, value);
+		return;
+	}
+
+	/// Overwrite just this field of a record stored in the archive.
+	/**
+	 * @param archive
+	 *   Stream to write to.  The write pointer is left after the field.
+	 *
+	 * @param offRecord
+	 *   Offset of the start of the record within archive.
+	 *
+	 * @param value
+	 *   New value for the field.
+	 */
+	static void update(stream::output_sptr archive, stream::pos offRecord,
+		uint32_t value)
+	{
+		uint8_t field[Width];
+		encode(field, value);
+		archive->seekp(offRecord + Offset, stream::start);
+		archive->write(field, Width);
+		return;
+	}
+
+	private:
+		static void encode(uint8_t *field, uint32_t value)
+		{
+			for (unsigned int i = 0; i < Width; i++) {
+				field[BigEndian ? Width - 1 - i : i] = (uint8_t)(value >> (i * 8));
+			}
+			return;
+		}
+};
+
+/// Null-padded string field at a fixed position within a FAT record.
+/**
+ * The string ends at the first null byte, or at the end of the field if it
+ * fills the whole field.  When written, shorter strings are padded with nulls
+ * and longer ones are truncated to fit.
+ *
+ * @param Offset
+ *   Position of the field from the start of the record, in bytes.
+ *
+ * @param Width
+ *   Length of the field in bytes.
+ */
+template <unsigned int Offset, unsigned int Width>
+struct FATFieldString
+{
+	enum {
+		offset = Offset, ///< Position of the field within the record
+		width = Width    ///< Length of the field in bytes
+	};
+
+	/// Decode the field from a record in memory.
+	static std::string get(const uint8_t *record)
+	{
+		const char *field = (const char *)record + Offset;
+		return std::string(field, std::find(field, field + Width, '\0'));
+	}
+
+	/// Encode the field into a record in memory.
+	static void set(uint8_t *record, const std::string& value)
+	{
+		encode(record + Offset, value);
+		return;
+	}
+
+	/// Overwrite just this field of a record stored in the archive.
+	/**
+	 * @see FATFieldInt::update()
+	 */
+	static void update(stream::output_sptr archive, stream::pos offRecord,
+		const std::string& value)
+	{
+		uint8_t field[Width];
+		encode(field, value);
+		archive->seekp(offRecord + Offset, stream::start);
+		archive->write(field, Width);
+		return;
+	}
+
+	private:
+		static void encode(uint8_t *field, const std::string& value)
+		{
+			std::string::size_type len = std::min<std::string::size_type>(
+				value.length(), Width);
+			memcpy(field, value.data(), len);
+			memset(field + len, 0, Width - len);
+			return;
+		}
+};
+
+/// Read a run of fixed-length FAT records into memory with one read().
+/**
+ * @param archive
+ *   Stream to read from.
+ *
+ * @param offFirst
+ *   Offset of the first record.
+ *
+ * @param numRecords
+ *   Number of records to read.
+ *
+ * @param lenRecord
+ *   Length of each record in bytes.
+ *
+ * @param records
+ *   On return, holds all the records back to back, so record i begins at
+ *   &(*records)[i * lenRecord].
+ *
+ * @throws stream::incomplete_read if the archive ends before the last record.
+ */
+inline void readFATRecords(stream::input_sptr archive, stream::pos offFirst,
+	unsigned int numRecords, unsigned int lenRecord,
+	std::vector<uint8_t> *records)
+{
+	records->resize(numRecords * lenRecord);
+	if (records->empty()) return;
+	archive->seekg(offFirst, stream::start);
+	archive->read(&(*records)[0], records->size());
+	return;
+}
+
+} // namespace gamearchive
+} // namespace camoto
+
+#endif // _CAMOTO_FATSCHEMA_HPP_
@@ -0,0 +1,74 @@
+/**
+ * @file   filter-buffered.cpp
+ * @brief  Base class for filters that need all their input before any output.
+ *
+ * Copyright (C) 2010-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <string.h> // memcpy
+#include "filter-buffered.hpp"
+
+namespace camoto {
+namespace gamearchive {
+
+void filter_buffered_compress::reset(stream::len lenInput)
+{
+	this->lenInput = lenInput;
+	this->input.clear();
+	this->input.reserve(lenInput);
+	this->output.clear();
+	this->posOutput = 0;
+	this->compressed = false;
+	return;
+}
+
+void filter_buffered_compress::transform(uint8_t *out, stream::len *lenOut,
+	const uint8_t *in, stream::len *lenIn)
+{
+	// Anything past the length given to reset() would either be lost or left
+	// out of a size already written into the header.
+	// TESTED BY: got_lzss_too_long
+	if (*lenIn > this->lenInput - this->input.size()) {
+		throw filter_error("More data was given to the compression filter than "
+			"the length it was reset with.");
+	}
+	this->input.insert(this->input.end(), in, in + *lenIn);
+
+	stream::len w = 0;
+	if (this->input.size() == this->lenInput) {
+		if (!this->compressed) {
+			this->compress();
+			this->compressed = true;
+		}
+		w = std::min<stream::len>(*lenOut,
+			this->output.size() - this->posOutput);
+		if (w) memcpy(out, &this->output[this->posOutput], w);
+		this->posOutput += w;
+	}
+
+	*lenOut = w;
+	return;
+}
+
+int filter_buffered_compress::appendByte(std::vector<uint8_t> *out, uint8_t c)
+{
+	out->push_back(c);
+	return 1;
+}
+
+} // namespace gamearchive
+} // namespace camoto
@@ -0,0 +1,61 @@
+/**
+ * @file   filter-buffered.hpp
+ * @brief  Base class for filters that need all their input before any output.
+ *
+ * Copyright (C) 2010-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_FILTER_BUFFERED_HPP_
+#define _CAMOTO_FILTER_BUFFERED_HPP_
+
+#include <vector>
+#include <camoto/filter.hpp>
+
+namespace camoto {
+namespace gamearchive {
+
+/// Compression filter that collects the whole file before compressing it.
+/**
+ * transform() stores the incoming data until the amount given to reset() has
+ * arrived, then calls compress() once and hands back the result over as many
+ * calls as it takes.  Formats where any byte could be matched by a later one,
+ * or where the header holds values only known at the end, work this way.
+ */
+class filter_buffered_compress: virtual public filter
+{
+	public:
+		virtual void reset(stream::len lenInput);
+		virtual void transform(uint8_t *out, stream::len *lenOut,
+			const uint8_t *in, stream::len *lenIn);
+
+	protected:
+		stream::len lenInput;         ///< Amount of data to compress
+		std::vector<uint8_t> input;   ///< Data received so far
+		std::vector<uint8_t> output;  ///< Compressed data, once input is complete
+		stream::len posOutput;        ///< Amount of output already returned
+		bool compressed;              ///< Has output been filled in yet?
+
+		/// Compress all of input into output.
+		virtual void compress() = 0;
+
+		/// Callback for bitstream to add bytes onto the end of a vector.
+		static int appendByte(std::vector<uint8_t> *out, uint8_t c);
+};
+
+} // namespace gamearchive
+} // namespace camoto
+
+#endif // _CAMOTO_FILTER_BUFFERED_HPP_
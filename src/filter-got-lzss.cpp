@@ -18,6 +18,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <string.h> // memcpy
 #include <camoto/stream_filtered.hpp>
 #include "filter-got-lzss.hpp"
 
@@ -26,6 +28,11 @@ namespace gamearchive {
 
 #define GOT_DICT_SIZE 4096
 
+#define GOT_MIN_MATCH  2                         // shortest match in a code
+#define GOT_MAX_MATCH  (15 + GOT_MIN_MATCH)      // 4-bit length field
+#define GOT_MAX_DIST   (GOT_DICT_SIZE - 1)       // 12-bit distance field
+#define GOT_MAX_CHAIN  64                        // matches to try per byte
+
 #define ADD_DICT(c) \
 	this->dictionary[this->dictPos] = c; \
 	this->dictPos = (this->dictPos + 1) % GOT_DICT_SIZE;
@@ -147,52 +154,88 @@ void filter_got_lzss::reset(stream::len lenInput)
 {
 	if (lenInput > 65535) throw stream::error(
 		"God of Thunder compression only supports files less than 64kB in size.");
-	this->lenInput = lenInput;
-	this->count = 0;
-	this->state = S0_START;
+	this->filter_buffered_compress::reset(lenInput);
 	return;
 }
 
-void filter_got_lzss::transform(uint8_t *out, stream::len *lenOut,
-	const uint8_t *in, stream::len *lenIn)
+void filter_got_lzss::compress()
 {
-	stream::len r = 0, w = 0;
-
-	while (              // while there is...
-		(w < *lenOut)      // more space to write into, and
-		&& (r < *lenIn)    // more data to read, or
-	) {
-		switch (this->state) {
-
-			case S0_START:
-				assert(*lenOut > 4);
-				*out++ = this->lenInput & 0xFF;
-				*out++ = (this->lenInput >> 8) & 0xFF;
-				*out++ = 0x01;
-				*out++ = 0x00;
-				w += 4;
-				this->state = S1_CODE;
-				break;
+	// TESTED BY: got_lzss_repeat
+	// TESTED BY: got_lzss_roundtrip
+	unsigned int len = this->input.size();
+
+	// An empty file stays empty
+	if (len == 0) return;
+
+	const uint8_t *data = &this->input[0];
+	std::vector<uint8_t>& out = this->output;
+	out.reserve(4 + len + (len + 7) / 8);
+	out.push_back(len & 0xFF);
+	out.push_back((len >> 8) & 0xFF);
+	out.push_back(0x01);
+	out.push_back(0x00);
+
+	// The most recent position of each two-byte sequence, and for each
+	// position the one before it with the same two bytes.
+	std::vector<int> head(65536, -1);
+	std::vector<int> prev(len, -1);
+
+	unsigned int posFlags = 0; // Offset of the current flag byte in out
+	unsigned int numFlags = 8; // Flags used in it, 8 when a new one is needed
+	unsigned int pos = 0;
+	while (pos < len) {
+		if (numFlags == 8) {
+			// Unused flags at the end of the data are left as literals
+			posFlags = out.size();
+			out.push_back(0xFF);
+			numFlags = 0;
+		}
 
-			case S1_CODE:
-				*out++ = 0xFF;
-				w++;
-				this->state = S2_DATA;
-				this->count = 8;
-				break;
+		unsigned int bestLen = 0, bestDist = 0;
+		unsigned int maxLen = std::min<unsigned int>(GOT_MAX_MATCH, len - pos);
+		if (maxLen >= GOT_MIN_MATCH) {
+			int cand = head[data[pos] | (data[pos + 1] << 8)];
+			for (unsigned int depth = 0;
+				(cand >= 0) && (depth < GOT_MAX_CHAIN);
+				depth++, cand = prev[cand]
+			) {
+				// Positions come out newest first, so the rest are out of reach too
+				unsigned int dist = pos - cand;
+				if (dist > GOT_MAX_DIST) break;
+
+				// The match may run on past pos, as the decoder copies one byte at
+				// a time it will have written those bytes by the time it needs them
+				unsigned int l = 0;
+				while ((l < maxLen) && (data[cand + l] == data[pos + l])) l++;
+				if (l > bestLen) {
+					bestLen = l;
+					bestDist = dist;
+					if (l == maxLen) break;
+				}
+			}
+		}
 
-			case S2_DATA:
-				*out++ = *in++;
-				r++;
-				w++;
-				this->count--;
-				if (this->count == 0) this->state = S1_CODE;
-				break;
+		unsigned int step;
+		if (bestLen >= GOT_MIN_MATCH) {
+			out[posFlags] &= ~(1 << numFlags);
+			unsigned int code = ((bestLen - GOT_MIN_MATCH) << 12) | bestDist;
+			out.push_back(code & 0xFF);
+			out.push_back(code >> 8);
+			step = bestLen;
+		} else {
+			out.push_back(data[pos]);
+			step = 1;
+		}
+		numFlags++;
+
+		// Add every position just written to the hash chains
+		for (; step > 0; step--, pos++) {
+			if (pos + 1 >= len) continue;
+			unsigned int key = data[pos] | (data[pos + 1] << 8);
+			prev[pos] = head[key];
+			head[key] = pos;
 		}
 	}
-
-	*lenIn = r;
-	*lenOut = w;
 	return;
 }
 
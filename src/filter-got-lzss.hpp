@@ -21,9 +21,11 @@
 #ifndef _CAMOTO_FILTER_GOT_LZSS_HPP_
 #define _CAMOTO_FILTER_GOT_LZSS_HPP_
 
+#include <vector>
 #include <boost/shared_array.hpp>
 #include <camoto/filter.hpp>
 #include <camoto/gamearchive/filtertype.hpp>
+#include "filter-buffered.hpp"
 
 namespace camoto {
 namespace gamearchive {
@@ -53,22 +55,20 @@ class filter_got_unlzss: virtual public filter
 		} state;
 };
 
-class filter_got_lzss: virtual public filter
+/// God of Thunder compression filter.
+/**
+ * The whole file is collected before anything is written, then compressed
+ * in one go, looking for matches through a hash chain of every earlier
+ * position starting with the same two bytes.  The 64kB limit on file size
+ * keeps this cheap.
+ */
+class filter_got_lzss: virtual public filter_buffered_compress
 {
 	public:
 		virtual void reset(stream::len lenInput);
-		virtual void transform(uint8_t *out, stream::len *lenOut,
-			const uint8_t *in, stream::len *lenIn);
 
 	protected:
-		unsigned int lenInput; ///< Decompressed size
-		int count; ///< Number of bytes written
-		/// Current state
-		enum {
-			S0_START,  ///< Write header
-			S1_CODE,   ///< LZSS code for next eight blocks
-			S2_DATA,   ///< Write data
-		} state;
+		virtual void compress();
 };
 
 /// God of Thunder decompression filter.
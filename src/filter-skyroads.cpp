@@ -18,7 +18,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <iostream>
+#include <string.h> // memcpy
 #include <boost/bind.hpp>
 #include <camoto/stream_filtered.hpp>
 #include "filter-skyroads.hpp"
@@ -28,6 +30,24 @@ namespace gamearchive {
 
 #define SKYROADS_DICT_SIZE 4096
 
+// Field widths used when compressing.  A short match code (one flag bit plus
+// the short distance and count fields) must be longer than 15 bits, so the
+// padding and the trailing zero byte written at the end of the data can never
+// form a complete code.  See filter_skyroads_lzs::compress().
+#define SKYROADS_WIDTH_COUNT  6   // match lengths of 2 to 65 bytes
+#define SKYROADS_WIDTH_SHORT  9   // distances of 2 to 513 bytes
+#define SKYROADS_WIDTH_LONG   12  // distances of 514 bytes and up
+
+#if 1 + SKYROADS_WIDTH_SHORT + SKYROADS_WIDTH_COUNT <= 15
+#error SkyRoads short match codes are too short to end the data safely
+#endif
+
+#define SKYROADS_MIN_MATCH  2
+#define SKYROADS_MAX_MATCH  (SKYROADS_MIN_MATCH + (1 << SKYROADS_WIDTH_COUNT) - 1)
+#define SKYROADS_MIN_DIST   2
+#define SKYROADS_MAX_DIST   SKYROADS_DICT_SIZE
+#define SKYROADS_MAX_CHAIN  64  // matches to compare for each position
+
 #define ADD_DICT(c) \
 	this->dictionary[this->dictPos] = c; \
 	this->dictPos = (this->dictPos + 1) % SKYROADS_DICT_SIZE;
@@ -193,44 +213,127 @@ void filter_skyroads_unlzs::transform(uint8_t *out, stream::len *lenOut,
 }
 
 
-filter_skyroads_lzs::filter_skyroads_lzs()
-	:	data(bitstream::bigEndian)
+filter_skyroads_lzs::filter_skyroads_lzs(bool lazy)
+	:	data(bitstream::bigEndian),
+		lazy(lazy)
 {
 }
 
-void filter_skyroads_lzs::reset(stream::len lenInput)
+void filter_skyroads_lzs::compress()
 {
-	return;
-}
+	// TESTED BY: skyroads_lzs_repeat
+	// TESTED BY: skyroads_lzs_roundtrip*
+	fn_putnextchar cbNext = boost::bind(appendByte, &this->output, _1);
+
+	// Field widths, in the same order and byte order the decoder reads them
+	this->data.changeEndian(bitstream::littleEndian);
+	this->data.write(cbNext, 8, SKYROADS_WIDTH_COUNT);
+	this->data.write(cbNext, 8, SKYROADS_WIDTH_SHORT);
+	this->data.write(cbNext, 8, SKYROADS_WIDTH_LONG);
+	this->data.changeEndian(bitstream::bigEndian);
+
+	unsigned int len = this->input.size();
+	this->head.assign(65536, -1);
+	this->prev.assign(len, -1);
+
+	unsigned int pos = 0;
+	unsigned int matchLen = 0, matchDist = 0;
+	bool haveMatch = false; // matchLen and matchDist are already for pos
+	while (pos < len) {
+		if (!haveMatch) matchLen = this->findMatch(pos, &matchDist);
+		haveMatch = false;
+
+		if (
+			this->lazy
+			&& (matchLen >= SKYROADS_MIN_MATCH)
+			&& (matchLen < SKYROADS_MAX_MATCH)
+		) {
+			unsigned int nextDist;
+			unsigned int nextLen = this->findMatch(pos + 1, &nextDist);
+			if (nextLen > matchLen) {
+				// Starting one byte later gives a longer match, so hold off
+				this->data.write(cbNext, 2, 0x03);
+				this->data.write(cbNext, 8, this->input[pos]);
+				this->addPosition(pos++);
+				matchLen = nextLen;
+				matchDist = nextDist;
+				haveMatch = true;
+				continue;
+			}
+		}
 
-int putChar(uint8_t **out, const stream::len *lenOut, stream::len *w, uint8_t in)
-{
-	if (*w < *lenOut) {
-		**out = in;  // "write" byte
-		(*out)++;    // increment write buffer
-		(*w)++;      // increment write count
-		return 1;    // return number of bytes written
+		if (matchLen >= SKYROADS_MIN_MATCH) {
+			unsigned int shortDist = matchDist - SKYROADS_MIN_DIST;
+			if (shortDist < (1 << SKYROADS_WIDTH_SHORT)) {
+				this->data.write(cbNext, 1, 0x00);
+				this->data.write(cbNext, SKYROADS_WIDTH_SHORT, shortDist);
+			} else {
+				this->data.write(cbNext, 2, 0x02);
+				this->data.write(cbNext, SKYROADS_WIDTH_LONG,
+					shortDist - (1 << SKYROADS_WIDTH_SHORT));
+			}
+			this->data.write(cbNext, SKYROADS_WIDTH_COUNT,
+				matchLen - SKYROADS_MIN_MATCH);
+			for (unsigned int i = 0; i < matchLen; i++) this->addPosition(pos++);
+		} else {
+			this->data.write(cbNext, 2, 0x03);
+			this->data.write(cbNext, 8, this->input[pos]);
+			this->addPosition(pos++);
+		}
 	}
-	return 0; // EOF
+
+	// The decoder stops as soon as it has read the last byte, dropping any
+	// codes still sitting in its bit buffer, so one extra byte is needed to
+	// make it decode everything before that.  The padding plus the extra byte
+	// is at most 15 zero bits, which is too short to make a match code.
+	this->data.flushByte(cbNext);
+	this->output.push_back(0x00);
+
+	this->head.clear();
+	this->prev.clear();
+	return;
 }
 
-void filter_skyroads_lzs::transform(uint8_t *out, stream::len *lenOut,
-	const uint8_t *in, stream::len *lenIn)
+unsigned int filter_skyroads_lzs::findMatch(unsigned int pos,
+	unsigned int *dist) const
 {
-	stream::len r = 0, w = 0;
-	fn_putnextchar cbNext = boost::bind(putChar, &out, lenOut, &w, _1);
-
-	while (              // while there is...
-		(w + 2 < *lenOut) // leave some leftover bytes to guarantee the codeword will be written
-		&& (r < *lenIn)    // more data to read, or
+	unsigned int len = this->input.size();
+	if (pos + SKYROADS_MIN_MATCH > len) return 0;
+	unsigned int maxLen = std::min<unsigned int>(SKYROADS_MAX_MATCH, len - pos);
+
+	const uint8_t *data = &this->input[0];
+	unsigned int bestLen = 0;
+	int cand = this->head[data[pos] | (data[pos + 1] << 8)];
+	for (unsigned int depth = 0;
+		(cand >= 0) && (depth < SKYROADS_MAX_CHAIN);
+		depth++, cand = this->prev[cand]
 	) {
-		this->data.write(cbNext, 2, 0x03);
-		this->data.write(cbNext, 8, *in++);
-		r++;
+		unsigned int d = pos - cand;
+		// The chains run from newest to oldest, so nothing further on is in reach
+		if (d > SKYROADS_MAX_DIST) break;
+		// The format can't refer to the byte immediately before
+		if (d < SKYROADS_MIN_DIST) continue;
+
+		// Overlapping the current position is fine, the decoder copies the
+		// match one byte at a time
+		unsigned int l = 0;
+		while ((l < maxLen) && (data[cand + l] == data[pos + l])) l++;
+		if (l > bestLen) {
+			bestLen = l;
+			*dist = d;
+			if (l == maxLen) break;
+		}
 	}
+	if (bestLen < SKYROADS_MIN_MATCH) return 0;
+	return bestLen;
+}
 
-	*lenIn = r;
-	*lenOut = w;
+void filter_skyroads_lzs::addPosition(unsigned int pos)
+{
+	if (pos + 1 >= this->input.size()) return;
+	unsigned int key = this->input[pos] | (this->input[pos + 1] << 8);
+	this->prev[pos] = this->head[key];
+	this->head[key] = pos;
 	return;
 }
 
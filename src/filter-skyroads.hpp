@@ -21,10 +21,12 @@
 #ifndef _CAMOTO_FILTER_SKYROADS_LZS_HPP_
 #define _CAMOTO_FILTER_SKYROADS_LZS_HPP_
 
+#include <vector>
 #include <camoto/bitstream.hpp>
 #include <boost/shared_array.hpp>
 #include <camoto/filter.hpp>
 #include <camoto/gamearchive/filtertype.hpp>
+#include "filter-buffered.hpp"
 
 namespace camoto {
 namespace gamearchive {
@@ -59,17 +61,52 @@ class filter_skyroads_unlzs: virtual public filter
 		} state;
 };
 
-class filter_skyroads_lzs: virtual public filter
+/// SkyRoads compression filter.
+/**
+ * All the input is gathered first and then compressed in one go, finding
+ * matches through hash chains keyed on the next two bytes.
+ */
+class filter_skyroads_lzs: virtual public filter_buffered_compress
 {
 	public:
-		filter_skyroads_lzs();
-
-		virtual void reset(stream::len lenInput);
-		virtual void transform(uint8_t *out, stream::len *lenOut,
-			const uint8_t *in, stream::len *lenIn);
+		/// Create a new compression filter.
+		/**
+		 * @param lazy
+		 *   true to check, whenever a match is found, whether a longer one
+		 *   starts at the following byte.  If it does, a literal is written
+		 *   and the longer match used instead.  This compresses better, at the
+		 *   cost of a second search for most matches.
+		 */
+		filter_skyroads_lzs(bool lazy = true);
 
 	protected:
 		bitstream data;
+		bool lazy;                    ///< Use lazy matching?
+
+		/// Most recent position of each two-byte sequence in input, or -1.
+		std::vector<int> head;
+
+		/// For each position in input, the one before with the same two bytes.
+		std::vector<int> prev;
+
+		virtual void compress();
+
+		/// Find the longest match for the data at pos within the dictionary.
+		/**
+		 * @param pos
+		 *   Offset into input.  Positions before this must already have been
+		 *   passed to addPosition().
+		 *
+		 * @param dist
+		 *   On return, how far back the match starts.  Unchanged if there is no
+		 *   match.
+		 *
+		 * @return Length of the match, or 0 if nothing long enough was found.
+		 */
+		unsigned int findMatch(unsigned int pos, unsigned int *dist) const;
+
+		/// Add an input position to the hash chains.
+		void addPosition(unsigned int pos);
 };
 
 /// SkyRoads decompression filter.
@@ -1,6 +1,6 @@
 /**
  * @file   filter-stargunner.cpp
- * @brief  Filter implementation for decompressing Stargunner files.
+ * @brief  Filter implementation for Stargunner compression.
  *
  * This file format is fully documented on the ModdingWiki:
  *   http://www.shikadi.net/moddingwiki/DLT_Format
@@ -23,8 +23,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <queue>
 #include <stack>
+#include <string.h>
 #include <boost/bind.hpp>
+#include <boost/unordered_map.hpp>
 #include <camoto/filter.hpp>
 #include <camoto/stream_filtered.hpp>
 #include <camoto/bitstream.hpp>
@@ -35,6 +39,21 @@
 namespace camoto {
 namespace gamearchive {
 
+/// A pair must appear at least this many times before it is worth encoding.
+/**
+ * Its dictionary entry costs two bytes, so anything less saves nothing.
+ */
+#define SG_MIN_PAIR_COUNT 3
+
+/// Deepest a codeword may nest before the decompressor runs out of room.
+/**
+ * explode_chunk() keeps the right-hand half of every codeword it is part way
+ * through in a 32 byte buffer, and refuses to expand any further once 30
+ * bytes are waiting.  A codeword nested n levels deep leaves at most n - 1
+ * bytes waiting when its innermost pair is expanded.
+ */
+#define SG_MAX_DEPTH 30
+
 void filter_stargunner_decompress::reset(stream::len lenInput)
 {
 	this->gotHeader = false;
@@ -212,6 +231,229 @@ void filter_stargunner_decompress::transform(uint8_t *out, stream::len *lenOut,
 }
 
 
+void filter_stargunner_compress::compress()
+{
+	// TESTED BY: stargunner_bpe_pairs
+	// TESTED BY: stargunner_bpe_roundtrip*
+	unsigned int len = this->input.size();
+	this->output.push_back('P');
+	this->output.push_back('G');
+	this->output.push_back('B');
+	this->output.push_back('P');
+	this->output.push_back(len & 0xFF);
+	this->output.push_back((len >> 8) & 0xFF);
+	this->output.push_back((len >> 16) & 0xFF);
+	this->output.push_back(len >> 24);
+
+	int numChunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	std::vector<std::vector<uint8_t> > chunks(numChunks);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int i = 0; i < numChunks; i++) {
+		unsigned int off = i * CHUNK_SIZE;
+		this->implode_chunk(&this->input[off],
+			std::min<unsigned int>(CHUNK_SIZE, len - off), &chunks[i]);
+	}
+
+	for (int i = 0; i < numChunks; i++) {
+		this->output.insert(this->output.end(), chunks[i].begin(),
+			chunks[i].end());
+	}
+	return;
+}
+
+/// Write one dictionary and the data encoded with it.
+/**
+ * @param tableA
+ *   First byte of each codeword's pair, or the codeword itself if it is a
+ *   plain byte.
+ *
+ * @param tableB
+ *   Second byte of each codeword's pair.  Unused for plain bytes.
+ *
+ * @param data
+ *   Encoded data.
+ *
+ * @param len
+ *   Number of bytes in data.
+ *
+ * @param out
+ *   The block is appended here.
+ */
+static void writeBlock(const uint8_t *tableA, const uint8_t *tableB,
+	const uint8_t *data, unsigned int len, std::vector<uint8_t> *out)
+{
+	unsigned int pos = 0;
+	while (pos < 256) {
+		// Plain bytes are skipped over, up to 128 at a time
+		unsigned int run = 0;
+		while ((pos + run < 256) && (run < 128) && (tableA[pos + run] == pos + run)) {
+			run++;
+		}
+		unsigned int count;
+		if (run) {
+			out->push_back(127 + run);
+			pos += run;
+			if (pos == 256) break;
+			// The decoder always reads one entry after a skip
+			count = 1;
+		} else {
+			count = 0;
+			while ((pos + count < 256) && (count < 128) &&
+				(tableA[pos + count] != pos + count)
+			) {
+				count++;
+			}
+			out->push_back(count - 1);
+		}
+		for (unsigned int i = 0; i < count; i++, pos++) {
+			out->push_back(tableA[pos]);
+			if (tableA[pos] != pos) out->push_back(tableB[pos]);
+		}
+	}
+
+	out->push_back(len & 0xFF);
+	out->push_back(len >> 8);
+	out->insert(out->end(), data, data + len);
+	return;
+}
+
+void filter_stargunner_compress::implode_chunk(const uint8_t *in,
+	unsigned int len, std::vector<uint8_t> *out) const
+{
+	// The chunk is held as a linked list so a pair can be merged in place,
+	// without moving everything after it.
+	std::vector<uint8_t> sym(in, in + len);
+	std::vector<int> next(len), prev(len);
+	std::vector<bool> merged(len, false);
+	for (unsigned int i = 0; i < len; i++) {
+		next[i] = (i + 1 < len) ? (int)i + 1 : -1;
+		prev[i] = (int)i - 1;
+	}
+
+	uint8_t tableA[256], tableB[256];
+	unsigned int depth[256];
+	bool used[256];
+	for (unsigned int i = 0; i < 256; i++) {
+		tableA[i] = i;
+		tableB[i] = 0;
+		depth[i] = 0;
+		used[i] = false;
+	}
+	for (unsigned int i = 0; i < len; i++) used[sym[i]] = true;
+
+	// Each pair (first byte in the high bits) is counted once, up front, and
+	// the counts are then adjusted only around each merge.  The queue holds
+	// an entry for every count a pair has had; those that no longer match
+	// the pair's current count are stale and skipped over.
+	std::vector<unsigned int> count(65536, 0);
+	typedef boost::unordered_map<unsigned int, std::vector<int> > PAIR_POSITIONS;
+	PAIR_POSITIONS where; // may include positions the pair has since left
+	typedef std::pair<unsigned int, unsigned int> PAIR_COUNT;
+	std::priority_queue<PAIR_COUNT> queue;
+
+	for (int i = 0; i + 1 < (signed)len; i++) {
+		unsigned int pair = (sym[i] << 8) | sym[i + 1];
+		count[pair]++;
+		where[pair].push_back(i);
+	}
+	for (PAIR_POSITIONS::const_iterator
+		i = where.begin(); i != where.end(); i++
+	) {
+		queue.push(PAIR_COUNT(count[i->first], i->first));
+	}
+
+	unsigned int nextCode = 0;
+	while (!queue.empty()) {
+		PAIR_COUNT top = queue.top();
+		queue.pop();
+		unsigned int pair = top.second;
+		if (top.first != count[pair]) continue; // stale
+		if (top.first < SG_MIN_PAIR_COUNT) break;
+
+		uint8_t a = pair >> 8, b = pair & 0xFF;
+		unsigned int d = 1 + std::max(depth[a], depth[b]);
+		if (d > SG_MAX_DEPTH) continue;
+
+		while ((nextCode < 256) && used[nextCode]) nextCode++;
+		if (nextCode == 256) break; // every byte value is taken
+		uint8_t code = nextCode;
+		used[code] = true;
+		tableA[code] = a;
+		tableB[code] = b;
+		depth[code] = d;
+
+		std::vector<int> positions;
+		positions.swap(where[pair]);
+		where.erase(pair);
+		// Left to right, so runs like "xxx" merge the same way every time
+		std::sort(positions.begin(), positions.end());
+		for (std::vector<int>::const_iterator
+			i = positions.begin(); i != positions.end(); i++
+		) {
+			int p = *i;
+			if (merged[p]) continue;
+			int q = next[p];
+			if ((q < 0) || (sym[p] != a) || (sym[q] != b)) continue;
+
+			int l = prev[p], r = next[q];
+			if (l >= 0) {
+				unsigned int old = (sym[l] << 8) | a;
+				if (--count[old]) queue.push(PAIR_COUNT(count[old], old));
+			}
+			if (r >= 0) {
+				unsigned int old = (b << 8) | sym[r];
+				if (--count[old]) queue.push(PAIR_COUNT(count[old], old));
+			}
+			count[pair]--;
+
+			sym[p] = code;
+			merged[q] = true;
+			next[p] = r;
+			if (r >= 0) prev[r] = p;
+
+			if (l >= 0) {
+				unsigned int added = (sym[l] << 8) | code;
+				where[added].push_back(l);
+				queue.push(PAIR_COUNT(++count[added], added));
+			}
+			if (r >= 0) {
+				unsigned int added = (code << 8) | sym[r];
+				where[added].push_back(p);
+				queue.push(PAIR_COUNT(++count[added], added));
+			}
+		}
+	}
+
+	// The first byte is never merged away, so the list always starts there
+	std::vector<uint8_t> data;
+	data.reserve(len);
+	if (len) {
+		for (int p = 0; p >= 0; p = next[p]) data.push_back(sym[p]);
+	}
+
+	std::vector<uint8_t> block;
+	writeBlock(tableA, tableB, data.empty() ? NULL : &data[0], data.size(),
+		&block);
+
+	// Overlapping pairs like "xxx" are counted twice but merged once, so on
+	// rare occasions the dictionary outweighs the savings.  Store the chunk
+	// as-is then, so it can never outgrow the decompressor's buffer.
+	if (block.size() > len + 5) {
+		for (unsigned int i = 0; i < 256; i++) tableA[i] = i;
+		block.clear();
+		writeBlock(tableA, tableB, in, len, &block);
+	}
+	assert(block.size() + 2 <= CMP_CHUNK_SIZE);
+
+	out->push_back(block.size() & 0xFF);
+	out->push_back(block.size() >> 8);
+	out->insert(out->end(), block.begin(), block.end());
+	return;
+}
+
+
 StargunnerFilterType::StargunnerFilterType()
 {
 }
@@ -242,8 +484,7 @@ stream::inout_sptr StargunnerFilterType::apply(stream::inout_sptr target,
 {
 	stream::filtered_sptr st(new stream::filtered());
 	filter_sptr de(new filter_stargunner_decompress());
-	/// @todo Implement Stargunner compression
-	filter_sptr en;//(new filter_stargunner_compress());
+	filter_sptr en(new filter_stargunner_compress());
 	st->open(target, de, en, resize);
 	return st;
 }
@@ -260,8 +501,7 @@ stream::output_sptr StargunnerFilterType::apply(stream::output_sptr target,
 	stream::fn_truncate resize) const
 {
 	stream::output_filtered_sptr st(new stream::output_filtered());
-	/// @todo Implement Stargunner compression
-	filter_sptr en;//(new filter_stargunner_compress());
+	filter_sptr en(new filter_stargunner_compress());
 	st->open(target, en, resize);
 	return st;
 }
@@ -1,6 +1,6 @@
 /**
  * @file   filter-stargunner.hpp
- * @brief  Filter implementation for decompressing Stargunner files.
+ * @brief  Filter implementation for Stargunner compression.
  *
  * Copyright (C) 2010-2013 Adam Nielsen <malvineous@shikadi.net>
  *
@@ -22,9 +22,11 @@
 #define _CAMOTO_FILTER_STARGUNNER_HPP_
 
 #include <stack>
+#include <vector>
 #include <camoto/stream.hpp>
 #include <camoto/bitstream.hpp>
 #include <camoto/gamearchive/filtertype.hpp>
+#include "filter-buffered.hpp"
 
 namespace camoto {
 namespace gamearchive {
@@ -68,6 +70,40 @@ class filter_stargunner_decompress: virtual public filter
 		unsigned int posOut;   ///< How much data has been read out of bufOut
 };
 
+/// Stargunner compression filter.
+/**
+ * All the input is gathered first, then each 4kB chunk is compressed on its
+ * own with byte-pair encoding: the most common pair of adjacent bytes is
+ * repeatedly replaced by a byte value the chunk does not otherwise use, until
+ * no pair occurs often enough to pay for its dictionary entry or there are no
+ * spare byte values left.
+ *
+ * Since chunks share nothing, they are compressed in parallel when the
+ * library is built with OpenMP.
+ */
+class filter_stargunner_compress: virtual public filter_buffered_compress
+{
+	public:
+		/// Compress a data chunk.
+		/**
+		 * @param in
+		 *   Input data.
+		 *
+		 * @param len
+		 *   Number of bytes in the chunk, no more than CHUNK_SIZE.
+		 *
+		 * @param out
+		 *   Compressed data is appended here, starting with the chunk length, so
+		 *   it can be passed to explode_chunk() after skipping the first two
+		 *   bytes.
+		 */
+		void implode_chunk(const uint8_t *in, unsigned int len,
+			std::vector<uint8_t> *out) const;
+
+	protected:
+		virtual void compress();
+};
+
 /// Stargunner decompression filter.
 class StargunnerFilterType: virtual public FilterType
 {
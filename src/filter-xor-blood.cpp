@@ -18,8 +18,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <string.h> // memcpy
 #include <boost/iostreams/invert.hpp>
-#include <camoto/stream_filtered.hpp>
 #include "filter-xor-blood.hpp"
 
 namespace camoto {
@@ -37,6 +38,120 @@ uint8_t filter_rff_crypt::getKey()
 	return (uint8_t)(this->seed + (this->offset >> 1));
 }
 
+/// Encrypt or decrypt part of an RFF file in place.
+/**
+ * @param buffer
+ *   Data to crypt.
+ *
+ * @param len
+ *   Number of bytes in buffer.
+ *
+ * @param off
+ *   Offset of buffer[0] from the start of the file.  Nothing is changed if
+ *   this is past the encrypted part.
+ */
+static void cryptPrefix(uint8_t *buffer, stream::len len, stream::pos off)
+{
+	// Same key as filter_rff_crypt with a seed of zero
+	for (; (len > 0) && (off < RFF_FILE_CRYPT_LEN); len--, off++) {
+		*buffer++ ^= (uint8_t)(off >> 1);
+	}
+	return;
+}
+
+void input_rff_crypt::open(stream::input_sptr parent)
+{
+	// Start at the beginning of the file, like a filtered stream would
+	this->in_parent = parent;
+	this->in_parent->seekg(0, stream::start);
+	return;
+}
+
+stream::len input_rff_crypt::try_read(uint8_t *buffer, stream::len len)
+{
+	// TESTED BY: rff_crypt_stream_read
+	// TESTED BY: rff_crypt_stream_seek
+	stream::pos off = this->in_parent->tellg();
+	stream::len r = this->in_parent->try_read(buffer, len);
+	cryptPrefix(buffer, r, off);
+	return r;
+}
+
+void input_rff_crypt::seekg(stream::delta off, stream::seek_from from)
+{
+	this->in_parent->seekg(off, from);
+	return;
+}
+
+stream::pos input_rff_crypt::tellg() const
+{
+	return this->in_parent->tellg();
+}
+
+stream::len input_rff_crypt::size() const
+{
+	return this->in_parent->size();
+}
+
+void output_rff_crypt::open(stream::output_sptr parent,
+	stream::fn_truncate resize)
+{
+	this->out_parent = parent;
+	this->out_parent->seekp(0, stream::start);
+	this->resize = resize;
+	return;
+}
+
+stream::len output_rff_crypt::try_write(const uint8_t *buffer,
+	stream::len len)
+{
+	// TESTED BY: rff_crypt_stream_write
+	stream::pos off = this->out_parent->tellp();
+	stream::len w = 0;
+	if (off < RFF_FILE_CRYPT_LEN) {
+		// Encrypt a copy of the start, as the caller's buffer is read-only
+		uint8_t prefix[RFF_FILE_CRYPT_LEN];
+		stream::len lenPrefix = std::min<stream::len>(len,
+			RFF_FILE_CRYPT_LEN - off);
+		memcpy(prefix, buffer, lenPrefix);
+		cryptPrefix(prefix, lenPrefix, off);
+		w = this->out_parent->try_write(prefix, lenPrefix);
+		if (w < lenPrefix) return w;
+	}
+	return w + this->out_parent->try_write(buffer + w, len - w);
+}
+
+void output_rff_crypt::seekp(stream::delta off, stream::seek_from from)
+{
+	this->out_parent->seekp(off, from);
+	return;
+}
+
+stream::pos output_rff_crypt::tellp() const
+{
+	return this->out_parent->tellp();
+}
+
+void output_rff_crypt::truncate(stream::pos size)
+{
+	this->out_parent->truncate(size);
+	if (this->resize) this->resize(size);
+	return;
+}
+
+void output_rff_crypt::flush()
+{
+	this->out_parent->flush();
+	return;
+}
+
+void rff_crypt::open(stream::inout_sptr parent, stream::fn_truncate resize)
+{
+	this->input_rff_crypt::open(parent);
+	this->output_rff_crypt::open(parent, resize);
+	return;
+}
+
 
 RFFFilterType::RFFFilterType()
 {
@@ -66,29 +181,25 @@ std::vector<std::string> RFFFilterType::getGameList() const
 stream::inout_sptr RFFFilterType::apply(stream::inout_sptr target,
 	stream::fn_truncate resize) const
 {
-	stream::filtered_sptr st(new stream::filtered());
-	// We need two separate filters, otherwise reading from one will
-	// affect the XOR key next used when writing to the other.
-	filter_sptr de(new filter_rff_crypt(RFF_FILE_CRYPT_LEN, 0));
-	filter_sptr en(new filter_rff_crypt(RFF_FILE_CRYPT_LEN, 0));
-	st->open(target, de, en, resize);
+	// Only the first few bytes are encrypted, so the file doesn't need to be
+	// loaded into memory and filtered as a whole.
+	rff_crypt_sptr st(new rff_crypt());
+	st->open(target, resize);
 	return st;
 }
 
 stream::input_sptr RFFFilterType::apply(stream::input_sptr target) const
 {
-	stream::input_filtered_sptr st(new stream::input_filtered());
-	filter_sptr de(new filter_rff_crypt(RFF_FILE_CRYPT_LEN, 0));
-	st->open(target, de);
+	input_rff_crypt_sptr st(new input_rff_crypt());
+	st->open(target);
 	return st;
 }
 
 stream::output_sptr RFFFilterType::apply(stream::output_sptr target,
 	stream::fn_truncate resize) const
 {
-	stream::output_filtered_sptr st(new stream::output_filtered());
-	filter_sptr en(new filter_rff_crypt(RFF_FILE_CRYPT_LEN, 0));
-	st->open(target, en, resize);
+	output_rff_crypt_sptr st(new output_rff_crypt());
+	st->open(target, resize);
 	return st;
 }
 
@@ -40,6 +40,84 @@ class filter_rff_crypt: public filter_xor_crypt
 		virtual uint8_t getKey();
 };
 
+/// Read a Blood RFF file, decrypting it on the way.
+/**
+ * Only the first 256 bytes of an encrypted RFF file are actually encrypted,
+ * so rather than pull the whole file through a filter the way
+ * stream::input_filtered does, reads go straight to the parent stream and
+ * only the part of each read that falls within those first 256 bytes is
+ * decrypted, in place.  Seeking is passed through too, so the rest of the
+ * file can be read at the same speed as an unencrypted one.
+ */
+class input_rff_crypt: virtual public stream::input
+{
+	public:
+		/// Read from the given stream, which holds the encrypted data.
+		void open(stream::input_sptr parent);
+
+		virtual stream::len try_read(uint8_t *buffer, stream::len len);
+		virtual void seekg(stream::delta off, stream::seek_from from);
+		virtual stream::pos tellg() const;
+		virtual stream::len size() const;
+
+	protected:
+		stream::input_sptr in_parent; ///< Stream holding the encrypted data
+};
+
+/// Write a Blood RFF file, encrypting it on the way.
+/**
+ * Only the part of each write landing in the first 256 bytes of the file is
+ * copied and encrypted, anything after that is passed straight through to
+ * the parent stream.
+ */
+class output_rff_crypt: virtual public stream::output
+{
+	public:
+		/// Write to the given stream.
+		/**
+		 * @param parent
+		 *   Stream to write the encrypted data to.
+		 *
+		 * @param resize
+		 *   Called after parent has been truncated, with the same size, as the
+		 *   encrypted and decrypted data are always the same length.  May be
+		 *   NULL.
+		 */
+		void open(stream::output_sptr parent, stream::fn_truncate resize);
+
+		virtual stream::len try_write(const uint8_t *buffer, stream::len len);
+		virtual void seekp(stream::delta off, stream::seek_from from);
+		virtual stream::pos tellp() const;
+		virtual void truncate(stream::pos size);
+		virtual void flush();
+
+	protected:
+		stream::output_sptr out_parent; ///< Stream receiving the encrypted data
+		stream::fn_truncate resize;     ///< Notified of new sizes
+};
+
+/// Read and write a Blood RFF file, without buffering the whole file.
+class rff_crypt: virtual public stream::inout,
+	virtual public input_rff_crypt,
+	virtual public output_rff_crypt
+{
+	public:
+		/// Access the given stream.
+		/**
+		 * @see output_rff_crypt::open()
+		 */
+		void open(stream::inout_sptr parent, stream::fn_truncate resize);
+};
+
+/// Shared pointer to an input_rff_crypt.
+typedef boost::shared_ptr<input_rff_crypt> input_rff_crypt_sptr;
+
+/// Shared pointer to an output_rff_crypt.
+typedef boost::shared_ptr<output_rff_crypt> output_rff_crypt_sptr;
+
+/// Shared pointer to an rff_crypt.
+typedef boost::shared_ptr<rff_crypt> rff_crypt_sptr;
+
 class RFFFilterType: virtual public FilterType
 {
 	public:
@@ -85,6 +85,12 @@ void filter_xor_crypt::setSeed(int val)
 	return;
 }
 
+void filter_xor_crypt::setOffset(int val)
+{
+	this->offset = val;
+	return;
+}
+
 uint8_t filter_xor_crypt::getKey()
 {
 	return (uint8_t)(this->seed + this->offset);
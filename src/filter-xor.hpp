@@ -65,6 +65,13 @@ class filter_xor_crypt: virtual public filter
 		/// Change the next XOR value
 		void setSeed(int val);
 
+		/// Continue as if this many bytes had already been processed.
+		/**
+		 * Call after reset() to crypt a block taken from the middle of a stream
+		 * without having to run the preceding data through the filter first.
+		 */
+		void setOffset(int val);
+
 		/// Get the next byte's seed value.
 		/**
 		 * This can be overridden by descendent classes to provide
@@ -23,6 +23,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <string.h> // memcpy
 #include <boost/bind.hpp>
 #include <camoto/stream_filtered.hpp>
 
@@ -173,80 +175,81 @@ filter_z66_compress::~filter_z66_compress()
 {
 }
 
-int filter_z66_compress::putChar(uint8_t **out, const stream::len *lenOut, stream::len *w, uint8_t in)
-{
-	if (*w < *lenOut) {
-		**out = in; // "write" byte
-		(*out)++;     // increment write buffer
-		(*w)++;      // increment write count
-		return 1;    // return number of bytes written
-	}
-	return 0; // EOF
-}
-
 void filter_z66_compress::reset(stream::len lenInput)
 {
-	this->outputLimit = lenInput;
-	this->state = 0;
+	this->filter_buffered_compress::reset(lenInput);
 	this->codeLength = 9;
 	this->curDicIndex = 0;
 	this->maxDicIndex = 255;
+	this->lookup.clear();
 
 	this->data.flushByte(); // drop any pending byte
 }
 
-void filter_z66_compress::transform(uint8_t *out, stream::len *lenOut,
-	const uint8_t *in, stream::len *lenIn)
+void filter_z66_compress::compress()
 {
-	stream::len r = 0, w = 0;
-
-	fn_putnextchar cbNext = boost::bind(&filter_z66_compress::putChar, this, &out, lenOut, &w, _1);
-
-	if (*lenIn == 0) {
-		// No more data to read, so flush
-		this->data.flushByte(cbNext);
+	// TESTED BY: z66_compress_suite
+	fn_putnextchar cbNext = boost::bind(appendByte, &this->output, _1);
+
+	// Decompressed size, so the decompressor knows when to stop
+	this->data.changeEndian(bitstream::littleEndian);
+	this->data.write(cbNext, 32, this->lenInput);
+	this->data.changeEndian(bitstream::bigEndian);
+
+	unsigned int len = this->input.size();
+	unsigned int pos = 0;
+	while (pos < len) {
+		// Follow the dictionary for as long as it matches, but stop in time to
+		// leave a byte to write after the code.
+		unsigned int code = this->input[pos++];
+		while (pos + 1 < len) {
+			DICT_LOOKUP::const_iterator i =
+				this->lookup.find((code << 8) | this->input[pos]);
+			if (i == this->lookup.end()) break;
+			code = 256 + i->second;
+			pos++;
+		}
+		this->data.write(cbNext, this->codeLength, code);
+
+		// If the data ended with the code there's nothing to follow it
+		if (pos == len) break;
+
+		uint8_t value = this->input[pos++];
+		this->data.write(cbNext, 8, value);
+		this->addEntry(code, value);
 	}
+	this->data.flushByte(cbNext);
 
-	while (
-		(w + 2 < *lenOut)  // while there is more space to write into
-		&& (r < *lenIn) // and there's at least one more byte to read
-	) {
-		switch (this->state) {
-			case 0:
-				// Read the first four bytes (decompressed size) so we can limit the
-				// output size appropriately.
-				this->data.changeEndian(bitstream::littleEndian);
-				this->data.write(cbNext, 32, this->outputLimit);
-				this->data.changeEndian(bitstream::bigEndian);
-				this->state++;
-				break;
-			case 1:
-				this->data.write(cbNext, this->codeLength, *in++);
-				r++;
-				this->state++;
-				break;
-			case 2:
-				this->data.write(cbNext, 8, *in++);
-				r++;
+	this->lookup.clear();
+	return;
+}
 
-				this->curDicIndex++;
-				if (this->curDicIndex >= this->maxDicIndex) {
-					this->codeLength++;
-					if (this->codeLength == 13) {
-						this->codeLength = 9;
-						this->curDicIndex = 64;
-						this->maxDicIndex = 255;
-					} else {
-						this->maxDicIndex = (1 << this->codeLength) - 257;
-					}
+void filter_z66_compress::addEntry(unsigned int code, uint8_t value)
+{
+	unsigned int key = (code << 8) | value;
+	this->entryKeys[this->curDicIndex] = key;
+	this->lookup[key] = this->curDicIndex;
+	this->curDicIndex++;
+
+	if (this->curDicIndex >= this->maxDicIndex) {
+		this->codeLength++;
+		if (this->codeLength == 13) {
+			// Only the first 64 entries survive the dictionary being reset.  The
+			// rest will be overwritten, and may refer to entries that have been
+			// overwritten already, so they can't be used again.
+			for (int i = 64; i < this->curDicIndex; i++) {
+				DICT_LOOKUP::iterator l = this->lookup.find(this->entryKeys[i]);
+				if ((l != this->lookup.end()) && ((int)l->second == i)) {
+					this->lookup.erase(l);
 				}
-				this->state = 1;
-				break;
-		} // switch(state)
-	} // while (more data to be read)
-
-	*lenIn = r;
-	*lenOut = w;
+			}
+			this->codeLength = 9;
+			this->curDicIndex = 64;
+			this->maxDicIndex = 255;
+		} else {
+			this->maxDicIndex = (1 << this->codeLength) - 257;
+		}
+	}
 	return;
 }
 
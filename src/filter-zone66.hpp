@@ -22,9 +22,12 @@
 #define _CAMOTO_FILTER_ZONE66_HPP_
 
 #include <stack>
+#include <vector>
+#include <boost/unordered_map.hpp>
 #include <camoto/stream.hpp>
 #include <camoto/bitstream.hpp>
 #include <camoto/gamearchive/filtertype.hpp>
+#include "filter-buffered.hpp"
 
 namespace camoto {
 namespace gamearchive {
@@ -62,29 +65,43 @@ class filter_z66_decompress: virtual public filter
 
 /// Zone 66 compression filter
 /**
- * This is a "fake" compression filter, in that it does not actually compress
- * the data, it just writes it out in such a way that when the game tries to
- * decompress it, it will recover the original data.  This also means the
- * "compressed" data will always be larger than the original data.
+ * Builds up the same dictionary as filter_z66_decompress while compressing,
+ * so each code written can stand for the longest string already in the
+ * dictionary.  Strings are found by looking up each (code, next byte) pair in
+ * a hash table, so compression takes time proportional to the input size.
  */
-class filter_z66_compress: virtual public filter
+class filter_z66_compress: virtual public filter_buffered_compress
 {
 	public:
 		filter_z66_compress();
 		virtual ~filter_z66_compress();
 
-		int putChar(uint8_t **out, const stream::len *lenOut, stream::len *w,
-			uint8_t in);
-
 		virtual void reset(stream::len lenInput);
-		virtual void transform(uint8_t *out, stream::len *lenOut,
-			const uint8_t *in, stream::len *lenIn);
 
 	protected:
 		bitstream data;
-		int state;
 		int codeLength, curDicIndex, maxDicIndex;
-		unsigned int outputLimit;  ///< Maximum number of bytes to write out overall
+
+		/// Dictionary index keyed by the code and byte making up each entry.
+		typedef boost::unordered_map<unsigned int, unsigned int> DICT_LOOKUP;
+
+		/// Every dictionary entry in use, for finding the next code to write.
+		DICT_LOOKUP lookup;
+
+		/// The key in lookup for each dictionary entry.
+		unsigned int entryKeys[4096];
+
+		virtual void compress();
+
+		/// Add a new dictionary entry, the same way the decompressor does.
+		/**
+		 * @param code
+		 *   Code just written.
+		 *
+		 * @param value
+		 *   Byte written after it.
+		 */
+		void addEntry(unsigned int code, uint8_t value);
 };
 
 /// Zone 66 compression handler
@@ -140,7 +140,7 @@ BNKArchive::BNKArchive(stream::inout_sptr psArchive, stream::inout_sptr psFAT)
 	this->psFAT->seekg(0, stream::start);
 
 	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		uint8_t lenName;
@@ -132,6 +132,13 @@ ArchivePtr DAT_BashType::open(stream::inout_sptr psArchive, SuppData& suppData)
 	return ArchivePtr(new DAT_BashArchive(psArchive));
 }
 
+ArchivePtr DAT_BashType::openIndexed(stream::inout_sptr psArchive,
+	SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const
+{
+	// TESTED BY: fmt_dat_bash_open_indexed
+	return ArchivePtr(new DAT_BashArchive(psArchive, index, stamp));
+}
+
 SuppFilenames DAT_BashType::getRequiredSupps(stream::input_sptr data,
 	const std::string& filenameArchive) const
 {
@@ -140,18 +147,22 @@ SuppFilenames DAT_BashType::getRequiredSupps(stream::input_sptr data,
 }
 
 
-DAT_BashArchive::DAT_BashArchive(stream::inout_sptr psArchive)
+DAT_BashArchive::DAT_BashArchive(stream::inout_sptr psArchive,
+	stream::inout_sptr index, uint64_t stamp)
 	:	FATArchive(psArchive, DAT_FIRST_FILE_OFFSET, DAT_MAX_FILENAME_LEN)
 {
 	stream::pos lenArchive = this->psArchive->size();
 
+	// A valid sidecar index saves reading the header in front of each file
+	if (this->loadIndex(index, stamp)) return;
+
 	this->psArchive->seekg(0, stream::start);
 
 	stream::pos pos = 0;
 	uint16_t type;
 	int numFiles = 0;
 	while (pos < lenArchive) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = numFiles;
@@ -246,6 +257,7 @@ DAT_BashArchive::DAT_BashArchive(stream::inout_sptr psArchive)
 		numFiles++;
 	}
 
+	this->saveIndex();
 }
 
 DAT_BashArchive::~DAT_BashArchive()
@@ -413,9 +425,11 @@ void DAT_BashArchive::postInsertFile(FATEntry *pNewEntry)
 	else if (boost::iequals(ext, ".spr")) typeNum = 64;
 	else typeNum = 32;
 
+	// Custom file, chop off extension.  The entry keeps it, as it would if the
+	// archive was opened again.
+	std::string strNativeName = pNewEntry->strName;
 	if ((typeNum != 32) && (typeNum != 8)) {
-		// Custom file, chop off extension
-		pNewEntry->strName = pNewEntry->strName.substr(0, newLen - 4);
+		strNativeName = pNewEntry->strName.substr(0, newLen - 4);
 	}
 
 	uint16_t expandedSize;
@@ -429,7 +443,7 @@ void DAT_BashArchive::postInsertFile(FATEntry *pNewEntry)
 	this->psArchive
 		<< u16le(typeNum)
 		<< u16le(pNewEntry->storedSize)
-		<< nullPadded(pNewEntry->strName, DAT_FILENAME_FIELD_LEN)
+		<< nullPadded(strNativeName, DAT_FILENAME_FIELD_LEN)
 		<< u16le(expandedSize)
 	;
 	return;
@@ -49,6 +49,8 @@ class DAT_BashType: virtual public ArchiveType {
 		virtual ArchivePtr newArchive(stream::inout_sptr psArchive, SuppData& suppData) const;
 
 		virtual ArchivePtr open(stream::inout_sptr fsArchive, SuppData& suppData) const;
+		virtual ArchivePtr openIndexed(stream::inout_sptr psArchive,
+			SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const;
 
 		virtual SuppFilenames getRequiredSupps(stream::input_sptr data,
 			const std::string& filenameArchive) const;
@@ -57,7 +59,8 @@ class DAT_BashType: virtual public ArchiveType {
 
 class DAT_BashArchive: virtual public FATArchive {
 	public:
-		DAT_BashArchive(stream::inout_sptr psArchive);
+		DAT_BashArchive(stream::inout_sptr psArchive,
+			stream::inout_sptr index = stream::inout_sptr(), uint64_t stamp = 0);
 
 		virtual ~DAT_BashArchive();
 
@@ -175,9 +175,11 @@ DAT_GoTArchive::DAT_GoTArchive(stream::inout_sptr psArchive)
 		fatSubStream(new stream::sub()),
 		fatStream(new stream::seg())
 {
-	// Create a substream to decrypt the FAT
+	// Create a substream to decrypt the FAT.  This goes through the FATArchive
+	// segmented stream rather than the raw parent, so FAT changes are held back
+	// with everything else until flush() and land in any flushTo() target.
 	this->fatSubStream->open(
-		psArchive,
+		this->psArchive,
 		0,
 		GOT_MAX_FILES * GOT_FAT_ENTRY_LEN,
 		boost::bind<void>(&DAT_GoTArchive::truncateFAT, this, _1)
@@ -199,7 +201,7 @@ DAT_GoTArchive::DAT_GoTArchive(stream::inout_sptr psArchive)
 	this->vcFAT.reserve(256);
 
 	for (int i = 0; i < GOT_MAX_FILES; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		uint16_t flags;
@@ -234,6 +236,8 @@ DAT_GoTArchive::~DAT_GoTArchive()
 
 void DAT_GoTArchive::flush()
 {
+	// The FAT goes out first, so it needs the final file sizes and offsets now
+	this->prepareFlush();
 	this->fatStream->flush();
 
 	// Commit this->psArchive
@@ -306,6 +310,7 @@ FATArchive::FATEntry *DAT_GoTArchive::preInsertFile(const FATEntry *idBeforeThis
 		unsigned int indexLast = GOT_MAX_FILES - 1;
 		for (VC_ENTRYPTR::reverse_iterator i = this->vcFAT.rbegin(); i != this->vcFAT.rend(); i++) {
 			FATEntry *pFAT = dynamic_cast<FATEntry *>(i->get());
+			this->resolveEntry(pFAT);
 			if (pFAT->iIndex != indexLast) {
 				// The previous slot is free, so delete it
 				this->fatStream->seekp(indexLast * GOT_FAT_ENTRY_LEN, stream::start);
@@ -356,6 +361,7 @@ void DAT_GoTArchive::preRemoveFile(const FATEntry *pid)
 
 	// Add an empty FAT entry onto the end to keep the FAT the same size
 	const FATEntry *pFAT = dynamic_cast<const FATEntry *>(this->vcFAT.back().get());
+	this->resolveEntry(pFAT);
 	this->fatStream->seekp((pFAT->iIndex + 1) * GOT_FAT_ENTRY_LEN, stream::start);
 	this->fatStream->insert(GOT_FAT_ENTRY_LEN);
 
@@ -139,6 +139,13 @@ ArchivePtr DAT_HighwayType::open(stream::inout_sptr psArchive, SuppData& suppDat
 	return ArchivePtr(new DAT_HighwayArchive(psArchive));
 }
 
+ArchivePtr DAT_HighwayType::openIndexed(stream::inout_sptr psArchive,
+	SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const
+{
+	// TESTED BY: fmt_dat_highway_open_indexed
+	return ArchivePtr(new DAT_HighwayArchive(psArchive, index, stamp));
+}
+
 SuppFilenames DAT_HighwayType::getRequiredSupps(stream::input_sptr data,
 	const std::string& filenameArchive) const
 {
@@ -147,18 +154,23 @@ SuppFilenames DAT_HighwayType::getRequiredSupps(stream::input_sptr data,
 }
 
 
-DAT_HighwayArchive::DAT_HighwayArchive(stream::inout_sptr psArchive)
+DAT_HighwayArchive::DAT_HighwayArchive(stream::inout_sptr psArchive,
+	stream::inout_sptr index, uint64_t stamp)
 	:	FATArchive(psArchive, DATHH_FIRST_FILE_OFFSET, DATHH_MAX_FILENAME_LEN)
 {
 	uint16_t lenFAT;
 	this->psArchive->seekg(DATHH_FATLEN_OFFSET, stream::start);
 	this->psArchive >> u16le(lenFAT);
 
+	// Each file's size lives in front of its data, so reading them all means
+	// a seek per file unless the sidecar index can be used instead
+	if (this->loadIndex(index, stamp)) return;
+
 	unsigned int numFiles = (lenFAT / DATHH_FAT_ENTRY_LEN) - 1;
 	FATEntry *lastFATEntry = NULL;
 	for (unsigned int i = 0; i < numFiles; i++) {
 		this->psArchive->seekg(DATHH_HEADER_LEN + i * DATHH_FAT_ENTRY_LEN, stream::start);
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
@@ -177,7 +189,7 @@ DAT_HighwayArchive::DAT_HighwayArchive(stream::inout_sptr psArchive)
 		if (lastFATEntry) {
 			lastFATEntry->storedSize = fatEntry->iOffset - lastFATEntry->iOffset - DATHH_EFAT_ENTRY_LEN;
 		}
-		lastFATEntry = fatEntry;
+		lastFATEntry = fatEntry.get();
 
 		this->vcFAT.push_back(ep);
 	}
@@ -185,6 +197,8 @@ DAT_HighwayArchive::DAT_HighwayArchive(stream::inout_sptr psArchive)
 		stream::pos lenArchive = this->psArchive->size();
 		lastFATEntry->storedSize = lenArchive - lastFATEntry->iOffset - DATHH_EFAT_ENTRY_LEN;
 	}
+
+	this->saveIndex();
 }
 
 DAT_HighwayArchive::~DAT_HighwayArchive()
@@ -139,7 +139,7 @@ DAT_HocusArchive::DAT_HocusArchive(stream::inout_sptr psArchive, stream::inout_s
 	this->psFAT->seekg(0, stream::start);
 
 	for (unsigned int i = 0; i < this->maxFiles; i++) {
-		FATEntry *pEntry = new FATEntry();
+		FATEntryPtr pEntry = FATArchive::newFATEntry();
 		pEntry->iIndex = i;
 		this->psFAT
 			>> u32le(pEntry->iOffset)
@@ -150,7 +150,7 @@ DAT_HocusArchive::DAT_HocusArchive(stream::inout_sptr psArchive, stream::inout_s
 		pEntry->fAttr = 0;
 		pEntry->bValid = true;
 		pEntry->realSize = pEntry->storedSize;
-		this->vcFAT.push_back(EntryPtr(pEntry));
+		this->vcFAT.push_back(pEntry);
 
 		if (pEntry->iOffset + pEntry->storedSize > lenArchive) {
 			std::cerr << "DAT file has been truncated, file @" << i
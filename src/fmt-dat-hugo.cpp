@@ -192,8 +192,8 @@ DAT_HugoArchive::DAT_HugoArchive(stream::inout_sptr psArchive, stream::inout_spt
 		int firstIndexInSecondArch = 0;
 		fatStream->seekg(0, stream::start);
 		for (unsigned int i = 0; i < numFiles; i++) {
-			DAT_HugoEntry *fatEntry = new DAT_HugoEntry();
-			EntryPtr ep(fatEntry);
+			boost::shared_ptr<DAT_HugoEntry> ep = FATArchive::allocEntry<DAT_HugoEntry>();
+			DAT_HugoEntry *fatEntry = ep.get();
 
 			// Read the data in from the FAT entry in the file
 			fatStream
@@ -318,9 +318,9 @@ void DAT_HugoArchive::preRemoveFile(const FATEntry *pid)
 	return;
 }
 
-FATArchive::FATEntry *DAT_HugoArchive::createNewFATEntry()
+FATArchive::FATEntryPtr DAT_HugoArchive::createNewFATEntry()
 {
-	return new DAT_HugoEntry();
+	return FATArchive::allocEntry<DAT_HugoEntry>();
 }
 
 } // namespace gamearchive
@@ -66,7 +66,7 @@ class DAT_HugoArchive: virtual public FATArchive
 		virtual FATEntry *preInsertFile(const FATEntry *idBeforeThis,
 			FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
-		virtual FATEntry *createNewFATEntry();
+		virtual FATEntryPtr createNewFATEntry();
 };
 
 } // namespace gamearchive
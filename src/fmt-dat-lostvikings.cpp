@@ -153,7 +153,7 @@ DAT_LostVikingsArchive::DAT_LostVikingsArchive(stream::inout_sptr psArchive)
 		uint32_t numFiles = offNext / DAT_FAT_ENTRY_LEN;
 		this->vcFAT.reserve(numFiles);
 		for (unsigned int i = 0; i < numFiles; i++) {
-			FATEntry *fatEntry = new FATEntry();
+			FATEntryPtr fatEntry = FATArchive::newFATEntry();
 			EntryPtr ep(fatEntry);
 
 			fatEntry->iOffset = offNext;
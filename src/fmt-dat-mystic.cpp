@@ -157,7 +157,7 @@ DAT_MysticArchive::DAT_MysticArchive(stream::inout_sptr psArchive)
 
 	this->psArchive->seekg(DAT_FILECOUNT_OFFSET_END - fileCount * DAT_FAT_ENTRY_LEN, stream::end);
 	for (unsigned int i = 0; i < fileCount; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
@@ -194,6 +194,7 @@ void DAT_MysticArchive::updateFileName(const FATEntry *pid, const std::string& s
 {
 	// TESTED BY: fmt_dat_mystic_rename
 	assert(strNewName.length() <= DAT_MAX_FILENAME_LEN);
+	if (this->deferFAT) return;
 	this->psArchive->seekp(DAT_FILENAME_OFFSET_END(pid), stream::end);
 	this->psArchive
 		<< u8(strNewName.length())
@@ -206,6 +207,7 @@ void DAT_MysticArchive::updateFileOffset(const FATEntry *pid, stream::delta offD
 {
 	// TESTED BY: fmt_dat_mystic_insert*
 	// TESTED BY: fmt_dat_mystic_resize*
+	if (this->deferFAT) return;
 	this->psArchive->seekp(DAT_FILEOFFSET_OFFSET_END(pid), stream::end);
 	this->psArchive << u32le(pid->iOffset);
 	return;
@@ -215,6 +217,7 @@ void DAT_MysticArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDe
 {
 	// TESTED BY: fmt_dat_mystic_insert*
 	// TESTED BY: fmt_dat_mystic_resize*
+	if (this->deferFAT) return;
 	this->psArchive->seekp(DAT_FILESIZE_OFFSET_END(pid), stream::end);
 	this->psArchive << u32le(pid->storedSize);
 	return;
@@ -230,6 +233,9 @@ FATArchive::FATEntry *DAT_MysticArchive::preInsertFile(const FATEntry *idBeforeT
 	// Prepare filename field
 	boost::to_upper(pNewEntry->strName);
 
+	// The whole FAT is written at once later on if it's been held back
+	if (this->deferFAT) return pNewEntry;
+
 	// Add the new entry into the on-disk FAT.  This has to happen here (rather
 	// than in postInsertFile()) because on return FATArchive will update the
 	// offsets of all FAT entries following this one.  If we don't insert a new
@@ -249,6 +255,7 @@ FATArchive::FATEntry *DAT_MysticArchive::preInsertFile(const FATEntry *idBeforeT
 
 void DAT_MysticArchive::postInsertFile(FATEntry *pNewEntry)
 {
+	if (this->deferFAT) return;
 	this->uncommittedFiles--;
 	this->updateFileCount(this->vcFAT.size());
 	return;
@@ -256,6 +263,7 @@ void DAT_MysticArchive::postInsertFile(FATEntry *pNewEntry)
 
 void DAT_MysticArchive::preRemoveFile(const FATEntry *pid)
 {
+	if (this->deferFAT) return;
 	this->psArchive->seekp(DAT_FATENTRY_OFFSET_END(pid), stream::end);
 	this->psArchive->remove(DAT_FAT_ENTRY_LEN);
 	return;
@@ -263,10 +271,52 @@ void DAT_MysticArchive::preRemoveFile(const FATEntry *pid)
 
 void DAT_MysticArchive::postRemoveFile(const FATEntry *pid)
 {
+	if (this->deferFAT) return;
 	this->updateFileCount(this->vcFAT.size());
 	return;
 }
 
+bool DAT_MysticArchive::detachFAT()
+{
+	// TESTED BY: test_archive::test_deferred_fat
+
+	// The FAT and file count are always the last thing in the file, so
+	// dropping them leaves the end of the last file at EOF.
+	stream::len lenFAT = this->vcFAT.size() * DAT_FAT_ENTRY_LEN + 2;
+	this->psArchive->seekp(-(stream::delta)lenFAT, stream::end);
+	this->psArchive->remove(lenFAT);
+	return true;
+}
+
+void DAT_MysticArchive::attachFAT()
+{
+	// TESTED BY: test_archive::test_deferred_fat
+	const VC_FATENTRY& entries = this->getFATEntries();
+	std::vector<const FATEntry *> ordered(entries.size());
+	for (VC_FATENTRY::const_iterator i = entries.begin(); i != entries.end(); i++) {
+		this->resolveEntry(*i);
+		assert((*i)->iIndex < ordered.size());
+		ordered[(*i)->iIndex] = *i;
+	}
+
+	stream::len lenFAT = ordered.size() * DAT_FAT_ENTRY_LEN + 2; // + file count
+	this->psArchive->seekp(0, stream::end);
+	this->psArchive->insert(lenFAT);
+	for (std::vector<const FATEntry *>::const_iterator i = ordered.begin();
+		i != ordered.end();
+		i++
+	) {
+		this->psArchive
+			<< u8((*i)->strName.length())
+			<< nullPadded((*i)->strName, DAT_FILENAME_FIELD_LEN)
+			<< u32le((*i)->iOffset)
+			<< u32le((*i)->storedSize)
+		;
+	}
+	this->psArchive << u16le(ordered.size());
+	return;
+}
+
 void DAT_MysticArchive::updateFileCount(uint32_t newCount)
 {
 	this->psArchive->seekp(DAT_FILECOUNT_OFFSET_END, stream::end);
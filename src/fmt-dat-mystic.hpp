@@ -64,6 +64,8 @@ class DAT_MysticArchive: virtual public FATArchive
 		virtual void postInsertFile(FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
 		virtual void postRemoveFile(const FATEntry *pid);
+		virtual bool detachFAT();
+		virtual void attachFAT();
 
 	protected:
 		void updateFileCount(uint32_t newCount);
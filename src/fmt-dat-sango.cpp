@@ -135,7 +135,7 @@ DAT_SangoArchive::DAT_SangoArchive(stream::inout_sptr psArchive)
 	for (int i = 0; offCur < this->lenArchive; i++) {
 		psArchive >> u32le(offNext);
 
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
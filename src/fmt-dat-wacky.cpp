@@ -25,6 +25,7 @@
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "fatschema.hpp"
 #include "fmt-dat-wacky.hpp"
 
 #define DAT_FILECOUNT_OFFSET     0
@@ -36,13 +37,14 @@
 
 #define DAT_FATENTRY_OFFSET(e)   (DAT_FAT_OFFSET + e->iIndex * DAT_FAT_ENTRY_LEN)
 
-#define DAT_FILENAME_OFFSET(e)    DAT_FATENTRY_OFFSET(e)
-#define DAT_FILESIZE_OFFSET(e)   (DAT_FATENTRY_OFFSET(e) + DAT_FILENAME_FIELD_LEN)
-#define DAT_FILEOFFSET_OFFSET(e) (DAT_FATENTRY_OFFSET(e) + DAT_FILENAME_FIELD_LEN + 4)
-
 namespace camoto {
 namespace gamearchive {
 
+// Fields within each FAT record
+typedef FATFieldString<0, DAT_FILENAME_FIELD_LEN> DATWackyFieldName;
+typedef FATFieldInt   <DAT_FILENAME_FIELD_LEN, 4> DATWackyFieldSize;
+typedef FATFieldInt   <DAT_FILENAME_FIELD_LEN + 4, 4> DATWackyFieldOffset;
+
 DAT_WackyType::DAT_WackyType()
 {
 }
@@ -156,9 +158,14 @@ DAT_WackyArchive::DAT_WackyArchive(stream::inout_sptr psArchive)
 	this->psArchive >> u16le(numFiles);
 	this->vcFAT.reserve(numFiles);
 
+	std::vector<uint8_t> fat;
+	readFATRecords(this->psArchive, DAT_FAT_OFFSET, numFiles, DAT_FAT_ENTRY_LEN,
+		&fat);
+
 	for (int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
+		const uint8_t *record = &fat[i * DAT_FAT_ENTRY_LEN];
 
 		fatEntry->iIndex = i;
 		fatEntry->lenHeader = 0;
@@ -166,11 +173,9 @@ DAT_WackyArchive::DAT_WackyArchive(stream::inout_sptr psArchive)
 		fatEntry->fAttr = 0;
 		fatEntry->bValid = true;
 
-		// Read the data in from the FAT entry in the file
-		this->psArchive
-			>> nullPadded(fatEntry->strName, DAT_FILENAME_FIELD_LEN)
-			>> u32le(fatEntry->storedSize)
-			>> u32le(fatEntry->iOffset);
+		fatEntry->strName = DATWackyFieldName::get(record);
+		fatEntry->storedSize = DATWackyFieldSize::get(record);
+		fatEntry->iOffset = DATWackyFieldOffset::get(record);
 
 		// Offset doesn't include the two byte file count
 		fatEntry->iOffset += DAT_FAT_OFFSET;
@@ -189,8 +194,8 @@ void DAT_WackyArchive::updateFileName(const FATEntry *pid, const std::string& st
 {
 	// TESTED BY: fmt_dat_wacky_rename
 	assert(strNewName.length() <= DAT_MAX_FILENAME_LEN);
-	this->psArchive->seekp(DAT_FILENAME_OFFSET(pid), stream::start);
-	this->psArchive << nullPadded(strNewName, DAT_FILENAME_FIELD_LEN);
+	DATWackyFieldName::update(this->psArchive, DAT_FATENTRY_OFFSET(pid),
+		strNewName);
 	return;
 }
 
@@ -204,8 +209,8 @@ void DAT_WackyArchive::updateFileOffset(const FATEntry *pid,
 	// Offsets don't start from the beginning of the archive
 	uint32_t deltaOffset = pid->iOffset - DAT_FAT_OFFSET;
 
-	this->psArchive->seekp(DAT_FILEOFFSET_OFFSET(pid), stream::start);
-	this->psArchive << u32le(deltaOffset);
+	DATWackyFieldOffset::update(this->psArchive, DAT_FATENTRY_OFFSET(pid),
+		deltaOffset);
 	return;
 }
 
@@ -215,8 +220,8 @@ void DAT_WackyArchive::updateFileSize(const FATEntry *pid,
 {
 	// TESTED BY: fmt_dat_wacky_insert*
 	// TESTED BY: fmt_dat_wacky_resize*
-	this->psArchive->seekp(DAT_FILESIZE_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->storedSize);
+	DATWackyFieldSize::update(this->psArchive, DAT_FATENTRY_OFFSET(pid),
+		pid->storedSize);
 	return;
 }
 
@@ -280,6 +285,21 @@ void DAT_WackyArchive::preRemoveFile(const FATEntry *pid)
 	return;
 }
 
+bool DAT_WackyArchive::canBeSparse() const
+{
+	// Offsets are stored explicitly (relative to the FAT) so files can be
+	// anywhere after it
+	return true;
+}
+
+bool DAT_WackyArchive::moveFATEntry(const FATEntry *pid, unsigned int newIndex)
+{
+	// TESTED BY: fmt_dat_wacky_move
+	FATArchive::moveRecord(this->psArchive, DAT_FAT_OFFSET, DAT_FAT_ENTRY_LEN,
+		pid->iIndex, newIndex);
+	return true;
+}
+
 void DAT_WackyArchive::updateFileCount(uint32_t iNewCount)
 {
 	// TESTED BY: fmt_dat_wacky_insert*
@@ -60,6 +60,8 @@ class DAT_WackyArchive: virtual public FATArchive
 		virtual FATEntry *preInsertFile(const FATEntry *idBeforeThis,
 			FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
+		virtual bool canBeSparse() const;
+		virtual bool moveFATEntry(const FATEntry *pid, unsigned int newIndex);
 
 	private:
 		void updateFileCount(uint32_t iNewCount);
@@ -21,10 +21,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h> // memcpy
 #include <boost/algorithm/string.hpp>
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "fatschema.hpp"
 #include "fmt-dlt-stargunner.hpp"
 
 #define DLT_FILECOUNT_OFFSET    6
@@ -41,11 +43,14 @@
 #define DLT_FATENTRY_OFFSET(e) (e->iOffset)
 
 #define DLT_FILENAME_OFFSET(e) DLT_FATENTRY_OFFSET(e)
-#define DLT_FILESIZE_OFFSET(e) (DLT_FATENTRY_OFFSET(e) + DLT_FILENAME_FIELD_LEN + 4)
 
 namespace camoto {
 namespace gamearchive {
 
+// Fields within the header in front of each file.  The filename is encrypted
+// so it is handled separately.
+typedef FATFieldInt<DLT_FILENAME_FIELD_LEN + 4, 4> DLTFieldSize;
+
 DLTType::DLTType()
 {
 }
@@ -108,6 +113,13 @@ ArchivePtr DLTType::open(stream::inout_sptr psArchive, SuppData& suppData) const
 	return ArchivePtr(new DLTArchive(psArchive));
 }
 
+ArchivePtr DLTType::openIndexed(stream::inout_sptr psArchive,
+	SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const
+{
+	// TESTED BY: fmt_dlt_stargunner_open_indexed
+	return ArchivePtr(new DLTArchive(psArchive, index, stamp));
+}
+
 SuppFilenames DLTType::getRequiredSupps(stream::input_sptr data,
 	const std::string& filenameArchive) const
 {
@@ -116,7 +128,8 @@ SuppFilenames DLTType::getRequiredSupps(stream::input_sptr data,
 }
 
 
-DLTArchive::DLTArchive(stream::inout_sptr psArchive)
+DLTArchive::DLTArchive(stream::inout_sptr psArchive,
+	stream::inout_sptr index, uint64_t stamp)
 	:	FATArchive(psArchive, DLT_FIRST_FILE_OFFSET, DLT_MAX_FILENAME_LEN)
 {
 	this->psArchive->seekg(4, stream::start); // skip "DAVE" sig
@@ -136,9 +149,13 @@ DLTArchive::DLTArchive(stream::inout_sptr psArchive)
 		throw stream::error("too many files or corrupted archive");
 	}
 
+	// Every file carries its own header, so avoid visiting them all if the
+	// sidecar index still matches
+	if (this->loadIndex(index, stamp)) return;
+
 	stream::pos offNext = DLT_HEADER_LEN;
 	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
@@ -148,15 +165,13 @@ DLTArchive::DLTArchive(stream::inout_sptr psArchive)
 		fatEntry->fAttr = 0;
 		fatEntry->bValid = true;
 
-		uint32_t unk;
+		// Read the whole embedded FAT entry in one go
+		uint8_t record[DLT_EFAT_ENTRY_LEN];
+		this->psArchive->read(record, DLT_EFAT_ENTRY_LEN);
+		fatEntry->storedSize = DLTFieldSize::get(record);
 
-		// Read the data in from the FAT entry in the file
 		uint8_t name[DLT_FILENAME_FIELD_LEN + 1];
-		this->psArchive->read(name, DLT_FILENAME_FIELD_LEN);
-		this->psArchive
-			>> u32le(unk)
-			>> u32le(fatEntry->storedSize)
-		;
+		memcpy(name, record, DLT_FILENAME_FIELD_LEN);
 
 		// Decrypt the filename
 		for (int i = 1; i < DLT_FILENAME_FIELD_LEN; i++) name[i] ^= name[i - 1] + i;
@@ -168,6 +183,8 @@ DLTArchive::DLTArchive(stream::inout_sptr psArchive)
 		offNext += fatEntry->storedSize + DLT_EFAT_ENTRY_LEN;
 		this->psArchive->seekg(fatEntry->storedSize, stream::cur);
 	}
+
+	this->saveIndex();
 }
 
 DLTArchive::~DLTArchive()
@@ -206,8 +223,8 @@ void DLTArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 {
 	// TESTED BY: fmt_dlt_stargunner_insert*
 	// TESTED BY: fmt_dlt_stargunner_resize*
-	this->psArchive->seekp(DLT_FILESIZE_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->storedSize);
+	DLTFieldSize::update(this->psArchive, DLT_FATENTRY_OFFSET(pid),
+		pid->storedSize);
 	return;
 }
 
@@ -26,6 +26,7 @@
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "fatschema.hpp"
 #include "fmt-epf-lionking.hpp"
 
 #define EPF_HEADER_LEN               11
@@ -46,6 +47,12 @@
 namespace camoto {
 namespace gamearchive {
 
+// Fields within each FAT record
+typedef FATFieldString<EPF_FAT_FILENAME_OFFSET, EPF_FILENAME_FIELD_LEN> EPFFieldName;
+typedef FATFieldInt   <EPF_FAT_ISCOMPRESSED_OFFSET, 1> EPFFieldFlags;
+typedef FATFieldInt   <EPF_FAT_FILESIZE_OFFSET, 4> EPFFieldSize;
+typedef FATFieldInt   <EPF_FAT_DECOMP_SIZE_OFFSET, 4> EPFFieldRealSize;
+
 EPFType::EPFType()
 {
 }
@@ -162,13 +169,16 @@ EPFArchive::EPFArchive(stream::inout_sptr psArchive)
 	) {
 		throw stream::error("header corrupted or file truncated");
 	}
-	this->psArchive->seekg(this->offFAT, stream::start);
+
+	std::vector<uint8_t> fat;
+	readFATRecords(this->psArchive, this->offFAT, numFiles, EPF_FAT_ENTRY_LEN,
+		&fat);
 
 	stream::pos offNext = EPF_FIRST_FILE_OFFSET;
-	uint8_t flags;
 	for (int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
+		const uint8_t *record = &fat[i * EPF_FAT_ENTRY_LEN];
 
 		fatEntry->iIndex = i;
 		fatEntry->iOffset = offNext;
@@ -177,14 +187,11 @@ EPFArchive::EPFArchive(stream::inout_sptr psArchive)
 		fatEntry->fAttr = 0;
 		fatEntry->bValid = true;
 
-		// Read the data in from the FAT entry in the file
-		this->psArchive
-			>> nullPadded(fatEntry->strName, EPF_FILENAME_FIELD_LEN)
-			>> u8(flags)
-			>> u32le(fatEntry->storedSize)
-			>> u32le(fatEntry->realSize);
+		fatEntry->strName = EPFFieldName::get(record);
+		fatEntry->storedSize = EPFFieldSize::get(record);
+		fatEntry->realSize = EPFFieldRealSize::get(record);
 
-		if (flags & EPF_FAT_FLAG_COMPRESSED) {
+		if (EPFFieldFlags::get(record) & EPF_FAT_FLAG_COMPRESSED) {
 			fatEntry->fAttr |= EA_COMPRESSED;
 			fatEntry->filter = "lzw-epfs";
 		}
@@ -266,8 +273,9 @@ void EPFArchive::updateFileName(const FATEntry *pid, const std::string& strNewNa
 {
 	// TESTED BY: fmt_epf_lionking_rename
 	assert(strNewName.length() <= EPF_MAX_FILENAME_LEN);
-	this->psArchive->seekp(this->offFAT + pid->iIndex * EPF_FAT_ENTRY_LEN, stream::start);
-	this->psArchive << nullPadded(strNewName, EPF_FILENAME_FIELD_LEN);
+	if (this->deferFAT) return; // attachFAT() will write the new name
+	EPFFieldName::update(this->psArchive,
+		this->offFAT + pid->iIndex * EPF_FAT_ENTRY_LEN, strNewName);
 	return;
 }
 
@@ -281,11 +289,11 @@ void EPFArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 	// TESTED BY: fmt_epf_lionking_insert*
 	// TESTED BY: fmt_epf_lionking_resize*
 
-	this->psArchive->seekp(this->offFAT + pid->iIndex * EPF_FAT_ENTRY_LEN + EPF_FAT_FILESIZE_OFFSET, stream::start);
-	this->psArchive
-		<< u32le(pid->storedSize)
-		<< u32le(pid->realSize)
-	;
+	if (!this->deferFAT) {
+		stream::pos offRecord = this->offFAT + pid->iIndex * EPF_FAT_ENTRY_LEN;
+		EPFFieldSize::update(this->psArchive, offRecord, pid->storedSize);
+		EPFFieldRealSize::update(this->psArchive, offRecord, pid->realSize);
+	}
 
 	this->offFAT += sizeDelta;
 	this->updateFATOffset();
@@ -313,16 +321,18 @@ void EPFArchive::postInsertFile(FATEntry *pNewEntry)
 {
 	this->offFAT += pNewEntry->storedSize;
 
-	this->psArchive->seekp(this->offFAT + pNewEntry->iIndex * EPF_FAT_ENTRY_LEN, stream::start);
-	this->psArchive->insert(EPF_FAT_ENTRY_LEN);
 	boost::to_upper(pNewEntry->strName);
-	uint8_t flags = 0;
-	if (pNewEntry->fAttr & EA_COMPRESSED) flags = 1;
-	this->psArchive
-		<< nullPadded(pNewEntry->strName, EPF_FILENAME_FIELD_LEN)
-		<< u8(flags)  // 0 == uncompressed, 1 == compressed
-		<< u32le(pNewEntry->storedSize)  // compressed
-		<< u32le(pNewEntry->realSize); // decompressed
+	if (!this->deferFAT) {
+		this->psArchive->seekp(this->offFAT + pNewEntry->iIndex * EPF_FAT_ENTRY_LEN, stream::start);
+		this->psArchive->insert(EPF_FAT_ENTRY_LEN);
+		uint8_t flags = 0;
+		if (pNewEntry->fAttr & EA_COMPRESSED) flags = 1;
+		this->psArchive
+			<< nullPadded(pNewEntry->strName, EPF_FILENAME_FIELD_LEN)
+			<< u8(flags)  // 0 == uncompressed, 1 == compressed
+			<< u32le(pNewEntry->storedSize)  // compressed
+			<< u32le(pNewEntry->realSize); // decompressed
+	}
 
 	this->updateFATOffset();
 	this->updateFileCount(this->vcFAT.size());
@@ -334,8 +344,10 @@ void EPFArchive::preRemoveFile(const FATEntry *pid)
 {
 	// TESTED BY: fmt_epf_lionking_remove*
 
-	this->psArchive->seekp(this->offFAT + pid->iIndex * EPF_FAT_ENTRY_LEN, stream::start);
-	this->psArchive->remove(EPF_FAT_ENTRY_LEN);
+	if (!this->deferFAT) {
+		this->psArchive->seekp(this->offFAT + pid->iIndex * EPF_FAT_ENTRY_LEN, stream::start);
+		this->psArchive->remove(EPF_FAT_ENTRY_LEN);
+	}
 
 	this->offFAT -= pid->storedSize;
 	this->updateFATOffset();
@@ -344,6 +356,39 @@ void EPFArchive::preRemoveFile(const FATEntry *pid)
 	return;
 }
 
+bool EPFArchive::detachFAT()
+{
+	// TESTED BY: test_archive::test_deferred_fat
+	this->psArchive->seekp(this->offFAT, stream::start);
+	this->psArchive->remove(this->vcFAT.size() * EPF_FAT_ENTRY_LEN);
+	return true;
+}
+
+void EPFArchive::attachFAT()
+{
+	// TESTED BY: test_archive::test_deferred_fat
+
+	// Build the whole FAT in memory so it goes back in with a single write
+	const VC_FATENTRY& entries = this->getFATEntries();
+	std::vector<uint8_t> fat(entries.size() * EPF_FAT_ENTRY_LEN, 0);
+	for (VC_FATENTRY::const_iterator i = entries.begin(); i != entries.end(); i++) {
+		this->resolveEntry(*i);
+		assert((*i)->iIndex < entries.size());
+		uint8_t *record = &fat[(*i)->iIndex * EPF_FAT_ENTRY_LEN];
+		EPFFieldName::set(record, (*i)->strName);
+		EPFFieldFlags::set(record,
+			((*i)->fAttr & EA_COMPRESSED) ? EPF_FAT_FLAG_COMPRESSED : 0);
+		EPFFieldSize::set(record, (*i)->storedSize);
+		EPFFieldRealSize::set(record, (*i)->realSize);
+	}
+	if (fat.empty()) return;
+
+	this->psArchive->seekp(this->offFAT, stream::start);
+	this->psArchive->insert(fat.size());
+	this->psArchive->write(&fat[0], fat.size());
+	return;
+}
+
 void EPFArchive::updateFileCount(uint16_t iNewCount)
 {
 	// TESTED BY: fmt_epf_lionking_insert*
@@ -371,6 +416,7 @@ stream::pos EPFArchive::getDescOffset() const
 		EntryPtr lastFile = this->vcFAT.back();
 		assert(lastFile);
 		FATEntry *lastFATEntry = dynamic_cast<FATEntry *>(lastFile.get());
+		this->resolveEntry(lastFATEntry);
 		offDesc = lastFATEntry->iOffset + lastFATEntry->storedSize;
 	} else {
 		offDesc = EPF_FIRST_FILE_OFFSET;
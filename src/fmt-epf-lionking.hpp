@@ -70,6 +70,8 @@ class EPFArchive: virtual public FATArchive
 			FATEntry *pNewEntry);
 		virtual void postInsertFile(FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
+		virtual bool detachFAT();
+		virtual void attachFAT();
 
 	protected:
 		void updateFileCount(uint16_t iNewCount);
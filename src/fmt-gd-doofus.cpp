@@ -124,7 +124,7 @@ GD_DoofusArchive::GD_DoofusArchive(stream::inout_sptr psArchive, stream::inout_s
 	stream::len off = 0;
 	uint16_t type;
 	for (unsigned int i = 0; i < this->maxFiles; i++) {
-		FATEntry *pEntry = new FATEntry();
+		FATEntryPtr pEntry = FATArchive::newFATEntry();
 		pEntry->iIndex = i;
 		this->psFAT
 			>> u16le(pEntry->storedSize)
@@ -148,7 +148,7 @@ GD_DoofusArchive::GD_DoofusArchive(stream::inout_sptr psArchive, stream::inout_s
 		pEntry->realSize = pEntry->storedSize;
 		pEntry->iOffset = off;
 		off += pEntry->storedSize;
-		this->vcFAT.push_back(EntryPtr(pEntry));
+		this->vcFAT.push_back(pEntry);
 
 		if (pEntry->iOffset + pEntry->storedSize > lenArchive) {
 			std::cerr << "G-D file has been truncated, file @" << i
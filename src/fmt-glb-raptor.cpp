@@ -46,6 +46,10 @@
 #define GLB_FILESIZE_OFFSET(e)   (GLB_FATENTRY_OFFSET(e) + 8)
 #define GLB_FILEOFFSET_OFFSET(e) (GLB_FATENTRY_OFFSET(e) + 4)
 
+// The header and each FAT entry are all one cipher block long, so the header
+// is block 0 and FAT entry N is block N+1.
+#define GLB_FAT_BLOCK(e) ((e)->iIndex + 1)
+
 // Uncomment to temporarily disable FAT encryption (for debugging)
 //#define GLB_CLEARTEXT
 
@@ -186,6 +190,7 @@ GLBArchive::GLBArchive(stream::inout_sptr psArchive)
 	stream::memory_sptr mem(new stream::memory());
 	stream::copy(mem, preFAT);
 	this->fat->open(mem);
+	this->dirtyBlocks.assign(numFiles + 1, false);
 
 	if (numFiles >= GLB_SAFETY_MAX_FILECOUNT) {
 		throw stream::error("too many files or corrupted archive");
@@ -193,7 +198,7 @@ GLBArchive::GLBArchive(stream::inout_sptr psArchive)
 
 	this->fat->seekg(GLB_FAT_OFFSET, stream::start);
 	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
@@ -226,22 +231,45 @@ GLBArchive::~GLBArchive()
 
 void GLBArchive::flush()
 {
+	// TESTED BY: fmt_glb_raptor_rename_flush
+	this->prepareFlush(); // before the sizes and offsets are encoded
 	GLBFATFilterType glbFilterType;
-	stream::output_sub_sptr substrFAT(new stream::output_sub);
-	stream::fn_truncate fnTruncateSub = boost::bind<void>(&fakeResizeSubstream,
-		boost::weak_ptr<stream::output_sub>(substrFAT), _1);
-	substrFAT->open(this->psArchive, 0,
-		GLB_HEADER_LEN + this->vcFAT.size() * GLB_FAT_ENTRY_LEN, fnTruncateSub);
+	std::vector<uint8_t> buf;
+	unsigned int numBlocks = this->dirtyBlocks.size();
+	unsigned int first = 0;
+	while (first < numBlocks) {
+		if (!this->dirtyBlocks[first]) {
+			first++;
+			continue;
+		}
+		unsigned int last = first;
+		while ((last + 1 < numBlocks) && this->dirtyBlocks[last + 1]) last++;
+
+		// The cipher restarts at every block boundary, so a run of changed blocks
+		// can be encrypted on its own without touching its neighbours.
+		stream::pos offRun = first * GLB_FAT_ENTRY_LEN;
+		stream::len lenRun = (last - first + 1) * GLB_FAT_ENTRY_LEN;
+
+		stream::output_sub_sptr substrFAT(new stream::output_sub);
+		stream::fn_truncate fnTruncateSub = boost::bind<void>(&fakeResizeSubstream,
+			boost::weak_ptr<stream::output_sub>(substrFAT), _1);
+		substrFAT->open(this->psArchive, offRun, lenRun, fnTruncateSub);
 #ifdef GLB_CLEARTEXT
-	stream::output_sptr bareCrypt = substrFAT;
+		stream::output_sptr bareCrypt = substrFAT;
 #else
-	stream::fn_truncate fnTruncate = boost::bind<void>(&dummyResize, _1);
-	stream::output_sptr bareCrypt = glbFilterType.apply((stream::output_sptr)substrFAT, fnTruncate);
+		stream::fn_truncate fnTruncate = boost::bind<void>(&dummyResize, _1);
+		stream::output_sptr bareCrypt = glbFilterType.apply((stream::output_sptr)substrFAT, fnTruncate);
 #endif
-	this->fat->seekg(0, stream::start);
-	bareCrypt->seekp(0, stream::start);
-	stream::copy(bareCrypt, this->fat);
-	bareCrypt->flush();
+		buf.resize(lenRun);
+		this->fat->seekg(offRun, stream::start);
+		this->fat->read(&buf[0], lenRun);
+		bareCrypt->seekp(0, stream::start);
+		bareCrypt->write(&buf[0], lenRun);
+		bareCrypt->flush();
+
+		first = last + 1;
+	}
+	this->dirtyBlocks.assign(numBlocks, false);
 
 	this->FATArchive::flush();
 	return;
@@ -253,6 +281,7 @@ void GLBArchive::updateFileName(const FATEntry *pid, const std::string& strNewNa
 	assert(strNewName.length() <= GLB_MAX_FILENAME_LEN);
 	this->fat->seekp(GLB_FILENAME_OFFSET(pid), stream::start);
 	this->fat << nullPadded(strNewName, GLB_FILENAME_FIELD_LEN);
+	this->dirtyBlocks[GLB_FAT_BLOCK(pid)] = true;
 	return;
 }
 
@@ -262,6 +291,7 @@ void GLBArchive::updateFileOffset(const FATEntry *pid, stream::delta offDelta)
 	// TESTED BY: fmt_glb_raptor_resize*
 	this->fat->seekp(GLB_FILEOFFSET_OFFSET(pid), stream::start);
 	this->fat << u32le(pid->iOffset);
+	this->dirtyBlocks[GLB_FAT_BLOCK(pid)] = true;
 	return;
 }
 
@@ -271,6 +301,7 @@ void GLBArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 	// TESTED BY: fmt_glb_raptor_resize*
 	this->fat->seekp(GLB_FILESIZE_OFFSET(pid), stream::start);
 	this->fat << u32le(pid->storedSize);
+	this->dirtyBlocks[GLB_FAT_BLOCK(pid)] = true;
 	return;
 }
 
@@ -289,6 +320,8 @@ FATArchive::FATEntry *GLBArchive::preInsertFile(const FATEntry *idBeforeThis, FA
 	this->fat->insert(GLB_FAT_ENTRY_LEN);
 	this->psArchive->seekp(GLB_FATENTRY_OFFSET(pNewEntry), stream::start);
 	this->psArchive->insert(GLB_FAT_ENTRY_LEN);
+	this->dirtyBlocks.insert(this->dirtyBlocks.begin() + GLB_FAT_BLOCK(pNewEntry),
+		true);
 
 	boost::to_upper(pNewEntry->strName);
 
@@ -334,17 +367,39 @@ void GLBArchive::preRemoveFile(const FATEntry *pid)
 
 	this->psArchive->seekp(GLB_FATENTRY_OFFSET(pid), stream::start);
 	this->psArchive->remove(GLB_FAT_ENTRY_LEN);
+	// The encrypted entries that follow are still valid where they now sit
+	this->dirtyBlocks.erase(this->dirtyBlocks.begin() + GLB_FAT_BLOCK(pid));
 
 	this->updateFileCount(this->vcFAT.size() - 1);
 	return;
 }
 
+bool GLBArchive::canBeSparse() const
+{
+	// Each FAT entry has its own offset, so unused space between files is fine
+	return true;
+}
+
+bool GLBArchive::moveFATEntry(const FATEntry *pid, unsigned int newIndex)
+{
+	// TESTED BY: fmt_glb_raptor_move
+	// The cleartext FAT is encrypted back into the archive on flush()
+	FATArchive::moveRecord(this->fat, GLB_FAT_OFFSET, GLB_FAT_ENTRY_LEN,
+		pid->iIndex, newIndex);
+	// Every entry between the old and new positions has shifted by one
+	unsigned int low = std::min(pid->iIndex, newIndex);
+	unsigned int high = std::max(pid->iIndex, newIndex);
+	for (unsigned int i = low; i <= high; i++) this->dirtyBlocks[i + 1] = true;
+	return true;
+}
+
 void GLBArchive::updateFileCount(uint32_t iNewCount)
 {
 	// TESTED BY: fmt_glb_raptor_insert*
 	// TESTED BY: fmt_glb_raptor_remove*
 	this->fat->seekp(GLB_FILECOUNT_OFFSET, stream::start);
 	this->fat << u32le(iNewCount);
+	this->dirtyBlocks[0] = true;
 	return;
 }
 
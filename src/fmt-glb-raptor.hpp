@@ -21,6 +21,7 @@
 #ifndef _CAMOTO_FMT_GLB_RAPTOR_HPP_
 #define _CAMOTO_FMT_GLB_RAPTOR_HPP_
 
+#include <vector>
 #include <camoto/gamearchive/archivetype.hpp>
 #include "fatarchive.hpp"
 
@@ -61,10 +62,16 @@ class GLBArchive: virtual public FATArchive
 		virtual FATEntry *preInsertFile(const FATEntry *idBeforeThis,
 			FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
+		virtual bool canBeSparse() const;
+		virtual bool moveFATEntry(const FATEntry *pid, unsigned int newIndex);
 
 	protected:
 		stream::seg_sptr fat;        ///< Cleartext version of FAT
 
+		/// One flag per 28-byte cipher block (header first, then each FAT entry)
+		/// that has changed in the cleartext FAT since it was last encrypted.
+		std::vector<bool> dirtyBlocks;
+
 		/// Update the header with the number of files in the archive
 		void updateFileCount(uint32_t iNewCount);
 };
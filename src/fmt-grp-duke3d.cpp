@@ -25,6 +25,8 @@
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "archivebuild.hpp"
+#include "fatschema.hpp"
 #include "fmt-grp-duke3d.hpp"
 
 #define GRP_FILECOUNT_OFFSET    12
@@ -39,12 +41,16 @@
 
 #define GRP_FATENTRY_OFFSET(e) (GRP_HEADER_LEN + e->iIndex * GRP_FAT_ENTRY_LEN)
 
-#define GRP_FILENAME_OFFSET(e) GRP_FATENTRY_OFFSET(e)
-#define GRP_FILESIZE_OFFSET(e) (GRP_FATENTRY_OFFSET(e) + GRP_FILENAME_FIELD_LEN)
-
 namespace camoto {
 namespace gamearchive {
 
+// Fields within each FAT record
+typedef FATFieldString<0, GRP_FILENAME_FIELD_LEN> GRPFieldName;
+typedef FATFieldInt   <GRP_FILENAME_FIELD_LEN, 4> GRPFieldSize;
+
+// Fields within the header
+typedef FATFieldInt   <GRP_FILECOUNT_OFFSET, 4> GRPFieldFileCount;
+
 GRPType::GRPType()
 {
 }
@@ -106,6 +112,30 @@ ArchivePtr GRPType::newArchive(stream::inout_sptr psArchive, SuppData& suppData)
 	return ArchivePtr(new GRPArchive(psArchive));
 }
 
+ArchivePtr GRPType::build(stream::inout_sptr psArchive, SuppData& suppData,
+	const BuildList& files, const BuildMetadata& metadata) const
+{
+	// TESTED BY: test_archive::test_new_build
+	if (!metadata.empty()) {
+		throw stream::error("GRP files have no metadata");
+	}
+	std::vector<stream::len> lenData;
+	stream::len lenTotal = measureBuildList(files, GRP_MAX_FILENAME_LEN,
+		GRP_SAFETY_MAX_FILECOUNT - 1, &lenData);
+
+	// The FAT only holds names and sizes, the files follow it in the same order
+	std::vector<uint8_t> head(GRP_FAT_OFFSET + files.size() * GRP_FAT_ENTRY_LEN);
+	memcpy(&head[0], "KenSilverman", 12);
+	GRPFieldFileCount::set(&head[0], files.size());
+	for (unsigned int i = 0; i < files.size(); i++) {
+		uint8_t *record = &head[GRP_FAT_OFFSET + i * GRP_FAT_ENTRY_LEN];
+		GRPFieldName::set(record, boost::to_upper_copy(files[i].name));
+		GRPFieldSize::set(record, lenData[i]);
+	}
+	writeBuild(psArchive, head, files, lenTotal);
+	return ArchivePtr(new GRPArchive(psArchive));
+}
+
 ArchivePtr GRPType::open(stream::inout_sptr psArchive, SuppData& suppData) const
 {
 	return ArchivePtr(new GRPArchive(psArchive));
@@ -135,9 +165,15 @@ GRPArchive::GRPArchive(stream::inout_sptr psArchive)
 		throw stream::error("too many files or corrupted archive");
 	}
 
+	// Read the whole FAT in one go and decode it from memory
+	std::vector<uint8_t> fat;
+	readFATRecords(this->psArchive, GRP_FAT_OFFSET, numFiles, GRP_FAT_ENTRY_LEN,
+		&fat);
+
 	stream::pos offNext = GRP_HEADER_LEN + (numFiles * GRP_FAT_ENTRY_LEN);
 	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		const uint8_t *record = &fat[i * GRP_FAT_ENTRY_LEN];
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
@@ -147,10 +183,8 @@ GRPArchive::GRPArchive(stream::inout_sptr psArchive)
 		fatEntry->fAttr = 0;
 		fatEntry->bValid = true;
 
-		// Read the data in from the FAT entry in the file
-		this->psArchive
-			>> nullPadded(fatEntry->strName, GRP_FILENAME_FIELD_LEN)
-			>> u32le(fatEntry->storedSize);
+		fatEntry->strName = GRPFieldName::get(record);
+		fatEntry->storedSize = GRPFieldSize::get(record);
 
 		fatEntry->realSize = fatEntry->storedSize;
 		this->vcFAT.push_back(ep);
@@ -166,8 +200,7 @@ void GRPArchive::updateFileName(const FATEntry *pid, const std::string& strNewNa
 {
 	// TESTED BY: fmt_grp_duke3d_rename
 	assert(strNewName.length() <= GRP_MAX_FILENAME_LEN);
-	this->psArchive->seekp(GRP_FILENAME_OFFSET(pid), stream::start);
-	this->psArchive << nullPadded(strNewName, GRP_FILENAME_FIELD_LEN);
+	GRPFieldName::update(this->psArchive, GRP_FATENTRY_OFFSET(pid), strNewName);
 	return;
 }
 
@@ -183,8 +216,8 @@ void GRPArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 {
 	// TESTED BY: fmt_grp_duke3d_insert*
 	// TESTED BY: fmt_grp_duke3d_resize*
-	this->psArchive->seekp(GRP_FILESIZE_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->storedSize);
+	GRPFieldSize::update(this->psArchive, GRP_FATENTRY_OFFSET(pid),
+		pid->storedSize);
 	return;
 }
 
@@ -241,6 +274,16 @@ void GRPArchive::preRemoveFile(const FATEntry *pid)
 	return;
 }
 
+bool GRPArchive::moveFATEntry(const FATEntry *pid, unsigned int newIndex)
+{
+	// TESTED BY: fmt_grp_duke3d_move
+	// Only the filename and size are in the FAT, so the data has to follow the
+	// same order, which FATArchive takes care of.
+	FATArchive::moveRecord(this->psArchive, GRP_FAT_OFFSET, GRP_FAT_ENTRY_LEN,
+		pid->iIndex, newIndex);
+	return true;
+}
+
 void GRPArchive::updateFileCount(uint32_t iNewCount)
 {
 	// TESTED BY: fmt_grp_duke3d_insert*
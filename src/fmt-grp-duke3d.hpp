@@ -41,6 +41,8 @@ class GRPType: virtual public ArchiveType
 			const;
 		virtual ArchivePtr newArchive(stream::inout_sptr psArchive,
 			SuppData& suppData) const;
+		virtual ArchivePtr build(stream::inout_sptr psArchive, SuppData& suppData,
+			const BuildList& files, const BuildMetadata& metadata) const;
 		virtual ArchivePtr open(stream::inout_sptr fsArchive, SuppData& suppData)
 			const;
 		virtual SuppFilenames getRequiredSupps(stream::input_sptr data,
@@ -60,6 +62,7 @@ class GRPArchive: virtual public FATArchive
 		virtual FATEntry *preInsertFile(const FATEntry *idBeforeThis,
 			FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
+		virtual bool moveFATEntry(const FATEntry *pid, unsigned int newIndex);
 
 	protected:
 		// Update the header with the number of files in the archive
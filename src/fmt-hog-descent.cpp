@@ -25,6 +25,7 @@
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "fatschema.hpp"
 #include "fmt-hog-descent.hpp"
 
 #define HOG_HEADER_LEN            3
@@ -40,6 +41,10 @@
 namespace camoto {
 namespace gamearchive {
 
+// Fields within the header in front of each file
+typedef FATFieldString<0, HOG_FILENAME_FIELD_LEN> HOGFieldName;
+typedef FATFieldInt   <HOG_FAT_FILESIZE_OFFSET, 4> HOGFieldSize;
+
 HOGType::HOGType()
 {
 }
@@ -102,6 +107,13 @@ ArchivePtr HOGType::open(stream::inout_sptr psArchive, SuppData& suppData) const
 	return ArchivePtr(new HOGArchive(psArchive));
 }
 
+ArchivePtr HOGType::openIndexed(stream::inout_sptr psArchive,
+	SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const
+{
+	// TESTED BY: fmt_hog_descent_open_indexed
+	return ArchivePtr(new HOGArchive(psArchive, index, stamp));
+}
+
 SuppFilenames HOGType::getRequiredSupps(stream::input_sptr data,
 	const std::string& filenameArchive) const
 {
@@ -110,7 +122,8 @@ SuppFilenames HOGType::getRequiredSupps(stream::input_sptr data,
 }
 
 
-HOGArchive::HOGArchive(stream::inout_sptr psArchive)
+HOGArchive::HOGArchive(stream::inout_sptr psArchive,
+	stream::inout_sptr index, uint64_t stamp)
 	:	FATArchive(psArchive, HOG_FIRST_FILE_OFFSET, HOG_MAX_FILENAME_LEN)
 {
 	stream::pos lenArchive = this->psArchive->size();
@@ -123,15 +136,21 @@ HOGArchive::HOGArchive(stream::inout_sptr psArchive)
 		throw stream::error("File too short");
 	}
 
+	// The headers are spread through the whole file, so use the cached list
+	// if there's a current one
+	if (this->loadIndex(index, stamp)) return;
+
 	stream::pos offNext = HOG_FIRST_FILE_OFFSET;
 	for (int i = 0; (offNext + HOG_FAT_ENTRY_LEN <= lenArchive); i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
-		this->psArchive
-			>> nullPadded(fatEntry->strName, HOG_FILENAME_FIELD_LEN)
-			>> u32le(fatEntry->storedSize)
-		;
+		// The headers are spread through the file, but each one can at least be
+		// read in a single call
+		uint8_t record[HOG_FAT_ENTRY_LEN];
+		this->psArchive->read(record, HOG_FAT_ENTRY_LEN);
+		fatEntry->strName = HOGFieldName::get(record);
+		fatEntry->storedSize = HOGFieldSize::get(record);
 
 		fatEntry->iIndex = i;
 		fatEntry->iOffset = offNext;
@@ -154,6 +173,8 @@ HOGArchive::HOGArchive(stream::inout_sptr psArchive)
 			throw stream::error("too many files or corrupted archive");
 		}
 	}
+
+	this->saveIndex();
 }
 
 HOGArchive::~HOGArchive()
@@ -164,8 +185,7 @@ void HOGArchive::updateFileName(const FATEntry *pid, const std::string& strNewNa
 {
 	// TESTED BY: fmt_hog_descent_rename
 	assert(strNewName.length() <= HOG_MAX_FILENAME_LEN);
-	this->psArchive->seekp(pid->iOffset, stream::start);
-	this->psArchive << nullPadded(strNewName, HOG_FILENAME_FIELD_LEN);
+	HOGFieldName::update(this->psArchive, pid->iOffset, strNewName);
 	return;
 }
 
@@ -181,8 +201,7 @@ void HOGArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 {
 	// TESTED BY: fmt_hog_descent_insert*
 	// TESTED BY: fmt_hog_descent_resize*
-	this->psArchive->seekp(pid->iOffset + HOG_FAT_FILESIZE_OFFSET, stream::start);
-	this->psArchive << u32le(pid->storedSize);
+	HOGFieldSize::update(this->psArchive, pid->iOffset, pid->storedSize);
 	return;
 }
 
@@ -43,6 +43,8 @@ class HOGType: virtual public ArchiveType
 			SuppData& suppData) const;
 		virtual ArchivePtr open(stream::inout_sptr fsArchive, SuppData& suppData)
 			const;
+		virtual ArchivePtr openIndexed(stream::inout_sptr psArchive,
+			SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const;
 		virtual SuppFilenames getRequiredSupps(stream::input_sptr data,
 			const std::string& filenameArchive) const;
 };
@@ -50,7 +52,8 @@ class HOGType: virtual public ArchiveType
 class HOGArchive: virtual public FATArchive
 {
 	public:
-		HOGArchive(stream::inout_sptr psArchive);
+		HOGArchive(stream::inout_sptr psArchive,
+			stream::inout_sptr index = stream::inout_sptr(), uint64_t stamp = 0);
 		virtual ~HOGArchive();
 
 		virtual void updateFileName(const FATEntry *pid,
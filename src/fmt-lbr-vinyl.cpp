@@ -496,7 +496,7 @@ LBRArchive::LBRArchive(stream::inout_sptr psArchive)
 				;
 			}
 
-			FATEntry *fatEntry = new FATEntry();
+			FATEntryPtr fatEntry = FATArchive::newFATEntry();
 			EntryPtr ep(fatEntry);
 
 			fatEntry->iIndex = i;
@@ -24,6 +24,8 @@
 #include <boost/algorithm/string.hpp>
 #include <camoto/iostream_helpers.hpp>
 
+#include "archivebuild.hpp"
+#include "fatschema.hpp"
 #include "fmt-lib-mythos.hpp"
 
 #define LIB_HEADER_LEN          4  // "LIB\x1A"
@@ -37,12 +39,16 @@
 #define LIB_SAFETY_MAX_FILECOUNT  8192 // Maximum value we will load
 
 #define LIB_FATENTRY_OFFSET(e)   (LIB_FAT_OFFSET + e->iIndex * LIB_FAT_ENTRY_LEN)
-#define LIB_FILENAME_OFFSET(e)   LIB_FATENTRY_OFFSET(e)
-#define LIB_FILEOFFSET_OFFSET(e) (LIB_FATENTRY_OFFSET(e) + LIB_FILENAME_FIELD_LEN)
-
 namespace camoto {
 namespace gamearchive {
 
+// Fields within each FAT record
+typedef FATFieldString<0, LIB_FILENAME_FIELD_LEN> LIBFieldName;
+typedef FATFieldInt   <LIB_FILENAME_FIELD_LEN, 4> LIBFieldOffset;
+
+// Fields within the header
+typedef FATFieldInt   <LIB_FILECOUNT_OFFSET, 2> LIBFieldFileCount;
+
 LIB_MythosType::LIB_MythosType()
 {
 }
@@ -101,6 +107,37 @@ ArchivePtr LIB_MythosType::newArchive(stream::inout_sptr psArchive, SuppData& su
 	return ArchivePtr(new LIB_MythosArchive(psArchive));
 }
 
+ArchivePtr LIB_MythosType::build(stream::inout_sptr psArchive,
+	SuppData& suppData, const BuildList& files,
+	const BuildMetadata& metadata) const
+{
+	// TESTED BY: test_archive::test_new_build
+	if (!metadata.empty()) {
+		throw stream::error("LIB files have no metadata");
+	}
+	std::vector<stream::len> lenData;
+	stream::len lenTotal = measureBuildList(files, LIB_MAX_FILENAME_LEN,
+		LIB_SAFETY_MAX_FILECOUNT - 1, &lenData);
+
+	// One FAT entry per file, then a blank one holding the offset of the end
+	// of the archive, from which the last file's size is worked out
+	std::vector<uint8_t> head(LIB_FAT_OFFSET
+		+ (files.size() + 1) * LIB_FAT_ENTRY_LEN, 0);
+	memcpy(&head[0], "LIB\x1A", LIB_HEADER_LEN);
+	LIBFieldFileCount::set(&head[0], files.size());
+	stream::pos offFile = head.size();
+	for (unsigned int i = 0; i < files.size(); i++) {
+		uint8_t *record = &head[LIB_FAT_OFFSET + i * LIB_FAT_ENTRY_LEN];
+		LIBFieldName::set(record, boost::to_upper_copy(files[i].name));
+		LIBFieldOffset::set(record, offFile);
+		offFile += lenData[i];
+	}
+	LIBFieldOffset::set(
+		&head[LIB_FAT_OFFSET + files.size() * LIB_FAT_ENTRY_LEN], offFile);
+	writeBuild(psArchive, head, files, lenTotal);
+	return ArchivePtr(new LIB_MythosArchive(psArchive));
+}
+
 ArchivePtr LIB_MythosType::open(stream::inout_sptr psArchive, SuppData& suppData) const
 {
 	return ArchivePtr(new LIB_MythosArchive(psArchive));
@@ -127,9 +164,19 @@ LIB_MythosArchive::LIB_MythosArchive(stream::inout_sptr psArchive)
 	psArchive->seekg(4, stream::start);
 	psArchive >> u16le(numFiles);
 
+	if (numFiles >= LIB_SAFETY_MAX_FILECOUNT) {
+		throw stream::error("too many files or corrupted archive");
+	}
+
+	// Read the whole FAT, including the trailing spacer entry, in one go
+	std::vector<uint8_t> fat;
+	readFATRecords(psArchive, LIB_FAT_OFFSET, numFiles + 1, LIB_FAT_ENTRY_LEN,
+		&fat);
+
 	FATEntry *fatLast = NULL;
 	for (unsigned int i = 0; i <= numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		const uint8_t *record = &fat[i * LIB_FAT_ENTRY_LEN];
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
@@ -140,18 +187,13 @@ LIB_MythosArchive::LIB_MythosArchive(stream::inout_sptr psArchive)
 		if (i != numFiles) { // skip the last spacer entry
 			this->vcFAT.push_back(ep);
 		}
-		if (i >= LIB_SAFETY_MAX_FILECOUNT) {
-			throw stream::error("too many files or corrupted archive");
-		}
-		psArchive
-			>> nullPadded(fatEntry->strName, LIB_FILENAME_FIELD_LEN)
-			>> u32le(fatEntry->iOffset)
-		;
+		fatEntry->strName = LIBFieldName::get(record);
+		fatEntry->iOffset = LIBFieldOffset::get(record);
 		if (fatLast) {
 			fatLast->storedSize = fatEntry->iOffset - fatLast->iOffset;
 			fatLast->realSize = fatLast->storedSize;
 		}
-		fatLast = fatEntry;
+		fatLast = fatEntry.get();
 	}
 }
 
@@ -163,15 +205,14 @@ void LIB_MythosArchive::updateFileName(const FATEntry *pid, const std::string& s
 {
 	// TESTED BY: fmt_lib_mythos_rename
 	assert(strNewName.length() <= LIB_MAX_FILENAME_LEN);
-	this->psArchive->seekp(LIB_FILENAME_OFFSET(pid), stream::start);
-	this->psArchive << nullPadded(strNewName, LIB_FILENAME_FIELD_LEN);
+	LIBFieldName::update(this->psArchive, LIB_FATENTRY_OFFSET(pid), strNewName);
 	return;
 }
 
 void LIB_MythosArchive::updateFileOffset(const FATEntry *pid, stream::delta offDelta)
 {
-	this->psArchive->seekp(LIB_FILEOFFSET_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->iOffset);
+	LIBFieldOffset::update(this->psArchive, LIB_FATENTRY_OFFSET(pid),
+		pid->iOffset);
 	return;
 }
 
@@ -41,6 +41,8 @@ class LIB_MythosType: virtual public ArchiveType
 			const;
 		virtual ArchivePtr newArchive(stream::inout_sptr psArchive,
 			SuppData& suppData) const;
+		virtual ArchivePtr build(stream::inout_sptr psArchive, SuppData& suppData,
+			const BuildList& files, const BuildMetadata& metadata) const;
 		virtual ArchivePtr open(stream::inout_sptr fsArchive, SuppData& suppData)
 			const;
 		virtual SuppFilenames getRequiredSupps(stream::input_sptr data,
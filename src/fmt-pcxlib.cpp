@@ -25,6 +25,7 @@
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "fatschema.hpp"
 #include "fmt-pcxlib.hpp"
 
 #define PCX_MAX_FILES         65535
@@ -35,13 +36,15 @@
 #define PCX_FIRST_FILE_OFFSET PCX_FAT_OFFSET
 
 #define PCX_FATENTRY_OFFSET(e)   (PCX_FAT_OFFSET + (e)->iIndex * PCX_FAT_ENTRY_LEN)
-#define PCX_FILENAME_OFFSET(e)   (PCX_FATENTRY_OFFSET(e) + 1)
-#define PCX_FILEOFFSET_OFFSET(e) (PCX_FATENTRY_OFFSET(e) + 14)
-#define PCX_FILESIZE_OFFSET(e)   (PCX_FATENTRY_OFFSET(e) + 18)
-
 namespace camoto {
 namespace gamearchive {
 
+// Fields within each FAT record
+typedef FATFieldString< 1, 8> PCXFieldBase;
+typedef FATFieldString< 9, 5> PCXFieldExt;
+typedef FATFieldInt   <14, 4> PCXFieldOffset;
+typedef FATFieldInt   <18, 4> PCXFieldSize;
+
 PCXLibType::PCXLibType()
 {
 }
@@ -182,37 +185,12 @@ PCXLibArchive::PCXLibArchive(stream::inout_sptr psArchive)
 	this->psArchive->seekg(PCX_FILECOUNT_OFFSET, stream::start);
 	uint16_t numFiles;
 	this->psArchive >> u16le(numFiles);
-	this->vcFAT.reserve(numFiles);
-
-	// Skip over remaining header
-	this->psArchive->seekg(32, stream::cur);
-
-	for (int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
-		EntryPtr ep(fatEntry);
 
-		uint8_t sync;
-		std::string name, ext;
-		uint16_t date, time;
-		this->psArchive
-			>> u8(sync)
-			>> nullPadded(name, 8)
-			>> nullPadded(ext, 5)
-			>> u32le(fatEntry->iOffset)
-			>> u32le(fatEntry->storedSize)
-			>> u16le(date)
-			>> u16le(time)
-		;
-		fatEntry->strName = name.substr(0, name.find_first_of(' ')) + ext.substr(0, ext.find_first_of(' '));
-
-		fatEntry->iIndex = i;
-		fatEntry->lenHeader = 0;
-		fatEntry->type = FILETYPE_GENERIC;
-		fatEntry->fAttr = 0;
-		fatEntry->bValid = true;
-		fatEntry->realSize = fatEntry->storedSize;
-		this->vcFAT.push_back(ep);
+	// There can be a lot of files, so only read the FAT as they are looked up
+	if (PCX_FAT_OFFSET + (stream::pos)numFiles * PCX_FAT_ENTRY_LEN > lenArchive) {
+		throw stream::error("Truncated file");
 	}
+	this->setLazyFAT(numFiles, PCX_FAT_OFFSET, PCX_FAT_ENTRY_LEN);
 }
 
 PCXLibArchive::~PCXLibArchive()
@@ -223,7 +201,6 @@ void PCXLibArchive::updateFileName(const FATEntry *pid, const std::string& strNe
 {
 	// TESTED BY: fmt_pcxlib_rename
 	assert(strNewName.length() <= PCX_MAX_FILENAME_LEN);
-	this->psArchive->seekp(PCX_FILENAME_OFFSET(pid), stream::start);
 	int pos = strNewName.find_last_of('.');
 	std::string name = strNewName.substr(0, pos);
 	while (name.length() < 8) name += ' ';
@@ -232,10 +209,8 @@ void PCXLibArchive::updateFileName(const FATEntry *pid, const std::string& strNe
 		throw stream::error("Filename extension too long - three letters max.");
 	}
 	while (ext.length() < 4) ext += ' ';
-	this->psArchive
-		<< nullPadded(name, 8)
-		<< nullPadded(ext, 5)
-	;
+	PCXFieldBase::update(this->psArchive, PCX_FATENTRY_OFFSET(pid), name);
+	PCXFieldExt::update(this->psArchive, PCX_FATENTRY_OFFSET(pid), ext);
 	return;
 }
 
@@ -243,8 +218,8 @@ void PCXLibArchive::updateFileOffset(const FATEntry *pid, stream::delta offDelta
 {
 	// TESTED BY: fmt_pcxlib_insert*
 	// TESTED BY: fmt_pcxlib_resize*
-	this->psArchive->seekp(PCX_FILEOFFSET_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->iOffset);
+	PCXFieldOffset::update(this->psArchive, PCX_FATENTRY_OFFSET(pid),
+		pid->iOffset);
 	return;
 }
 
@@ -252,8 +227,8 @@ void PCXLibArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 {
 	// TESTED BY: fmt_pcxlib_insert*
 	// TESTED BY: fmt_pcxlib_resize*
-	this->psArchive->seekp(PCX_FILESIZE_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->storedSize);
+	PCXFieldSize::update(this->psArchive, PCX_FATENTRY_OFFSET(pid),
+		pid->storedSize);
 	return;
 }
 
@@ -335,6 +310,41 @@ void PCXLibArchive::preRemoveFile(const FATEntry *pid)
 	return;
 }
 
+bool PCXLibArchive::canBeSparse() const
+{
+	// Nothing requires the files to be contiguous
+	return true;
+}
+
+void PCXLibArchive::loadFATEntry(const uint8_t *record, FATEntry *fatEntry)
+	const
+{
+	fatEntry->iOffset = PCXFieldOffset::get(record);
+	fatEntry->storedSize = PCXFieldSize::get(record);
+	fatEntry->strName = this->loadFATName(record);
+
+	fatEntry->lenHeader = 0;
+	fatEntry->type = FILETYPE_GENERIC;
+	fatEntry->fAttr = 0;
+	fatEntry->realSize = fatEntry->storedSize;
+	return;
+}
+
+std::string PCXLibArchive::loadFATName(const uint8_t *record) const
+{
+	std::string name = PCXFieldBase::get(record);
+	std::string ext = PCXFieldExt::get(record);
+	return name.substr(0, name.find_first_of(' ')) + ext.substr(0, ext.find_first_of(' '));
+}
+
+bool PCXLibArchive::moveFATEntry(const FATEntry *pid, unsigned int newIndex)
+{
+	// TESTED BY: fmt_pcxlib_move
+	FATArchive::moveRecord(this->psArchive, PCX_FAT_OFFSET, PCX_FAT_ENTRY_LEN,
+		pid->iIndex, newIndex);
+	return true;
+}
+
 void PCXLibArchive::updateFileCount(uint32_t iNewCount)
 {
 	// TESTED BY: fmt_pcxlib_insert*
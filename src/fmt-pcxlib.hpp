@@ -60,6 +60,10 @@ class PCXLibArchive: virtual public FATArchive
 		virtual FATEntry *preInsertFile(const FATEntry *idBeforeThis,
 			FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
+		virtual bool canBeSparse() const;
+		virtual void loadFATEntry(const uint8_t *record, FATEntry *pEntry) const;
+		virtual std::string loadFATName(const uint8_t *record) const;
+		virtual bool moveFATEntry(const FATEntry *pid, unsigned int newIndex);
 
 	protected:
 		void updateFileCount(uint32_t iNewCount);
@@ -161,7 +161,7 @@ PODArchive::PODArchive(stream::inout_sptr psArchive)
 	this->psArchive->seekg(POD_FAT_OFFSET, stream::start);
 
 	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *pEntry = new FATEntry();
+		FATEntryPtr pEntry = FATArchive::newFATEntry();
 		pEntry->iIndex = i;
 		this->psArchive
 			>> nullPadded(pEntry->strName, POD_MAX_FILENAME_LEN)
@@ -173,7 +173,7 @@ PODArchive::PODArchive(stream::inout_sptr psArchive)
 		pEntry->fAttr = 0;
 		pEntry->bValid = true;
 		pEntry->realSize = pEntry->storedSize;
-		this->vcFAT.push_back(EntryPtr(pEntry));
+		this->vcFAT.push_back(pEntry);
 	}
 }
 
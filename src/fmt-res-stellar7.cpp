@@ -123,6 +123,13 @@ ArchivePtr RESType::open(stream::inout_sptr psArchive, SuppData& suppData) const
 	return root;
 }
 
+ArchivePtr RESType::openIndexed(stream::inout_sptr psArchive,
+	SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const
+{
+	// TESTED BY: fmt_res_stellar7_open_indexed
+	return ArchivePtr(new RESArchiveFolder(psArchive, index, stamp));
+}
+
 SuppFilenames RESType::getRequiredSupps(stream::input_sptr data,
 	const std::string& filenameArchive) const
 {
@@ -131,11 +138,16 @@ SuppFilenames RESType::getRequiredSupps(stream::input_sptr data,
 }
 
 
-RESArchiveFolder::RESArchiveFolder(stream::inout_sptr psArchive)
+RESArchiveFolder::RESArchiveFolder(stream::inout_sptr psArchive,
+	stream::inout_sptr index, uint64_t stamp)
 	:	FATArchive(psArchive, RES_FIRST_FILE_OFFSET, RES_MAX_FILENAME_LEN)
 {
 	stream::pos lenArchive = this->psArchive->size();
 
+	// Use the cached file list if there is one, rather than hopping from one
+	// embedded header to the next
+	if (this->loadIndex(index, stamp)) return;
+
 	this->psArchive->seekg(0, stream::start);
 
 	stream::pos offNext = 0;
@@ -144,7 +156,7 @@ RESArchiveFolder::RESArchiveFolder(stream::inout_sptr psArchive)
 		(offNext + RES_FAT_ENTRY_LEN <= lenArchive)
 	); i++) {
 
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		// Read the data in from the FAT entry in the file
@@ -174,6 +186,8 @@ RESArchiveFolder::RESArchiveFolder(stream::inout_sptr psArchive)
 		}
 		this->psArchive->seekg(fatEntry->storedSize, stream::cur);
 	}
+
+	this->saveIndex();
 }
 
 RESArchiveFolder::~RESArchiveFolder()
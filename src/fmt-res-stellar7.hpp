@@ -41,6 +41,8 @@ class RESType: virtual public ArchiveType
 		virtual ArchivePtr newArchive(stream::inout_sptr psArchive,
 			SuppData& suppData) const;
 		virtual ArchivePtr open(stream::inout_sptr fsArchive, SuppData& suppData) const;
+		virtual ArchivePtr openIndexed(stream::inout_sptr psArchive,
+			SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const;
 		virtual SuppFilenames getRequiredSupps(stream::input_sptr data,
 			const std::string& filenameArchive) const;
 };
@@ -48,7 +50,8 @@ class RESType: virtual public ArchiveType
 class RESArchiveFolder: virtual public FATArchive
 {
 	public:
-		RESArchiveFolder(stream::inout_sptr psArchive);
+		RESArchiveFolder(stream::inout_sptr psArchive,
+			stream::inout_sptr index = stream::inout_sptr(), uint64_t stamp = 0);
 		virtual ~RESArchiveFolder();
 
 		virtual ArchivePtr openFolder(const EntryPtr id);
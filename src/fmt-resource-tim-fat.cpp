@@ -137,7 +137,7 @@ TIMResourceFATArchive::TIMResourceFATArchive(stream::inout_sptr psArchive)
 	this->psArchive >> u16le(numFiles);
 	stream::pos pos = TIM_FILECOUNT_OFFSET + 2;
 	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 		uint16_t count;
 		this->psArchive
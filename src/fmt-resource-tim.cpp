@@ -121,6 +121,15 @@ ArchivePtr TIMResourceType::open(stream::inout_sptr psArchive,
 	return ArchivePtr(new TIMResourceArchive(psArchive, suppData[SuppItem::FAT]));
 }
 
+ArchivePtr TIMResourceType::openIndexed(stream::inout_sptr psArchive,
+	SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const
+{
+	// TESTED BY: fmt_resource_tim_open_indexed
+	assert(suppData.find(SuppItem::FAT) != suppData.end());
+	return ArchivePtr(new TIMResourceArchive(psArchive, suppData[SuppItem::FAT],
+		index, stamp));
+}
+
 SuppFilenames TIMResourceType::getRequiredSupps(stream::input_sptr data,
 	const std::string& filenameArchive) const
 {
@@ -132,26 +141,30 @@ SuppFilenames TIMResourceType::getRequiredSupps(stream::input_sptr data,
 
 
 TIMResourceArchive::TIMResourceArchive(stream::inout_sptr psArchive,
-	stream::inout_sptr psFAT)
+	stream::inout_sptr psFAT, stream::inout_sptr index, uint64_t stamp)
 	:	FATArchive(psArchive, TIM_FIRST_FILE_OFFSET, TIM_MAX_FILENAME_LEN),
 		psFAT(new stream::seg())
 {
 	this->psFAT->open(psFAT);
 
+	// The external FAT has no names or sizes, so the embedded headers would
+	// have to be read one by one unless the sidecar index is still current
+	if (this->loadIndex(index, stamp)) return;
+
 	stream::len lenArchive = this->psArchive->size();
 	this->psArchive->seekg(0, stream::start);
 
 	stream::pos pos = 0;
-	unsigned int index = 0;
+	unsigned int iIndex = 0;
 	while (pos < lenArchive) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 		this->psArchive
 			>> nullPadded(fatEntry->strName, TIM_FILENAME_FIELD_LEN)
 			>> u32le(fatEntry->storedSize)
 		;
 		fatEntry->iOffset = pos;
-		fatEntry->iIndex = index++;
+		fatEntry->iIndex = iIndex++;
 		fatEntry->lenHeader = TIM_EFAT_ENTRY_LEN;
 		fatEntry->type = FILETYPE_GENERIC;
 		fatEntry->fAttr = 0;
@@ -162,6 +175,8 @@ TIMResourceArchive::TIMResourceArchive(stream::inout_sptr psArchive,
 		this->psArchive->seekg(fatEntry->storedSize, stream::cur);
 		pos += TIM_EFAT_ENTRY_LEN + fatEntry->storedSize;
 	}
+
+	this->saveIndex();
 }
 
 TIMResourceArchive::~TIMResourceArchive()
@@ -170,6 +185,7 @@ TIMResourceArchive::~TIMResourceArchive()
 
 void TIMResourceArchive::flush()
 {
+	this->prepareFlush();
 	this->psFAT->flush();
 	this->FATArchive::flush();
 	return;
@@ -43,6 +43,8 @@ class TIMResourceType: virtual public ArchiveType
 			SuppData& suppData) const;
 		virtual ArchivePtr open(stream::inout_sptr psArchive, SuppData& suppData)
 			const;
+		virtual ArchivePtr openIndexed(stream::inout_sptr psArchive,
+			SuppData& suppData, stream::inout_sptr index, uint64_t stamp) const;
 		virtual SuppFilenames getRequiredSupps(stream::input_sptr data,
 			const std::string& filenameArchive) const;
 };
@@ -53,7 +55,8 @@ class TIMResourceArchive: virtual public FATArchive
 		stream::seg_sptr psFAT;
 
 	public:
-		TIMResourceArchive(stream::inout_sptr psArchive, stream::inout_sptr psFAT);
+		TIMResourceArchive(stream::inout_sptr psArchive, stream::inout_sptr psFAT,
+			stream::inout_sptr index = stream::inout_sptr(), uint64_t stamp = 0);
 		virtual ~TIMResourceArchive();
 
 		virtual void flush();
@@ -128,7 +128,8 @@ SuppFilenames RFFType::getRequiredSupps(stream::input_sptr data,
 
 RFFArchive::RFFArchive(stream::inout_sptr psArchive)
 	:	FATArchive(psArchive, RFF_FIRST_FILE_OFFSET, ARCH_STD_DOS_FILENAMES),
-		modifiedFAT(false)
+		modifiedFAT(false),
+		offFATDisk(0)
 {
 	stream::pos lenArchive = this->psArchive->size();
 
@@ -144,6 +145,7 @@ RFFArchive::RFFArchive(stream::inout_sptr psArchive)
 		>> u16le(unknown1)
 		>> u32le(offFAT)
 		>> u32le(numFiles);
+	this->offFATDisk = offFAT;
 
 	if (numFiles >= RFF_SAFETY_MAX_FILECOUNT) {
 		// TESTED BY: test_rff_blood::invalidcontent_i01
@@ -182,7 +184,7 @@ RFFArchive::RFFArchive(stream::inout_sptr psArchive)
 	this->fatStream->seekg(0, stream::start);
 
 	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
+		FATEntryPtr fatEntry = FATArchive::newFATEntry();
 		EntryPtr ep(fatEntry);
 
 		fatEntry->iIndex = i;
@@ -284,6 +286,9 @@ void RFFArchive::setMetadata(MetadataType item, const std::string& value)
 			this->psArchive->seekg(4, stream::start);
 			this->psArchive << u16le(this->version);
 			this->psArchive << u16le(0); // TODO: write 1 here for 0x200?
+
+			// Only 3.1 encrypts the FAT, so it must be rewritten in the new form
+			this->modifiedFAT = true;
 			break;
 		}
 		default:
@@ -295,18 +300,33 @@ void RFFArchive::setMetadata(MetadataType item, const std::string& value)
 
 void RFFArchive::flush()
 {
+	// TESTED BY: fmt_rff_blood_rename_flush
+
+	// Open files may still hold reserved space that would move the FAT, and
+	// files that have moved may not have their new offsets in the cache yet
+	this->prepareFlush();
+
+	// The FAT lives immediately after the last file
+	uint32_t offFAT;
+	if (this->vcFAT.size() == 0) {
+		// No files
+		offFAT = RFF_FIRST_FILE_OFFSET;
+	} else {
+		const FATEntry *pLast = dynamic_cast<const FATEntry *>(this->vcFAT.back().get());
+		assert(pLast);
+		this->resolveEntry(pLast);
+		offFAT = pLast->iOffset + pLast->lenHeader + pLast->storedSize;
+	}
+
+	// The FAT is encrypted with a key seeded from its own offset, so if it has
+	// to move then every record must be re-encrypted, not just the dirty ones.
+	if ((!this->dirtyRecords.empty()) && (offFAT != this->offFATDisk)) {
+		this->modifiedFAT = true;
+	}
+
 	if (this->modifiedFAT) {
 
 		// Write the new FAT offset into the file header
-		uint32_t offFAT;
-		if (this->vcFAT.size() == 0) {
-			// No files
-			offFAT = RFF_FIRST_FILE_OFFSET;
-		} else {
-			const FATEntry *pLast = dynamic_cast<const FATEntry *>(this->vcFAT.back().get());
-			assert(pLast);
-			offFAT = pLast->iOffset + pLast->lenHeader + pLast->storedSize;
-		}
 		this->psArchive->seekp(RFF_FATOFFSET_OFFSET, stream::start);
 		this->psArchive << u32le(offFAT);
 
@@ -363,14 +383,53 @@ void RFFArchive::flush()
 		this->psArchive->seekp(RFF_FATOFFSET_OFFSET, stream::start);
 		this->psArchive << u32le(offFAT);
 
+		this->offFATDisk = offFAT;
 		this->modifiedFAT = false;
+
+	} else if (!this->dirtyRecords.empty()) {
+		// Only some records were changed in place, so leave the rest alone
+		this->writeDirtyRecords();
 	}
+	this->dirtyRecords.clear();
 
 	// Commit this->psArchive
 	this->FATArchive::flush();
 	return;
 }
 
+void RFFArchive::writeDirtyRecords()
+{
+	// TESTED BY: fmt_rff_blood_rename_flush
+	std::vector<uint8_t> plain, crypt;
+	std::set<unsigned int>::const_iterator i = this->dirtyRecords.begin();
+	while (i != this->dirtyRecords.end()) {
+		// Group adjacent records so each run is a single read and write
+		unsigned int first = *i, last = first;
+		for (i++; (i != this->dirtyRecords.end()) && (*i == last + 1); i++) last = *i;
+
+		stream::pos offRun = first * RFF_FAT_ENTRY_LEN;
+		stream::len lenRun = (last - first + 1) * RFF_FAT_ENTRY_LEN;
+		plain.resize(lenRun);
+		this->fatStream->seekg(offRun, stream::start);
+		this->fatStream->read(&plain[0], lenRun);
+
+		this->psArchive->seekp(this->offFATDisk + offRun, stream::start);
+		if (this->version >= 0x301) {
+			// Pick the key stream up part way through, where this run begins
+			filter_rff_crypt fatCrypt(0, this->offFATDisk & 0xFF);
+			fatCrypt.reset(lenRun);
+			fatCrypt.setOffset(offRun);
+			crypt.resize(lenRun);
+			stream::len lenIn = lenRun, lenOut = lenRun;
+			fatCrypt.transform(&crypt[0], &lenOut, &plain[0], &lenIn);
+			this->psArchive->write(&crypt[0], lenRun);
+		} else {
+			this->psArchive->write(&plain[0], lenRun);
+		}
+	}
+	return;
+}
+
 void RFFArchive::updateFileName(const FATEntry *pid, const std::string& strNewName)
 {
 	// TESTED BY: fmt_rff_blood_rename
@@ -386,7 +445,7 @@ void RFFArchive::updateFileName(const FATEntry *pid, const std::string& strNewNa
 		<< nullPadded(ext, 3)
 		<< nullPadded(base, 8);
 
-	this->modifiedFAT = true;
+	this->dirtyRecords.insert(pid->iIndex);
 	return;
 }
 
@@ -396,7 +455,7 @@ void RFFArchive::updateFileOffset(const FATEntry *pid, stream::delta offDelta)
 	// TESTED BY: fmt_rff_blood_resize*
 	this->fatStream->seekp(RFF_FILEOFFSET_OFFSET(pid), stream::start);
 	this->fatStream << u32le(pid->iOffset);
-	this->modifiedFAT = true;
+	this->dirtyRecords.insert(pid->iIndex);
 	return;
 }
 
@@ -406,7 +465,7 @@ void RFFArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 	// TESTED BY: fmt_rff_blood_resize*
 	this->fatStream->seekp(RFF_FILESIZE_OFFSET(pid), stream::start);
 	this->fatStream << u32le(pid->storedSize);
-	this->modifiedFAT = true;
+	this->dirtyRecords.insert(pid->iIndex);
 	return;
 }
 
@@ -468,12 +527,37 @@ void RFFArchive::preRemoveFile(const FATEntry *pid)
 	return;
 }
 
+bool RFFArchive::moveFATEntry(const FATEntry *pid, unsigned int newIndex)
+{
+	// TESTED BY: fmt_rff_blood_move
+	FATArchive::moveRecord(this->fatStream, 0, RFF_FAT_ENTRY_LEN, pid->iIndex,
+		newIndex);
+	this->modifiedFAT = true;
+	return true;
+}
+
 void RFFArchive::postRemoveFile(const FATEntry *pid)
 {
 	this->updateFileCount(this->vcFAT.size());
 	return;
 }
 
+bool RFFArchive::detachFAT()
+{
+	// TESTED BY: test_archive::test_deferred_fat
+
+	// The cleartext FAT is already held in fatStream, so the copy in the
+	// archive can go.  Nothing is kept after the FAT, so cut off everything
+	// following the last file.
+	stream::pos offFAT = this->getDescOffset();
+	this->psArchive->seekp(offFAT, stream::start);
+	this->psArchive->remove(this->psArchive->size() - offFAT);
+
+	// flush() puts back the whole FAT when this is set
+	this->modifiedFAT = true;
+	return true;
+}
+
 void RFFArchive::updateFileCount(uint32_t newCount)
 {
 	this->psArchive->seekp(RFF_FILECOUNT_OFFSET, stream::start);
@@ -488,6 +572,7 @@ stream::pos RFFArchive::getDescOffset() const
 		EntryPtr lastFile = this->vcFAT.back();
 		assert(lastFile);
 		FATEntry *lastFATEntry = dynamic_cast<FATEntry *>(lastFile.get());
+		this->resolveEntry(lastFATEntry);
 		offDesc = lastFATEntry->iOffset + lastFATEntry->storedSize;
 	} else {
 		offDesc = RFF_FIRST_FILE_OFFSET;
@@ -21,6 +21,7 @@
 #ifndef _CAMOTO_FMT_RFF_BLOOD_HPP_
 #define _CAMOTO_FMT_RFF_BLOOD_HPP_
 
+#include <set>
 #include <camoto/gamearchive/archivetype.hpp>
 #include <camoto/stream_seg.hpp>
 #include <camoto/stream_filtered.hpp>
@@ -71,15 +72,26 @@ class RFFArchive: virtual public FATArchive
 			FATEntry *pNewEntry);
 		virtual void postInsertFile(FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
+		virtual bool moveFATEntry(const FATEntry *pid, unsigned int newIndex);
 		virtual void postRemoveFile(const FATEntry *pid);
+		virtual bool detachFAT();
 
 	protected:
 		stream::seg_sptr fatStream;  ///< In-memory stream storing the cleartext FAT
 		uint32_t version;            ///< File format version
-		bool modifiedFAT;            ///< Has the FAT been changed?
+		bool modifiedFAT;            ///< Does the whole FAT need rewriting?
+		uint32_t offFATDisk;         ///< FAT offset (and crypt seed) on disk
+		std::set<unsigned int> dirtyRecords; ///< Records changed in place
 
 		void updateFileCount(uint32_t newCount);
 
+		/// Re-encrypt only the FAT records listed in dirtyRecords.
+		/**
+		 * Only valid when the FAT is still at offFATDisk and no records have
+		 * been added, removed or reordered since it was last written.
+		 */
+		void writeDirtyRecords();
+
 		stream::pos getDescOffset() const;
 
 		void splitFilename(const std::string& full, std::string *base,
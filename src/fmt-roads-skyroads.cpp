@@ -149,7 +149,7 @@ SkyRoadsRoadsArchive::SkyRoadsRoadsArchive(stream::inout_sptr psArchive)
 		this->vcFAT.reserve(numFiles);
 
 		for (int i = 0; i < numFiles; i++) {
-			FATEntry *fatEntry = new FATEntry();
+			FATEntryPtr fatEntry = FATArchive::newFATEntry();
 			EntryPtr ep(fatEntry);
 
 			uint16_t lenDecomp, offNext;
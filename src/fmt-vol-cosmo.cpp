@@ -25,6 +25,8 @@
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "archivebuild.hpp"
+#include "fatschema.hpp"
 #include "fmt-vol-cosmo.hpp"
 
 #define VOL_MAX_FILES         200
@@ -36,6 +38,11 @@
 namespace camoto {
 namespace gamearchive {
 
+// Fields within each FAT record
+typedef FATFieldString< 0, VOL_MAX_FILENAME_LEN> VOLFieldName;
+typedef FATFieldInt   <12, 4> VOLFieldOffset;
+typedef FATFieldInt   <16, 4> VOLFieldSize;
+
 VOLType::VOLType()
 {
 }
@@ -138,6 +145,31 @@ ArchivePtr VOLType::newArchive(stream::inout_sptr psArchive, SuppData& suppData)
 	return ArchivePtr(new VOLArchive(psArchive));
 }
 
+ArchivePtr VOLType::build(stream::inout_sptr psArchive, SuppData& suppData,
+	const BuildList& files, const BuildMetadata& metadata) const
+{
+	// TESTED BY: test_archive::test_new_build
+	if (!metadata.empty()) {
+		throw stream::error("VOL files have no metadata");
+	}
+	std::vector<stream::len> lenData;
+	stream::len lenTotal = measureBuildList(files, VOL_MAX_FILENAME_LEN,
+		VOL_MAX_FILES, &lenData);
+
+	// The FAT is always the same size, with any unused entries left blank
+	std::vector<uint8_t> head(VOL_FAT_LENGTH, 0);
+	stream::pos offFile = VOL_FIRST_FILE_OFFSET;
+	for (unsigned int i = 0; i < files.size(); i++) {
+		uint8_t *record = &head[i * VOL_FAT_ENTRY_LEN];
+		VOLFieldName::set(record, boost::to_upper_copy(files[i].name));
+		VOLFieldOffset::set(record, offFile);
+		VOLFieldSize::set(record, lenData[i]);
+		offFile += lenData[i];
+	}
+	writeBuild(psArchive, head, files, lenTotal);
+	return ArchivePtr(new VOLArchive(psArchive));
+}
+
 ArchivePtr VOLType::open(stream::inout_sptr psArchive, SuppData& suppData) const
 {
 	return ArchivePtr(new VOLArchive(psArchive));
@@ -166,19 +198,25 @@ VOLArchive::VOLArchive(stream::inout_sptr psArchive)
 		uint32_t lenFAT;
 		this->psArchive >> u32le(lenFAT);
 
+		// Make sure the whole FAT is there before allocating room for it
+		if (lenFAT > lenArchive) {
+			throw stream::error("FAT runs past the end of the file");
+		}
+
 		uint32_t numFiles = lenFAT / VOL_FAT_ENTRY_LEN;
 		this->vcFAT.reserve(numFiles);
 
-		this->psArchive->seekg(0, stream::start);
+		std::vector<uint8_t> fat;
+		readFATRecords(this->psArchive, 0, numFiles, VOL_FAT_ENTRY_LEN, &fat);
+
 		for (unsigned int i = 0; i < numFiles; i++) {
-			FATEntry *fatEntry = new FATEntry();
+			FATEntryPtr fatEntry = FATArchive::newFATEntry();
 			EntryPtr ep(fatEntry);
 
-			this->psArchive
-				>> nullPadded(fatEntry->strName, VOL_MAX_FILENAME_LEN)
-				>> u32le(fatEntry->iOffset)
-				>> u32le(fatEntry->storedSize)
-			;
+			const uint8_t *record = &fat[i * VOL_FAT_ENTRY_LEN];
+			fatEntry->strName = VOLFieldName::get(record);
+			fatEntry->iOffset = VOLFieldOffset::get(record);
+			fatEntry->storedSize = VOLFieldSize::get(record);
 
 			fatEntry->iIndex = i;
 			fatEntry->lenHeader = 0;
@@ -202,8 +240,8 @@ void VOLArchive::updateFileName(const FATEntry *pid, const std::string& strNewNa
 {
 	// TESTED BY: fmt_vol_cosmo_rename
 	assert(strNewName.length() <= VOL_MAX_FILENAME_LEN);
-	this->psArchive->seekp(pid->iIndex * VOL_FAT_ENTRY_LEN, stream::start);
-	this->psArchive << nullPadded(strNewName, VOL_MAX_FILENAME_LEN);
+	VOLFieldName::update(this->psArchive, pid->iIndex * VOL_FAT_ENTRY_LEN,
+		strNewName);
 	return;
 }
 
@@ -211,8 +249,8 @@ void VOLArchive::updateFileOffset(const FATEntry *pid, stream::delta offDelta)
 {
 	// TESTED BY: fmt_vol_cosmo_insert*
 	// TESTED BY: fmt_vol_cosmo_resize*
-	this->psArchive->seekp(pid->iIndex * VOL_FAT_ENTRY_LEN + 12, stream::start);
-	this->psArchive << u32le(pid->iOffset);
+	VOLFieldOffset::update(this->psArchive, pid->iIndex * VOL_FAT_ENTRY_LEN,
+		pid->iOffset);
 	return;
 }
 
@@ -220,8 +258,8 @@ void VOLArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 {
 	// TESTED BY: fmt_vol_cosmo_insert*
 	// TESTED BY: fmt_vol_cosmo_resize*
-	this->psArchive->seekp(pid->iIndex * VOL_FAT_ENTRY_LEN + 16, stream::start);
-	this->psArchive << u32le(pid->storedSize);
+	VOLFieldSize::update(this->psArchive, pid->iIndex * VOL_FAT_ENTRY_LEN,
+		pid->storedSize);
 	return;
 }
 
@@ -254,6 +292,7 @@ FATArchive::FATEntry *VOLArchive::preInsertFile(const FATEntry *idBeforeThis,
 		unsigned int indexLast = VOL_MAX_FILES - 1;
 		for (VC_ENTRYPTR::reverse_iterator i = this->vcFAT.rbegin(); i != this->vcFAT.rend(); i++) {
 			FATEntry *pFAT = dynamic_cast<FATEntry *>(i->get());
+			this->resolveEntry(pFAT);
 			if (pFAT->iIndex != indexLast) {
 				// The previous slot is free, so delete it
 				this->psArchive->seekp(indexLast * VOL_FAT_ENTRY_LEN, stream::start);
@@ -288,6 +327,7 @@ void VOLArchive::preRemoveFile(const FATEntry *pid)
 
 	// Add an empty FAT entry onto the end to keep the FAT the same size
 	const FATEntry *pFAT = dynamic_cast<const FATEntry *>(this->vcFAT.back().get());
+	this->resolveEntry(pFAT);
 	this->psArchive->seekp((pFAT->iIndex + 1) * VOL_FAT_ENTRY_LEN, stream::start);
 	this->psArchive->insert(VOL_FAT_ENTRY_LEN);
 
@@ -25,6 +25,8 @@
 #include <camoto/iostream_helpers.hpp>
 #include <camoto/util.hpp>
 
+#include "archivebuild.hpp"
+#include "fatschema.hpp"
 #include "fmt-wad-doom.hpp"
 
 #define WAD_FILECOUNT_OFFSET    4
@@ -39,13 +41,18 @@
 
 #define WAD_FATENTRY_OFFSET(e) (WAD_HEADER_LEN + e->iIndex * WAD_FAT_ENTRY_LEN)
 
-#define WAD_FILEOFFSET_OFFSET(e) WAD_FATENTRY_OFFSET(e)
-#define WAD_FILESIZE_OFFSET(e) (WAD_FATENTRY_OFFSET(e) + 4)
-#define WAD_FILENAME_OFFSET(e) (WAD_FATENTRY_OFFSET(e) + 8)
-
 namespace camoto {
 namespace gamearchive {
 
+// Fields within each FAT record
+typedef FATFieldInt   <0, 4> WADFieldOffset;
+typedef FATFieldInt   <4, 4> WADFieldSize;
+typedef FATFieldString<8, WAD_FILENAME_FIELD_LEN> WADFieldName;
+
+// Fields within the header
+typedef FATFieldInt   <WAD_FILECOUNT_OFFSET, 4> WADFieldFileCount;
+typedef FATFieldInt   <WAD_FILECOUNT_OFFSET + 4, 4> WADFieldFATOffset;
+
 WADType::WADType()
 {
 }
@@ -113,6 +120,44 @@ ArchivePtr WADType::newArchive(stream::inout_sptr psArchive, SuppData& suppData)
 	return ArchivePtr(new WADArchive(psArchive));
 }
 
+ArchivePtr WADType::build(stream::inout_sptr psArchive, SuppData& suppData,
+	const BuildList& files, const BuildMetadata& metadata) const
+{
+	// TESTED BY: test_archive::test_new_build
+	char wadType = 'I';
+	for (BuildMetadata::const_iterator
+		i = metadata.begin(); i != metadata.end(); i++
+	) {
+		if (i->first != Metadata::Version) {
+			throw stream::error("WAD files only have a version");
+		}
+		if ((i->second.compare("I") != 0) && (i->second.compare("P") != 0)) {
+			throw stream::error("Version can only be set to I or P for IWAD or PWAD");
+		}
+		wadType = i->second[0];
+	}
+	std::vector<stream::len> lenData;
+	stream::len lenTotal = measureBuildList(files, WAD_MAX_FILENAME_LEN,
+		WAD_SAFETY_MAX_FILECOUNT - 1, &lenData);
+
+	// The FAT goes straight after the header, with the files following it
+	std::vector<uint8_t> head(WAD_FAT_OFFSET + files.size() * WAD_FAT_ENTRY_LEN);
+	head[0] = wadType;
+	memcpy(&head[1], "WAD", 3);
+	WADFieldFileCount::set(&head[0], files.size());
+	WADFieldFATOffset::set(&head[0], WAD_FAT_OFFSET);
+	stream::pos offFile = head.size();
+	for (unsigned int i = 0; i < files.size(); i++) {
+		uint8_t *record = &head[WAD_FAT_OFFSET + i * WAD_FAT_ENTRY_LEN];
+		WADFieldOffset::set(record, offFile);
+		WADFieldSize::set(record, lenData[i]);
+		WADFieldName::set(record, boost::to_upper_copy(files[i].name));
+		offFile += lenData[i];
+	}
+	writeBuild(psArchive, head, files, lenTotal);
+	return ArchivePtr(new WADArchive(psArchive));
+}
+
 ArchivePtr WADType::open(stream::inout_sptr psArchive, SuppData& suppData) const
 {
 	return ArchivePtr(new WADArchive(psArchive));
@@ -145,27 +190,13 @@ WADArchive::WADArchive(stream::inout_sptr psArchive)
 		throw stream::error("too many files or corrupted archive");
 	}
 
-	this->psArchive->seekg(offFAT, stream::start);
-	for (unsigned int i = 0; i < numFiles; i++) {
-		FATEntry *fatEntry = new FATEntry();
-		EntryPtr ep(fatEntry);
-
-		fatEntry->iIndex = i;
-		fatEntry->lenHeader = 0;
-		fatEntry->type = FILETYPE_GENERIC;
-		fatEntry->fAttr = 0;
-		fatEntry->bValid = true;
-
-		// Read the data in from the FAT entry in the file
-		this->psArchive
-			>> u32le(fatEntry->iOffset)
-			>> u32le(fatEntry->storedSize)
-			>> nullPadded(fatEntry->strName, WAD_FILENAME_FIELD_LEN)
-		;
-
-		fatEntry->realSize = fatEntry->storedSize;
-		this->vcFAT.push_back(ep);
+	// The FAT is only read as files are looked up, so make sure it's all there
+	if ((stream::pos)offFAT + numFiles * WAD_FAT_ENTRY_LEN
+		> this->psArchive->size()
+	) {
+		throw stream::error("FAT runs past the end of the file");
 	}
+	this->setLazyFAT(numFiles, offFAT, WAD_FAT_ENTRY_LEN);
 }
 
 WADArchive::~WADArchive()
@@ -222,8 +253,7 @@ void WADArchive::updateFileName(const FATEntry *pid, const std::string& strNewNa
 {
 	// TESTED BY: fmt_wad_doom_rename
 	assert(strNewName.length() <= WAD_MAX_FILENAME_LEN);
-	this->psArchive->seekp(WAD_FILENAME_OFFSET(pid), stream::start);
-	this->psArchive << nullPadded(strNewName, WAD_FILENAME_FIELD_LEN);
+	WADFieldName::update(this->psArchive, WAD_FATENTRY_OFFSET(pid), strNewName);
 	return;
 }
 
@@ -231,8 +261,8 @@ void WADArchive::updateFileOffset(const FATEntry *pid, stream::delta offDelta)
 {
 	// TESTED BY: fmt_wad_doom_insert*
 	// TESTED BY: fmt_wad_doom_resize*
-	this->psArchive->seekp(WAD_FILEOFFSET_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->iOffset);
+	WADFieldOffset::update(this->psArchive, WAD_FATENTRY_OFFSET(pid),
+		pid->iOffset);
 	return;
 }
 
@@ -240,8 +270,8 @@ void WADArchive::updateFileSize(const FATEntry *pid, stream::delta sizeDelta)
 {
 	// TESTED BY: fmt_wad_doom_insert*
 	// TESTED BY: fmt_wad_doom_resize*
-	this->psArchive->seekp(WAD_FILESIZE_OFFSET(pid), stream::start);
-	this->psArchive << u32le(pid->storedSize);
+	WADFieldSize::update(this->psArchive, WAD_FATENTRY_OFFSET(pid),
+		pid->storedSize);
 	return;
 }
 
@@ -300,6 +330,39 @@ void WADArchive::preRemoveFile(const FATEntry *pid)
 	return;
 }
 
+bool WADArchive::canBeSparse() const
+{
+	// Files are only located by their FAT offsets, so gaps are harmless
+	return true;
+}
+
+void WADArchive::loadFATEntry(const uint8_t *record, FATEntry *fatEntry) const
+{
+	fatEntry->lenHeader = 0;
+	fatEntry->type = FILETYPE_GENERIC;
+	fatEntry->fAttr = 0;
+
+	fatEntry->iOffset = WADFieldOffset::get(record);
+	fatEntry->storedSize = WADFieldSize::get(record);
+	fatEntry->strName = WADFieldName::get(record);
+
+	fatEntry->realSize = fatEntry->storedSize;
+	return;
+}
+
+std::string WADArchive::loadFATName(const uint8_t *record) const
+{
+	return WADFieldName::get(record);
+}
+
+bool WADArchive::moveFATEntry(const FATEntry *pid, unsigned int newIndex)
+{
+	// TESTED BY: fmt_wad_doom_move
+	FATArchive::moveRecord(this->psArchive, WAD_FAT_OFFSET, WAD_FAT_ENTRY_LEN,
+		pid->iIndex, newIndex);
+	return true;
+}
+
 void WADArchive::updateFileCount(uint32_t iNewCount)
 {
 	// TESTED BY: fmt_wad_doom_insert*
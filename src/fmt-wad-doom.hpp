@@ -41,6 +41,8 @@ class WADType: virtual public ArchiveType
 			const;
 		virtual ArchivePtr newArchive(stream::inout_sptr psArchive,
 			SuppData& suppData) const;
+		virtual ArchivePtr build(stream::inout_sptr psArchive, SuppData& suppData,
+			const BuildList& files, const BuildMetadata& metadata) const;
 		virtual ArchivePtr open(stream::inout_sptr fsArchive, SuppData& suppData)
 			const;
 		virtual SuppFilenames getRequiredSupps(stream::input_sptr data,
@@ -64,6 +66,10 @@ class WADArchive: virtual public FATArchive
 		virtual FATEntry *preInsertFile(const FATEntry *idBeforeThis,
 			FATEntry *pNewEntry);
 		virtual void preRemoveFile(const FATEntry *pid);
+		virtual bool canBeSparse() const;
+		virtual void loadFATEntry(const uint8_t *record, FATEntry *pEntry) const;
+		virtual std::string loadFATName(const uint8_t *record) const;
+		virtual bool moveFATEntry(const FATEntry *pid, unsigned int newIndex);
 
 	protected:
 		// Update the header with the number of files in the archive
@@ -47,13 +47,15 @@ Archive::EntryPtr findFile(ArchivePtr& archive,
 		unsigned long index = strtoul(&(filename.c_str()[1]), &endptr, 10);
 		if (*endptr == '\0') {
 			// The number was entirely valid (no junk at end)
-			Archive::VC_ENTRYPTR files = archive->getFileList();
+			const Archive::VC_ENTRYPTR& files = archive->getFileList();
 			if (index < files.size()) return files[index];
 			throw stream::error("index too large");
 		}
 	}
 
-	// Filename isn't an index, see if it matches a name
+	// Filename isn't an index, see if it matches a name.  FAT-based archives
+	// keep a filename index, so this and each path component below is a hash
+	// lookup rather than a scan of the whole file list.
 	Archive::EntryPtr id = archive->find(filename);
 	if (archive->isValid(id)) return id;
 
@@ -63,27 +63,47 @@ class test_archive: public test_main
 
 		void test_isinstance_others();
 		void test_open();
+		void test_find_then_list();
+		void test_open_indexed();
 		void test_rename();
+		void test_rename_flush();
+		void test_find();
 		void test_rename_long();
 		void test_insert_long();
 		void test_insert_mid();
 		void test_insert_end();
+		void test_insert_src();
 		void test_insert2();
 		void test_remove();
 		void test_remove2();
 		void test_insert_remove();
 		void test_remove_insert();
 		void test_move();
+		void test_move_back();
 		void test_resize_larger();
 		void test_resize_smaller();
 		void test_resize_write();
+		void test_write_growing();
+		void test_write_growing_flush();
+		void test_open_shift();
+		void test_compact();
+		void test_flush_to();
+		void test_flush_to_write();
+		void test_sparse_layout();
+		void test_sparse_zero_length();
+		void test_dedup();
+		void test_deferred_fat();
 		void test_remove_all_re_add();
 		void test_insert_zero_then_resize();
 		void test_resize_over64k();
+		void test_transaction_commit();
+		void test_transaction_abort();
+		void test_transaction_abort_write();
 		void test_shortext();
 
 		void test_new_isinstance();
 		void test_new_to_initialstate();
+		void test_new_build();
 		void test_new_manipulate_zero_length_files();
 
 		void test_metadata_get_desc();
@@ -97,4 +97,54 @@ BOOST_AUTO_TEST_CASE(got_lzss_read_short)
 		"Compressing a little GoT data failed");
 }
 
+BOOST_AUTO_TEST_CASE(got_lzss_repeat)
+{
+	BOOST_TEST_MESSAGE("Compress repeated GoT data");
+
+	this->in << "ABABABAB";
+
+	BOOST_CHECK_MESSAGE(is_equal(STRING_WITH_NULLS(
+		"\x08\x00\x01\x00"
+		"\xFB""AB""\x02\x40"
+	)),
+		"Compressing repeated GoT data failed");
+}
+
+BOOST_AUTO_TEST_CASE(got_lzss_roundtrip)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress a larger block of GoT data");
+
+	std::string plain;
+	for (int i = 0; i < 2000; i++) {
+		plain += createString("Line " << (i % 300) << " of the test data\n");
+	}
+	plain.resize(60000, 'x');
+	this->in << plain;
+
+	stream::string_sptr packed(new stream::string());
+	this->in_filt->open(this->in, this->filter);
+	stream::copy(packed, this->in_filt);
+	BOOST_CHECK_LT(packed->size(), plain.size() / 2);
+
+	stream::input_filtered_sptr unpack(new stream::input_filtered());
+	unpack->open(packed, filter_sptr(new filter_got_unlzss()));
+	stream::string_sptr out(new stream::string());
+	stream::copy(out, unpack);
+
+	BOOST_CHECK_MESSAGE(this->test_main::is_equal(plain, *(out->str())),
+		"Round trip through GoT compression failed");
+}
+
+BOOST_AUTO_TEST_CASE(got_lzss_too_long)
+{
+	BOOST_TEST_MESSAGE("Give the GoT compressor more data than expected");
+
+	const uint8_t in[] = "ABCDEFGH";
+	uint8_t out[64];
+	stream::len lenIn = 8, lenOut = sizeof(out);
+	this->filter->reset(4);
+	BOOST_CHECK_THROW(this->filter->transform(out, &lenOut, in, &lenIn),
+		filter_error);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,134 @@
+/**
+ * @file   test-filter-skyroads.cpp
+ * @brief  Test code for SkyRoads LZS packer/unpacker.
+ *
+ * Copyright (C) 2010-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <camoto/stream_string.hpp>
+#include <camoto/stream_filtered.hpp>
+#include <camoto/util.hpp>
+#include "../src/filter-skyroads.hpp"
+#include "test-filter.hpp"
+
+using namespace camoto;
+using namespace camoto::gamearchive;
+
+struct skyroads_lzs_sample: public test_filter {
+	skyroads_lzs_sample()
+	{
+		this->filter.reset(new filter_skyroads_lzs());
+	}
+
+	/// Compress then decompress some data, checking it comes back unchanged.
+	/**
+	 * @param plain
+	 *   Data to compress.
+	 *
+	 * @param compressible
+	 *   true to also check the data shrinks to less than half its size.
+	 */
+	boost::test_tools::predicate_result is_roundtrip(const std::string& plain,
+		bool compressible = true)
+	{
+		stream::string_sptr src(new stream::string());
+		src << plain;
+
+		stream::string_sptr packed(new stream::string());
+		stream::input_filtered_sptr pack(new stream::input_filtered());
+		pack->open(src, this->filter);
+		stream::copy(packed, pack);
+		if (compressible) BOOST_CHECK_LT(packed->size(), plain.size() / 2);
+
+		stream::input_filtered_sptr unpack(new stream::input_filtered());
+		unpack->open(packed, filter_sptr(new filter_skyroads_unlzs()));
+		stream::string_sptr out(new stream::string());
+		stream::copy(out, unpack);
+
+		return this->test_main::is_equal(plain, *(out->str()));
+	}
+};
+
+/// Text with plenty of near and distant repeats.
+static std::string sampleText()
+{
+	std::string plain;
+	for (int i = 0; i < 1500; i++) {
+		plain += createString("Road " << (i % 97) << ", tile " << (i % 13) << "\n");
+	}
+	return plain;
+}
+
+BOOST_FIXTURE_TEST_SUITE(skyroads_lzs_suite, skyroads_lzs_sample)
+
+BOOST_AUTO_TEST_CASE(skyroads_lzs_repeat)
+{
+	BOOST_TEST_MESSAGE("Compress repeated SkyRoads data");
+
+	this->in << "ABABABAB";
+
+	// Two literals then a six byte match two bytes back, 36 bits in all, then
+	// the padding and the zero byte that ends the data
+	BOOST_CHECK_MESSAGE(is_equal(STRING_WITH_NULLS(
+		"\x06\x09\x0C"
+		"\xD0\x74\x20\x00\x40"
+		"\x00"
+	)),
+		"Compressing repeated SkyRoads data failed");
+}
+
+BOOST_AUTO_TEST_CASE(skyroads_lzs_roundtrip)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress SkyRoads data");
+
+	BOOST_CHECK_MESSAGE(is_roundtrip(sampleText()),
+		"Round trip through SkyRoads compression failed");
+}
+
+BOOST_AUTO_TEST_CASE(skyroads_lzs_roundtrip_greedy)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress SkyRoads data without lazy "
+		"matching");
+
+	this->filter.reset(new filter_skyroads_lzs(false));
+	BOOST_CHECK_MESSAGE(is_roundtrip(sampleText()),
+		"Round trip through SkyRoads compression without lazy matching failed");
+}
+
+BOOST_AUTO_TEST_CASE(skyroads_lzs_roundtrip_lengths)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress SkyRoads data of many lengths");
+
+	// The last code can end anywhere within the final byte, so try enough
+	// lengths and contents to land on every bit position
+	uint32_t seed = 1;
+	for (unsigned int len = 0; len < 400; len++) {
+		std::string plain;
+		for (unsigned int i = 0; i < len; i++) {
+			seed = seed * 1103515245 + 12345;
+			plain += (char)('a' + ((seed >> 16) % 5));
+		}
+		for (int lazy = 0; lazy < 2; lazy++) {
+			this->filter.reset(new filter_skyroads_lzs(lazy));
+			BOOST_REQUIRE_MESSAGE(is_roundtrip(plain, false),
+				"Round trip through SkyRoads compression failed for "
+				<< len << " bytes" << (lazy ? "" : " without lazy matching"));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
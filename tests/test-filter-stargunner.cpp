@@ -0,0 +1,165 @@
+/**
+ * @file   test-filter-stargunner.cpp
+ * @brief  Test code for Stargunner compression.
+ *
+ * Copyright (C) 2010-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <camoto/stream_string.hpp>
+#include <camoto/stream_filtered.hpp>
+#include <camoto/util.hpp>
+#include "../src/filter-stargunner.hpp"
+#include "test-filter.hpp"
+
+using namespace camoto;
+using namespace camoto::gamearchive;
+
+struct stargunner_bpe_sample: public test_filter {
+	stargunner_bpe_sample()
+	{
+		this->filter.reset(new filter_stargunner_compress());
+	}
+
+	/// Compress then decompress some data, checking it comes back unchanged.
+	/**
+	 * @param maxSize
+	 *   Largest acceptable size for the compressed data.
+	 */
+	boost::test_tools::predicate_result is_roundtrip(const std::string& plain,
+		stream::len maxSize)
+	{
+		this->in << plain;
+
+		stream::string_sptr packed(new stream::string());
+		this->in_filt->open(this->in, this->filter);
+		stream::copy(packed, this->in_filt);
+		BOOST_CHECK_LE(packed->size(), maxSize);
+
+		stream::input_filtered_sptr unpack(new stream::input_filtered());
+		unpack->open(packed, filter_sptr(new filter_stargunner_decompress()));
+		stream::string_sptr out(new stream::string());
+		stream::copy(out, unpack);
+
+		return this->test_main::is_equal(plain, *(out->str()));
+	}
+};
+
+/// Text spread over several chunks, with plenty of common pairs.
+static std::string sampleText()
+{
+	std::string plain;
+	for (int i = 0; i < 600; i++) {
+		plain += createString("Level " << (i % 31) << ", wave " << (i % 7) << "\n");
+	}
+	return plain;
+}
+
+BOOST_FIXTURE_TEST_SUITE(stargunner_bpe_suite, stargunner_bpe_sample)
+
+BOOST_AUTO_TEST_CASE(stargunner_bpe_pairs)
+{
+	BOOST_TEST_MESSAGE("Compress repeated pairs with Stargunner BPE");
+
+	this->in << "ABABABAB";
+
+	// "AB" becomes 0x00, then "\x00\x00" becomes 0x01, leaving two bytes
+	BOOST_CHECK_MESSAGE(is_equal(STRING_WITH_NULLS(
+		"PGBP" "\x08\x00\x00\x00"
+		"\x0C\x00"
+		"\x01" "AB" "\x00\x00" "\xFF" "\x82" "\xFC"
+		"\x02\x00" "\x01\x01"
+	)),
+		"Compressing repeated pairs with Stargunner BPE failed");
+}
+
+BOOST_AUTO_TEST_CASE(stargunner_bpe_roundtrip)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress Stargunner data");
+
+	std::string plain = sampleText();
+	BOOST_CHECK_MESSAGE(is_roundtrip(plain, plain.length() / 2),
+		"Round trip through Stargunner compression failed");
+}
+
+BOOST_AUTO_TEST_CASE(stargunner_bpe_roundtrip_run)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress long runs of one byte");
+
+	// Pairs of pairs nest quickly here, so this checks that no codeword ends
+	// up too deep for the decompressor to expand
+	std::string plain(3 * CHUNK_SIZE + 100, 'x');
+	BOOST_CHECK_MESSAGE(is_roundtrip(plain, 256),
+		"Round trip of long runs through Stargunner compression failed");
+}
+
+BOOST_AUTO_TEST_CASE(stargunner_bpe_roundtrip_phrase)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress one long phrase repeated");
+
+	std::string phrase;
+	for (int i = 0; i < 200; i++) phrase += (char)('a' + (i * 7) % 26);
+	std::string plain;
+	for (int i = 0; i < 40; i++) plain += phrase;
+	BOOST_CHECK_MESSAGE(is_roundtrip(plain, plain.length() / 4),
+		"Round trip of a repeated phrase through Stargunner compression failed");
+}
+
+BOOST_AUTO_TEST_CASE(stargunner_bpe_roundtrip_deep)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress data that nests codewords "
+		"deeply");
+
+	// Every copy of the phrase starts with 0xFF, so "\xFF\x00" is merged
+	// first, and each new codeword is then the highest value in the most
+	// common pair, which joins it to the next byte of the phrase.  Every
+	// level of this chain leaves another byte waiting in the decompressor's
+	// expansion buffer, so the encoder must stop before that overflows.
+	std::string plain;
+	for (int i = 0; i < 4; i++) {
+		plain += '\xFF';
+		for (int j = 0; j < 60; j++) plain += (char)j;
+	}
+	BOOST_CHECK_MESSAGE(is_roundtrip(plain, plain.length()),
+		"Round trip of deeply nested data through Stargunner compression failed");
+}
+
+BOOST_AUTO_TEST_CASE(stargunner_bpe_roundtrip_random)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress data using every byte value");
+
+	// No spare byte values to use as codewords, so nothing can be compressed
+	std::string plain;
+	uint32_t seed = 1;
+	for (int i = 0; i < 2 * CHUNK_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		plain += (char)(seed >> 16);
+	}
+	BOOST_CHECK_MESSAGE(is_roundtrip(plain, 8 + 2 * (CHUNK_SIZE + 7)),
+		"Round trip of random data through Stargunner compression failed");
+}
+
+BOOST_AUTO_TEST_CASE(stargunner_bpe_empty)
+{
+	BOOST_TEST_MESSAGE("Compress empty Stargunner data");
+
+	BOOST_CHECK_MESSAGE(is_equal(STRING_WITH_NULLS(
+		"PGBP" "\x00\x00\x00\x00"
+	)),
+		"Compressing empty Stargunner data failed");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -73,6 +73,64 @@ BOOST_AUTO_TEST_CASE(rff_crypt_altseed_read)
 
 BOOST_AUTO_TEST_SUITE_END()
 
+/// Plaintext spanning the end of the encrypted part of an RFF file.
+static std::string rffPlain()
+{
+	std::string plain(260, '\x55');
+	return plain;
+}
+
+/// rffPlain() as stored in an RFF file.
+static std::string rffCrypt()
+{
+	std::string crypt = rffPlain();
+	for (unsigned int i = 0; i < 256; i++) crypt[i] ^= (char)(i >> 1);
+	return crypt;
+}
+
+BOOST_FIXTURE_TEST_SUITE(rff_stream_suite, test_filter)
+
+BOOST_AUTO_TEST_CASE(rff_crypt_stream_read)
+{
+	BOOST_TEST_MESSAGE("Decrypt a file longer than the encrypted part");
+
+	RFFFilterType filter;
+
+	BOOST_CHECK_MESSAGE(is_equal_read(&filter, rffCrypt(), rffPlain()),
+		"Decrypting RFF file failed");
+}
+
+BOOST_AUTO_TEST_CASE(rff_crypt_stream_write)
+{
+	BOOST_TEST_MESSAGE("Encrypt a file longer than the encrypted part");
+
+	RFFFilterType filter;
+
+	BOOST_CHECK_MESSAGE(is_equal_write(&filter, rffPlain(), rffCrypt()),
+		"Encrypting RFF file failed");
+}
+
+BOOST_AUTO_TEST_CASE(rff_crypt_stream_seek)
+{
+	BOOST_TEST_MESSAGE("Decrypt from part way through an RFF file");
+
+	RFFFilterType filter;
+	in << rffCrypt();
+	stream::input_sptr s = filter.apply(stream::input_sptr(in));
+
+	// Read across the end of the encrypted part
+	uint8_t buf[4];
+	s->seekg(254, stream::start);
+	s->read(buf, 4);
+
+	BOOST_CHECK_MESSAGE(
+		this->test_main::is_equal(rffPlain().substr(254, 4),
+			std::string((char *)buf, 4)),
+		"Decrypting RFF file after seeking failed");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
 BOOST_FIXTURE_TEST_SUITE(rff_encrypt_suite, test_main)
 
 BOOST_AUTO_TEST_CASE(rff_crypt_write_filteredstream)
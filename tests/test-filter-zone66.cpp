@@ -178,12 +178,41 @@ BOOST_AUTO_TEST_CASE(encode)
 {
 	BOOST_TEST_MESSAGE("Compress some data in Zone 66 format");
 
-	in << STRING_WITH_NULLS(DATA_DECODED_CAMOTO);
+	// 'A', then "AA" from the dictionary, then 'A' again, each followed by 'A'
+	in << "AAAAAAA";
 
-	BOOST_CHECK_MESSAGE(is_equal(STRING_WITH_NULLS(DATA_ENCODED_CAMOTO)),
+	BOOST_CHECK_MESSAGE(is_equal(STRING_WITH_NULLS(
+		"\x07\x00\x00\x00"
+		"\x20\xA0\xC0\x10\x48\x28\x20"
+	)),
 		"Compressing Zone 66 data failed");
 }
 
+BOOST_AUTO_TEST_CASE(encode_decode)
+{
+	BOOST_TEST_MESSAGE("Compress and decompress some data in Zone 66 format");
+
+	std::string src = STRING_WITH_NULLS(DATA_DECODED);
+	in << src;
+
+	stream::string_sptr out(new stream::string());
+	this->in_filt->open(this->in, this->filter);
+	stream::copy(out, this->in_filt);
+	this->in_filt.reset(new stream::input_filtered());
+
+	// Recompressing data shouldn't make it any bigger than the game's own
+	BOOST_CHECK_LE(out->size(),
+		STRING_WITH_NULLS(DATA_ENCODED).length());
+
+	this->in.reset(new stream::string());
+	out->seekg(0, stream::start);
+	stream::copy(in, out);
+
+	this->filter.reset(new filter_z66_decompress());
+	BOOST_CHECK_MESSAGE(is_equal(src),
+		"Compressing and decompressing Zone 66 data failed");
+}
+
 BOOST_AUTO_TEST_CASE(encode_decode_20k)
 {
 	BOOST_TEST_MESSAGE("Compress >20k bytes in Zone 66 format");
@@ -208,4 +237,32 @@ BOOST_AUTO_TEST_CASE(encode_decode_20k)
 		"Compressing >20k of Zone 66 data failed");
 }
 
+BOOST_AUTO_TEST_CASE(encode_decode_reset)
+{
+	BOOST_TEST_MESSAGE("Compress enough varied data to fill the Zone 66 "
+		"dictionary several times");
+
+	// Short strings that seldom repeat, so the dictionary fills quickly
+	std::string src;
+	uint32_t seed = 1;
+	for (unsigned int i = 0; i < 40000; i++) {
+		seed = seed * 1103515245 + 12345;
+		src += (char)('a' + ((seed >> 16) % 6));
+	}
+	in << src;
+
+	stream::string_sptr out(new stream::string());
+	this->in_filt->open(this->in, this->filter);
+	stream::copy(out, this->in_filt);
+	this->in_filt.reset(new stream::input_filtered());
+
+	this->in.reset(new stream::string());
+	out->seekg(0, stream::start);
+	stream::copy(in, out);
+
+	this->filter.reset(new filter_z66_decompress());
+	BOOST_CHECK_MESSAGE(is_equal(src),
+		"Compressing Zone 66 data across dictionary resets failed");
+}
+
 BOOST_AUTO_TEST_SUITE_END()